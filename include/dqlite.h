@@ -10,6 +10,15 @@
 #define DQLITE_MISUSE 2 /* Library used incorrectly */
 #define DQLITE_NOMEM 3  /* A malloc() failed */
 
+/**
+ * Extended SQLITE_BUSY code failing a write when the node is overloaded, that
+ * is when the raft log has too many entries not yet applied, or too many bytes
+ * of writes are in flight. Nothing was written, and clients should retry the
+ * transaction after a backoff, ideally growing with each attempt, rather than
+ * right away.
+ */
+#define DQLITE_OVERLOADED (5 /* SQLITE_BUSY */ | (40 << 8))
+
 /**
  * Dqlite node handle.
  *
@@ -123,6 +132,65 @@ int dqlite_node_set_connect_func(dqlite_node *n,
 int dqlite_node_set_network_latency(dqlite_node *n,
 				    unsigned long long nanoseconds);
 
+/**
+ * Maximum number of reader threads, see dqlite_node_set_reader_threads().
+ */
+#define DQLITE_MAX_READER_THREADS 64
+
+/**
+ * Set the number of threads running read-only queries.
+ *
+ * By default all queries run on the node's main loop thread, along with raft
+ * and writes, so a heavy query stalls everything else. With reader threads,
+ * batches of rows of read-only queries outside explicit transactions are
+ * produced on one of them instead.
+ *
+ * Reader threads don't hold connections of their own: a query is stepped on
+ * the connection of the client that issued it, so a single client connection
+ * still runs one query at a time, and parallelism comes from serving several
+ * clients. Offloaded reads are drained and held off while a snapshot is being
+ * restored.
+ *
+ * This function must be called before calling dqlite_node_start().
+ */
+int dqlite_node_set_reader_threads(dqlite_node *n, unsigned threads);
+
+/**
+ * Maximum query prefetch depth, see dqlite_node_set_query_prefetch().
+ */
+#define DQLITE_MAX_QUERY_PREFETCH 8
+
+/**
+ * Set the number of batches of rows of a query that a connection produces
+ * while a previous batch is still being written to the client.
+ *
+ * The default is 1, so stepping the query overlaps with sending its rows. Each
+ * additional batch costs a response buffer per connection, which bounds the
+ * memory used for slow clients. Zero makes stepping and writing alternate.
+ *
+ * This function must be called before calling dqlite_node_start().
+ */
+int dqlite_node_set_query_prefetch(dqlite_node *n, unsigned depth);
+
+/**
+ * Set the number of idle leader connections kept for each database, so clients
+ * opening a database reuse one instead of creating a new SQLite connection
+ * with its own schema and page cache. The default is 4, zero disables pooling.
+ *
+ * A connection is leased to a client only while the client is using it: it's
+ * given back to the pool as soon as the client has no request pending, unless
+ * the client has a transaction in progress or prepared statements on that
+ * database, since those belong to the connection. So clients sending plain SQL
+ * with exec_sql and query_sql share a few connections, however many they are.
+ *
+ * A client that sets a PRAGMA, attaches a database or creates a temporary
+ * object keeps its connection until it closes, and the connection is then
+ * closed rather than pooled, so no other client sees those changes.
+ *
+ * This function must be called before calling dqlite_node_start().
+ */
+int dqlite_node_set_leader_pool(dqlite_node *n, unsigned size);
+
 /**
  * Start a dqlite node.
  *
@@ -141,6 +209,176 @@ int dqlite_node_start(dqlite_node *n);
  */
 int dqlite_node_stop(dqlite_node *n);
 
+/**
+ * Number of buckets of a latency histogram.
+ */
+#define DQLITE_HISTOGRAM_BUCKETS 24
+
+/**
+ * Distribution of latencies. Bucket i counts the observations that took less
+ * than 2^i microseconds and more than the previous bucket bound, the last
+ * bucket counts all slower ones too.
+ */
+struct dqlite_histogram
+{
+	unsigned long long count; /* Number of observations */
+	unsigned long long sum;   /* Sum of all observations, in microseconds */
+	unsigned long long buckets[DQLITE_HISTOGRAM_BUCKETS];
+};
+
+/**
+ * Size of the per-type arrays of struct dqlite_node_metrics, which are indexed
+ * by the type code of client requests and of raft commands respectively.
+ */
+#define DQLITE_METRICS_REQUEST_TYPES 32
+#define DQLITE_METRICS_COMMAND_TYPES 8
+
+/**
+ * Counters of a dqlite node, all since it was created unless noted otherwise.
+ */
+struct dqlite_node_metrics
+{
+	/* Client requests, the latency being measured until the last response
+	 * of the request is produced. */
+	unsigned long long requests[DQLITE_METRICS_REQUEST_TYPES];
+	unsigned long long request_failures[DQLITE_METRICS_REQUEST_TYPES];
+	struct dqlite_histogram request_latency[DQLITE_METRICS_REQUEST_TYPES];
+
+	/* Raft commands submitted while leader, the latency being measured
+	 * until they are applied. */
+	unsigned long long applies;
+	unsigned long long apply_failures;
+	unsigned long long apply_bytes;
+	struct dqlite_histogram apply_latency;
+	unsigned long long writes_shed; /* Refused by admission control */
+
+	/* Raft commands applied to the local state machine. */
+	unsigned long long commands[DQLITE_METRICS_COMMAND_TYPES];
+	struct dqlite_histogram command_latency[DQLITE_METRICS_COMMAND_TYPES];
+
+	/* Checkpoints of all databases. */
+	unsigned long long checkpoints;
+	unsigned long long checkpoint_busy;     /* Postponed due to readers */
+	unsigned long long checkpoint_skipped;  /* Writes or dumps in progress */
+	unsigned long long checkpoint_failures;
+	unsigned long long checkpoint_duration; /* Total, in milliseconds */
+
+	/* Queries of all databases. */
+	unsigned long long queries;
+	unsigned long long query_batches;
+	unsigned long long databases; /* Currently registered */
+
+	/* Raft state, as of the snapshot. */
+	unsigned long long term;
+	unsigned long long commit_index;
+	unsigned long long last_applied;
+	unsigned long long last_index;
+
+	/* Client connections. */
+	unsigned long long connections; /* Currently open */
+	unsigned long long connections_total;
+
+	/* Connection buffers. */
+	unsigned long long buffer_gets;
+	unsigned long long buffer_hits; /* Served by memory kept in the pool */
+};
+typedef struct dqlite_node_metrics dqlite_node_metrics;
+
+/**
+ * Take a snapshot of the metrics of the given node.
+ *
+ * This function is thread-safe. If the node is running, the snapshot is taken
+ * on its main loop thread, so it's consistent but might wait for the loop to
+ * be done with the current event: the calling thread blocks until then.
+ *
+ * It can also be called from the loop thread itself, for example from a
+ * callback invoked by the node, in which case the snapshot is taken right away
+ * without blocking.
+ */
+int dqlite_node_get_metrics(dqlite_node *n, dqlite_node_metrics *metrics);
+
+/**
+ * Serve the node metrics in the Prometheus text format, over HTTP on the given
+ * local address, which must be in the "<HOST>:<PORT>" format with <HOST> being
+ * an IPv4 address.
+ *
+ * Only GET requests for /metrics are answered, by the node's main loop thread,
+ * and connections idle for more than 10 seconds are closed. Clients can also
+ * get the metrics with a METRICS request over the regular dqlite protocol, so
+ * this is optional.
+ *
+ * This function must be called before calling dqlite_node_start().
+ */
+int dqlite_node_set_metrics_address(dqlite_node *n, const char *address);
+
+/**
+ * Stages of the handling of a client request, whose time is recorded in trace
+ * spans.
+ */
+enum {
+	DQLITE_TRACE_HANDLE = 0,   /* Request decoded, handling starts */
+	DQLITE_TRACE_BARRIER,      /* Raft barrier submitted */
+	DQLITE_TRACE_BARRIER_DONE, /* Raft barrier completed */
+	DQLITE_TRACE_STEP,         /* Leader loop started sqlite3_step() */
+	DQLITE_TRACE_APPLY,        /* Raft command submitted */
+	DQLITE_TRACE_APPLY_DONE,   /* Raft command applied, or failed */
+	DQLITE_TRACE_STEP_DONE,    /* Leader loop returned from sqlite3_step() */
+	DQLITE_TRACE_RESPOND,      /* Last response produced */
+	DQLITE_TRACE_WRITE,        /* Last response queued for writing */
+	DQLITE_TRACE_STAGES
+};
+
+/**
+ * Trace of a single client request.
+ *
+ * Each stamp is the CLOCK_MONOTONIC time in nanoseconds at which the request
+ * last went through the matching stage, or zero if it never did. Queries don't
+ * step on the leader loop, and only writes submit raft commands, possibly more
+ * than once, e.g. for large transactions or EXEC_BULK requests.
+ */
+struct dqlite_trace_span
+{
+	unsigned long long id; /* Sequence number of the request on the node */
+	int type;              /* Request type code */
+	int failed;            /* Whether the last response was a failure */
+	unsigned steps;        /* Number of steps on the leader loop */
+	unsigned applies;      /* Number of raft commands submitted */
+	unsigned long long stamps[DQLITE_TRACE_STAGES];
+};
+
+typedef struct dqlite_trace_span dqlite_trace_span;
+
+/**
+ * Maximum number of spans kept by a node, see dqlite_node_set_tracing().
+ */
+#define DQLITE_MAX_TRACE_SPANS 65536
+
+/**
+ * Trace one client request every @sample, keeping the spans of the last
+ * @capacity traced requests until they are fetched with
+ * dqlite_node_get_traces(). A @sample of 0, the default, disables tracing.
+ *
+ * Only requests handled while no other request of the same connection is in
+ * progress are traced, so interrupts and heartbeats sent during a query are
+ * left out.
+ *
+ * This function must be called before calling dqlite_node_start().
+ */
+int dqlite_node_set_tracing(dqlite_node *n, unsigned sample, unsigned capacity);
+
+/**
+ * Move up to @n of the spans recorded so far to the given array, oldest first,
+ * and set @count to the number of spans moved. Spans that are not fetched in
+ * time are overwritten by newer ones.
+ *
+ * This function can be called from any thread, whether the node is running or
+ * not.
+ */
+int dqlite_node_get_traces(dqlite_node *node,
+			   dqlite_trace_span *spans,
+			   unsigned n,
+			   unsigned *count);
+
 struct dqlite_node_info
 {
 	dqlite_node_id id;
@@ -6,13 +6,10 @@ static int bind_one(sqlite3_stmt *stmt, int n, struct value *value)
 {
 	int rc;
 
-	/* TODO: the binding calls below currently use SQLITE_TRANSIENT when
-	 * passing pointers to data (for TEXT or BLOB datatypes). This way
-	 * SQLite makes its private copy of the data before the bind call
-	 * returns, and we can reuse the message body buffer. The overhead of
-	 * the copy is typically low, but if it becomes a concern, this could be
-	 * optimized to make no copy and instead prevent the message body from
-	 * being reused. */
+	/* Text and blob values point into the request payload, which is not
+	 * reused until the request is done, so there's no need for SQLite to
+	 * make a private copy of them. Bindings are cleared by bind__params()
+	 * before any new request uses the statement. */
 	switch (value->type) {
 		case SQLITE_INTEGER:
 			rc = sqlite3_bind_int64(stmt, n, value->integer);
@@ -23,18 +20,18 @@ static int bind_one(sqlite3_stmt *stmt, int n, struct value *value)
 		case SQLITE_BLOB:
 			rc = sqlite3_bind_blob(stmt, n, value->blob.base,
 					       value->blob.len,
-					       SQLITE_TRANSIENT);
+					       SQLITE_STATIC);
 			break;
 		case SQLITE_NULL:
 			rc = sqlite3_bind_null(stmt, n);
 			break;
 		case SQLITE_TEXT:
 			rc = sqlite3_bind_text(stmt, n, value->text, -1,
-					       SQLITE_TRANSIENT);
+					       SQLITE_STATIC);
 			break;
 		case DQLITE_ISO8601:
 			rc = sqlite3_bind_text(stmt, n, value->text, -1,
-					       SQLITE_TRANSIENT);
+					       SQLITE_STATIC);
 			break;
 		case DQLITE_BOOLEAN:
 			rc = sqlite3_bind_int64(stmt, n,
@@ -56,6 +53,10 @@ int bind__params(sqlite3_stmt *stmt, struct cursor *cursor)
 
 	sqlite3_reset(stmt);
 
+	/* Drop any value bound by a previous request, since it points to a
+	 * payload buffer that might have been reused since then. */
+	sqlite3_clear_bindings(stmt);
+
 	/* If the payload has been fully consumed, it means there are no
 	 * parameters to bind. */
 	if (cursor->cap == 0) {
@@ -11,6 +11,10 @@
 
 /**
  * Bind the parameters of the given statement by decoding the given payload.
+ *
+ * Parameters not present in the payload are bound to NULL. Text and blob values
+ * are not copied, so the payload must stay valid and unchanged as long as the
+ * statement is stepped.
  */
 int bind__params(sqlite3_stmt *stmt, struct cursor *cursor);
 
@@ -0,0 +1,210 @@
+#include <sqlite3.h>
+
+#include "../include/dqlite.h"
+
+#include "./lib/assert.h"
+
+#include "checkpoint.h"
+#include "command.h"
+#include "db.h"
+#include "format.h"
+#include "registry.h"
+
+void checkpoint__init(struct checkpoint *c)
+{
+	c->wal_pages = 0;
+	c->last_write = 0;
+	c->pending = false;
+	c->req.data = NULL;
+	c->n = 0;
+	c->n_busy = 0;
+	c->n_skipped = 0;
+	c->n_fail = 0;
+	c->duration = 0;
+	c->total = 0;
+}
+
+static raft_time now(struct raft *raft)
+{
+	return raft->io->time(raft->io);
+}
+
+/* Read the current number of frames in the WAL of the given database from the
+ * WAL index header, and check whether any WAL lock is held.
+ *
+ * Return SQLITE_BUSY if a lock is held, meaning that a full checkpoint would
+ * not succeed right now. */
+static int inspectWal(struct db *db, unsigned *pages)
+{
+	struct sqlite3_file *file;
+	volatile void *region;
+	uint32_t mx_frame;
+	int i;
+	int rv;
+
+	/* The follower connection shares the WAL index with all leader
+	 * connections of this database. */
+	rv = sqlite3_file_control(db->follower, "main",
+				  SQLITE_FCNTL_FILE_POINTER, &file);
+	assert(rv == SQLITE_OK); /* Should never fail */
+
+	/* Get the first SHM region, which contains the WAL header. */
+	rv = file->pMethods->xShmMap(file, 0, 0, 0, &region);
+	if (rv != SQLITE_OK || region == NULL) {
+		/* The WAL index was never created, so nothing was written. */
+		*pages = 0;
+		return SQLITE_OK;
+	}
+
+	format__get_mx_frame((const uint8_t *)region, &mx_frame);
+	*pages = mx_frame;
+
+	/* Check each lock. This logic is similar to the one in the
+	 * walCheckpoint function of wal.c, in the SQLite code. */
+	for (i = 0; i < SQLITE_SHM_NLOCK; i++) {
+		int flags = SQLITE_SHM_LOCK | SQLITE_SHM_EXCLUSIVE;
+
+		rv = file->pMethods->xShmLock(file, i, 1, flags);
+		if (rv == SQLITE_BUSY) {
+			return SQLITE_BUSY;
+		}
+
+		/* Not locked. Let's release the lock we just acquired. */
+		flags = SQLITE_SHM_UNLOCK | SQLITE_SHM_EXCLUSIVE;
+		file->pMethods->xShmLock(file, i, 1, flags);
+	}
+
+	return SQLITE_OK;
+}
+
+/* The outcome of the checkpoint itself is recorded by the FSM, see
+ * checkpoint__applied(), so only raft failures are accounted for here. */
+static void applyCb(struct raft_apply *req, int status, void *result)
+{
+	struct db *db = req->data;
+	struct checkpoint *c = &db->checkpoint;
+	(void)result;
+
+	assert(c->pending);
+	c->pending = false;
+
+	if (status != 0) {
+		warnf(&db->config->logger, "checkpoint of %s: raft error %d",
+		      db->filename, status);
+		c->n_fail++;
+	}
+}
+
+void checkpoint__applied(struct db *db, int outcome, uint64_t ns)
+{
+	struct checkpoint *c = &db->checkpoint;
+
+	switch (outcome) {
+		case CHECKPOINT_DONE:
+			/* The WAL was truncated, so writes that were refused
+			 * because of its size can go ahead right away. */
+			c->wal_pages = 0;
+			c->n++;
+			c->duration = ns;
+			c->total += ns;
+			break;
+		case CHECKPOINT_SKIPPED:
+			c->n_skipped++;
+			break;
+		case CHECKPOINT_BUSY:
+			c->n_busy++;
+			break;
+		default:
+			c->n_fail++;
+			break;
+	}
+}
+
+void checkpoint__maybe(struct db *db, struct raft *raft)
+{
+	struct checkpoint *c = &db->checkpoint;
+	struct config *config = db->config;
+	struct command_checkpoint command;
+	struct raft_buffer buf;
+	unsigned pages;
+	raft_time time;
+	int rv;
+
+	/* Streamed dumps rely on the database file staying unchanged and the
+	 * WAL only growing, until they're done. */
+	if (c->pending || db->follower == NULL || db->tx != NULL ||
+	    db__dumping(db)) {
+		return;
+	}
+
+	if (raft_state(raft) != RAFT_LEADER) {
+		return;
+	}
+
+	rv = inspectWal(db, &pages);
+	c->wal_pages = pages;
+	if (pages == 0) {
+		return;
+	}
+
+	time = now(raft);
+	if (pages < config->checkpoint_threshold) {
+		if (config->checkpoint_idle == 0 ||
+		    time - c->last_write < config->checkpoint_idle) {
+			return;
+		}
+	}
+
+	if (rv == SQLITE_BUSY) {
+		/* Some reader is still using the WAL: retry at the next tick or
+		 * when the reader is done. */
+		c->n_busy++;
+		return;
+	}
+
+	command.filename = db->filename;
+	rv = command__encode(COMMAND_CHECKPOINT, &command, &buf);
+	if (rv != 0) {
+		warnf(&config->logger, "checkpoint of %s: encode command: %d",
+		      db->filename, rv);
+		return;
+	}
+	c->req.data = db;
+	rv = raft_apply(raft, &c->req, &buf, 1, applyCb);
+	if (rv != 0) {
+		warnf(&config->logger, "checkpoint of %s: raft_apply(): %s",
+		      db->filename, raft_errmsg(raft));
+		raft_free(buf.base);
+		c->n_fail++;
+		return;
+	}
+	c->pending = true;
+}
+
+void checkpoint__commit(struct db *db, struct raft *raft, unsigned pages)
+{
+	struct checkpoint *c = &db->checkpoint;
+	c->wal_pages = pages;
+	c->last_write = now(raft);
+	if (pages < db->config->checkpoint_threshold) {
+		/* Nothing to do yet. */
+		return;
+	}
+	checkpoint__maybe(db, raft);
+}
+
+void checkpoint__tick(struct registry *registry, struct raft *raft)
+{
+	queue *head;
+	QUEUE__FOREACH(head, &registry->dbs)
+	{
+		struct db *db = QUEUE__DATA(head, struct db, queue);
+		checkpoint__maybe(db, raft);
+	}
+}
+
+bool checkpoint__over_limit(struct db *db)
+{
+	unsigned max = db->config->checkpoint_max;
+	return max != 0 && db->checkpoint.wal_pages >= max;
+}
@@ -0,0 +1,80 @@
+/**
+ * Schedule WAL checkpoints of the databases this node is leader for.
+ *
+ * Checkpoints are never taken synchronously at the end of a write: the WAL
+ * hook just records the WAL size and possibly submits a checkpoint command,
+ * while a periodic tick on the main loop retries postponed checkpoints (e.g.
+ * because a reader was holding a WAL read mark) and checkpoints databases that
+ * went idle.
+ */
+
+#ifndef CHECKPOINT_H_
+#define CHECKPOINT_H_
+
+#include <raft.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+struct db;
+struct registry;
+
+/* Outcome of a checkpoint command applied by the FSM. */
+enum {
+	CHECKPOINT_DONE = 0, /* The WAL was checkpointed and truncated */
+	CHECKPOINT_SKIPPED,  /* A transaction or dump was in progress */
+	CHECKPOINT_BUSY,     /* A reader was holding the WAL */
+	CHECKPOINT_FAILED    /* SQLite returned an error */
+};
+
+struct checkpoint
+{
+	unsigned wal_pages;           /* Frames in the WAL, as last observed */
+	raft_time last_write;         /* Time of the last commit */
+	bool pending;                 /* Whether a command is in flight */
+	struct raft_apply req;        /* Pending checkpoint command */
+	unsigned long long n;         /* Number of checkpoints taken */
+	unsigned long long n_busy;    /* Number of checkpoints postponed */
+	unsigned long long n_skipped; /* Commands skipped by the FSM */
+	unsigned long long n_fail;    /* Number of failed checkpoints */
+	uint64_t duration;            /* Duration of the last checkpoint, in ns */
+	uint64_t total;               /* Duration of all checkpoints, in ns */
+};
+
+void checkpoint__init(struct checkpoint *c);
+
+/**
+ * Record the outcome of a checkpoint command applied by the FSM to @db, which
+ * took @ns nanoseconds. This happens on every node, since each one checkpoints
+ * its own WAL.
+ */
+void checkpoint__applied(struct db *db, int outcome, uint64_t ns);
+
+/**
+ * Record that a write transaction against @db was committed, leaving @pages
+ * frames in the WAL, and trigger a checkpoint if the threshold was crossed.
+ */
+void checkpoint__commit(struct db *db, struct raft *raft, unsigned pages);
+
+/**
+ * Submit a checkpoint command for @db if one is due and no WAL lock is held.
+ *
+ * A checkpoint is due if the WAL has reached the configured threshold, or if
+ * it's not empty and no write has been committed for the configured idle
+ * time. Nothing happens if this node is not the leader or a checkpoint
+ * command is already in flight.
+ */
+void checkpoint__maybe(struct db *db, struct raft *raft);
+
+/**
+ * Run checkpoint__maybe() against all databases in the given registry.
+ */
+void checkpoint__tick(struct registry *registry, struct raft *raft);
+
+/**
+ * Return true if the WAL of @db has grown past the configured hard limit, in
+ * which case new write transactions should be refused until a checkpoint
+ * succeeds.
+ */
+bool checkpoint__over_limit(struct db *db);
+
+#endif /* CHECKPOINT_H_ */
@@ -14,6 +14,9 @@ int clientInit(struct client *c, int fd)
 {
 	int rv;
 	c->fd = fd;
+	c->tag = 0;
+	c->last_tag = 0;
+	c->capabilities = 0;
 
 	rv = buffer__init(&c->read);
 	if (rv != 0) {
@@ -43,8 +46,7 @@ int clientSendHandshake(struct client *c)
 	uint64_t protocol;
 	int rv;
 
-	/* TODO: update to version 1 */
-	protocol = byte__flip64(DQLITE_PROTOCOL_VERSION_LEGACY);
+	protocol = byte__flip64(DQLITE_PROTOCOL_VERSION);
 
 	rv = write(c->fd, &protocol, sizeof(protocol));
 	if (rv < 0) {
@@ -74,6 +76,9 @@ int clientSendHandshake(struct client *c)
 		assert(n2 % 8 == 0);                                \
 		message.type = DQLITE_REQUEST_##UPPER;              \
 		message.words = n2 / 8;                             \
+		message.flags = c->tag != 0 ? DQLITE_MESSAGE_TAGGED \
+					    : 0;                    \
+		message.extra = c->tag;                             \
 		message__encode(&message, &cursor);                 \
 		request_##LOWER##__encode(&request, &cursor);       \
 		rv = write(c->fd, buffer__cursor(&c->write, 0), n); \
@@ -102,6 +107,7 @@ int clientSendHandshake(struct client *c)
 		cursor.cap = n;                                \
 		rv = message__decode(&cursor, &message);       \
 		assert(rv == 0);                               \
+		c->last_tag = message.extra;                   \
 		if (message.type != DQLITE_RESPONSE_##UPPER) { \
 			return DQLITE_ERROR;                   \
 		}                                              \
@@ -135,6 +141,23 @@ int clientSendHandshake(struct client *c)
 	READ(LOWER, UPPER);    \
 	DECODE(LOWER)
 
+int clientSendCapabilities(struct client *c, uint64_t capabilities)
+{
+	struct request_capabilities request;
+	request.capabilities = capabilities;
+	REQUEST(capabilities, CAPABILITIES);
+	return 0;
+}
+
+int clientRecvCapabilities(struct client *c, uint64_t *capabilities)
+{
+	struct response_capabilities response;
+	RESPONSE(capabilities, CAPABILITIES);
+	c->capabilities = response.capabilities;
+	*capabilities = response.capabilities;
+	return 0;
+}
+
 int clientSendOpen(struct client *c, const char *name)
 {
 	struct request_open request;
@@ -331,3 +354,57 @@ int clientRecvEmpty(struct client *c)
 	return 0;
 }
 
+
+int clientSendInterrupt(struct client *c)
+{
+	struct request_interrupt request;
+	request.db_id = c->db_id;
+	REQUEST(interrupt, INTERRUPT);
+	return 0;
+}
+
+int clientRecvInterrupt(struct client *c, unsigned *skipped)
+{
+	struct message message;
+	struct cursor cursor;
+	size_t n;
+	void *p;
+	int rv;
+
+	*skipped = 0;
+	while (1) {
+		n = message__sizeof(&message);
+		buffer__reset(&c->read);
+		p = buffer__advance(&c->read, n);
+		assert(p != NULL);
+		rv = read(c->fd, p, n);
+		if (rv != (int)n) {
+			return DQLITE_ERROR;
+		}
+		cursor.p = p;
+		cursor.cap = n;
+		rv = message__decode(&cursor, &message);
+		assert(rv == 0);
+		c->last_tag = message.extra;
+		buffer__reset(&c->read);
+		n = message.words * 8;
+		p = buffer__advance(&c->read, n);
+		if (p == NULL) {
+			return DQLITE_ERROR;
+		}
+		rv = read(c->fd, p, n);
+		if (rv != (int)n) {
+			return DQLITE_ERROR;
+		}
+		if (message.type == DQLITE_RESPONSE_EMPTY) {
+			break;
+		}
+		if (message.type != DQLITE_RESPONSE_ROWS &&
+		    message.type != DQLITE_RESPONSE_FAILURE) {
+			return DQLITE_ERROR;
+		}
+		(*skipped)++;
+	}
+
+	return 0;
+}
@@ -13,10 +13,13 @@
 
 struct client
 {
-	int fd;		     /* Connected socket */
-	unsigned db_id;      /* Database ID provided by the server */
-	struct buffer read;  /* Read buffer */
-	struct buffer write; /* Write buffer */
+	int fd;                /* Connected socket */
+	unsigned db_id;        /* Database ID provided by the server */
+	uint16_t tag;          /* If not zero, tag requests with this value */
+	uint16_t last_tag;     /* Tag of the last response received */
+	uint64_t capabilities; /* Agreed with the server */
+	struct buffer read;    /* Read buffer */
+	struct buffer write;   /* Write buffer */
 };
 
 struct row
@@ -42,6 +45,12 @@ void clientClose(struct client *c);
  * called before using any other API. */
 int clientSendHandshake(struct client *c);
 
+/* Send a request advertising the given capabilities. */
+int clientSendCapabilities(struct client *c, uint64_t capabilities);
+
+/* Receive the capabilities agreed with the server. */
+int clientRecvCapabilities(struct client *c, uint64_t *capabilities);
+
 /* Send a request to open a database */
 int clientSendOpen(struct client *c, const char *name);
 
@@ -89,4 +98,11 @@ int clientSendRemove(struct client *c, unsigned id);
 /* Receive an empty response. */
 int clientRecvEmpty(struct client *c);
 
+/* Send a request to interrupt the query in progress. */
+int clientSendInterrupt(struct client *c);
+
+/* Skip the responses of an interrupted query, counting them in @skipped, up to
+ * the empty response of the interrupt request. */
+int clientRecvInterrupt(struct client *c, unsigned *skipped);
+
 #endif /* CLIENT_H_*/
@@ -23,6 +23,74 @@
  * soon as possible. */
 #define DEFAULT_CHECKPOINT_THRESHOLD 1000
 
+/* Milliseconds without writes after which a non-empty WAL is checkpointed even
+ * if it's below the threshold. */
+#define DEFAULT_CHECKPOINT_IDLE 5000
+
+/* Number of outstanding WAL frames after which new write transactions are
+ * refused until a checkpoint succeeds. */
+#define DEFAULT_CHECKPOINT_MAX 10000
+
+/* Maximum number of idle leader connections kept open for each database, to be
+ * reused by new clients. */
+#define DEFAULT_LEADER_POOL 4
+
+/* Maximum number of statements prepared from EXEC_SQL and QUERY_SQL requests
+ * that each leader connection keeps cached. */
+#define DEFAULT_STMT_CACHE 32
+
+/* Maximum size in bytes of the page data of a single frames command. Larger
+ * transactions are split across several commands. */
+#define DEFAULT_FRAMES_MAX_SIZE (4 * 1024 * 1024)
+
+/* Number of raft log entries not yet applied, and total size of the commands
+ * being applied on behalf of leader connections, after which new write
+ * transactions are refused. */
+#define DEFAULT_MAX_BACKLOG 256
+#define DEFAULT_MAX_INFLIGHT_BYTES (256 * 1024 * 1024)
+
+/* Maximum number of tagged requests read ahead from a single client connection
+ * while another request is being handled. */
+#define DEFAULT_MAX_PIPELINED 16
+
+/* Size of a single batch of query rows. Larger batches mean fewer responses and
+ * write round trips for large result sets, at the cost of more memory per
+ * connection. */
+#define DEFAULT_QUERY_BATCH_BYTES (64 * 1024)
+#define DEFAULT_QUERY_BATCH_ROWS 0
+
+/* Time that stepping a query can take, across all its batches of rows, before
+ * it gets cut off. Zero means no limit. */
+#define DEFAULT_QUERY_TIME_BUDGET 0
+
+/* Number of threads running read-only queries. Zero means that all queries run
+ * on the main loop thread. */
+#define DEFAULT_READER_THREADS 0
+
+/* Number of batches of query rows produced while a previous one is still being
+ * written to the client, overlapping stepping with network I/O. Each one costs
+ * a response buffer per connection. */
+#define DEFAULT_QUERY_PREFETCH 1
+
+/* Connections borrow buffer memory from a node-wide pool while reading a
+ * request or writing a response. Memory larger than this, e.g. used to serve a
+ * large dump, is released instead of being kept for reuse. */
+#define DEFAULT_BUFFER_POOL_MAX_SIZE (1024 * 1024)
+
+/* Cap on the idle buffer memory kept by the pool. */
+#define DEFAULT_BUFFER_POOL_MAX (16 * 1024 * 1024)
+
+/* Time the pool can go unused before all its idle memory is given back. */
+#define DEFAULT_BUFFER_IDLE 30000
+
+/* Size of the parts of a file sent in a single response of a streamed dump. */
+#define DEFAULT_DUMP_CHUNK_BYTES (512 * 1024)
+
+/* Longest time streamed dumps can hold off checkpoints of a database. Past
+ * that, the dumps in progress are aborted, so a client that stopped reading
+ * can't postpone checkpoints, and eventually writes, forever. */
+#define DEFAULT_DUMP_TIMEOUT (60 * 1000)
+
 /* For generating unique replication/VFS registration names.
  *
  * TODO: make this thread safe. */
@@ -40,6 +108,24 @@ int config__init(struct config *c, dqlite_node_id id, const char *address)
 	c->heartbeat_timeout = DEFAULT_HEARTBEAT_TIMEOUT;
 	c->page_size = DEFAULT_PAGE_SIZE;
 	c->checkpoint_threshold = DEFAULT_CHECKPOINT_THRESHOLD;
+	c->checkpoint_idle = DEFAULT_CHECKPOINT_IDLE;
+	c->checkpoint_max = DEFAULT_CHECKPOINT_MAX;
+	c->leader_pool = DEFAULT_LEADER_POOL;
+	c->stmt_cache = DEFAULT_STMT_CACHE;
+	c->frames_max_size = DEFAULT_FRAMES_MAX_SIZE;
+	c->max_backlog = DEFAULT_MAX_BACKLOG;
+	c->max_inflight_bytes = DEFAULT_MAX_INFLIGHT_BYTES;
+	c->max_pipelined = DEFAULT_MAX_PIPELINED;
+	c->query_batch_bytes = DEFAULT_QUERY_BATCH_BYTES;
+	c->query_batch_rows = DEFAULT_QUERY_BATCH_ROWS;
+	c->query_time_budget = DEFAULT_QUERY_TIME_BUDGET;
+	c->reader_threads = DEFAULT_READER_THREADS;
+	c->query_prefetch = DEFAULT_QUERY_PREFETCH;
+	c->buffer_pool_max_size = DEFAULT_BUFFER_POOL_MAX_SIZE;
+	c->buffer_pool_max = DEFAULT_BUFFER_POOL_MAX;
+	c->buffer_idle = DEFAULT_BUFFER_IDLE;
+	c->dump_chunk_bytes = DEFAULT_DUMP_CHUNK_BYTES;
+	c->dump_timeout = DEFAULT_DUMP_TIMEOUT;
 	rv = snprintf(c->name, sizeof c->name, "dqlite-%u", serial);
 	assert(rv < (int)(sizeof c->name));
 	c->logger.data = NULL;
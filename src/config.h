@@ -13,6 +13,24 @@ struct config
 	unsigned heartbeat_timeout;    /* In milliseconds */
 	unsigned page_size;            /* Database page size */
 	unsigned checkpoint_threshold; /* In outstanding WAL frames */
+	unsigned checkpoint_idle;      /* In milliseconds, 0 to disable */
+	unsigned checkpoint_max;       /* Refuse writes past this WAL size */
+	unsigned leader_pool;          /* Idle leader connections per db */
+	unsigned stmt_cache;           /* Cached statements per connection */
+	unsigned frames_max_size;      /* Max WAL frames bytes per raft entry */
+	unsigned max_backlog;          /* Refuse writes past this, 0 for none */
+	size_t max_inflight_bytes;     /* Refuse writes past this, 0 for none */
+	unsigned max_pipelined;        /* Requests read ahead per connection */
+	unsigned query_batch_bytes;    /* Default size of a batch of rows */
+	unsigned query_batch_rows;     /* Default rows per batch, 0 for any */
+	unsigned query_time_budget;    /* In milliseconds, 0 for no limit */
+	unsigned reader_threads;       /* Threads running read-only queries */
+	unsigned query_prefetch;       /* Batches of rows produced ahead */
+	size_t buffer_pool_max_size;   /* Larger buffers aren't pooled */
+	size_t buffer_pool_max;        /* Idle memory kept by the pool */
+	unsigned buffer_idle;          /* In milliseconds, 0 to never trim */
+	size_t dump_chunk_bytes;       /* Size of a chunk of a streamed dump */
+	unsigned dump_timeout;         /* In milliseconds, 0 for no limit */
 	struct logger logger;          /* Custom logger */
 	char name[256];                /* VFS/replication registriatio name */
 };
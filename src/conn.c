@@ -4,44 +4,211 @@
 #include "transport.h"
 #include "protocol.h"
 
-/* Initialize the given buffer for reading, ensure it has the given size. */
+/* Initialize the given buffer for reading a protocol version or a message
+ * header, which fit in the connection object itself. */
+static void init_preamble(struct conn *c, uv_buf_t *buf, size_t size)
+{
+	assert(size <= sizeof c->preamble);
+	buf->base = (char *)&c->preamble;
+	buf->len = size;
+}
+
+/* Initialize the given buffer for reading a request payload of the given
+ * size, borrowing memory from the pool. */
 static int init_read(struct conn *c, uv_buf_t *buf, size_t size)
 {
-	buffer__reset(&c->read);
+	int rv;
+	rv = buffer_pool__get(c->pool, &c->read, size);
+	if (rv != 0) {
+		return rv;
+	}
 	buf->base = buffer__advance(&c->read, size);
-	if (buf->base == NULL) {
+	assert(buf->base != NULL); /* The buffer is large enough */
+	buf->len = size;
+	return 0;
+}
+
+/* Allocate a ring of @n response buffers. They borrow memory from the pool
+ * only while a response is being encoded or written. */
+static int init_write(struct conn *c, unsigned n)
+{
+	unsigned i;
+
+	c->write = sqlite3_malloc64(n * sizeof *c->write);
+	if (c->write == NULL) {
 		return DQLITE_NOMEM;
 	}
-	buf->len = size;
+	for (i = 0; i < n; i++) {
+		c->write[i].data = NULL;
+	}
+	c->n_write = n;
+	c->first = 0;
+	c->n_queued = 0;
 	return 0;
 }
 
+static void close_write(struct conn *c)
+{
+	unsigned i;
+	for (i = 0; i < c->n_write; i++) {
+		buffer_pool__put(c->pool, &c->write[i]);
+	}
+	sqlite3_free(c->write);
+}
+
 static int read_message(struct conn *c);
-static void write_cb(struct transport *transport, int status)
+static void handle_request(struct conn *c, struct cursor *cursor);
+
+/* Start reading the next request while the current one is still being handled,
+ * if the client is pipelining and there's room in the pending queue. */
+static void maybe_read_ahead(struct conn *c)
 {
-	struct conn *c = transport->data;
-	bool finished;
 	int rv;
-	if (status != 0) {
-		goto abort;
+	if (c->closed || c->reading || c->n_pending >= c->config->max_pipelined) {
+		return;
 	}
+	rv = read_message(c);
+	if (rv != 0) {
+		conn__stop(c);
+	}
+}
 
-	buffer__reset(&c->write);
-	buffer__advance(&c->write, message__sizeof(&c->response)); /* Header */
+/* Handle the oldest request in the pending queue. */
+static void handle_pending(struct conn *c)
+{
+	struct pipelined *p;
+	struct cursor cursor;
+	queue *head;
+
+	head = QUEUE__HEAD(&c->pending);
+	QUEUE__REMOVE(head);
+	c->n_pending--;
+	p = QUEUE__DATA(head, struct pipelined, queue);
+
+	c->handled = p;
+	c->current = p->message;
+	cursor.p = p->body;
+	cursor.cap = p->len;
+	handle_request(c, &cursor);
+}
 
-	rv = gateway__resume(&c->gateway, &finished);
+/* Return the response buffer at the given position in the ring, counting from
+ * the oldest response not yet sent. */
+static struct buffer *write_buffer(struct conn *c, unsigned i)
+{
+	return &c->write[(c->first + i) % c->n_write];
+}
+
+/* Borrow memory for the first free response buffer, reserving room for the
+ * header. Return NULL if no memory is available. */
+static struct buffer *next_write_buffer(struct conn *c)
+{
+	struct buffer *buffer = write_buffer(c, c->n_queued);
+	int rv;
+	rv = buffer_pool__get(c->pool, buffer, c->pool->page_size);
 	if (rv != 0) {
-		goto abort;
+		return NULL;
 	}
-	if (!finished) {
+	buffer__advance(buffer, message__sizeof(&c->response)); /* Header */
+	return buffer;
+}
+
+static void write_cb(struct transport *transport, int status);
+
+/* Start writing the oldest response not yet sent. */
+static int write_response(struct conn *c)
+{
+	struct buffer *buffer = write_buffer(c, 0);
+	uv_buf_t bufs[BUFFER__MAX_SEGMENTS];
+	unsigned n;
+	n = buffer__segments(buffer, bufs);
+	return transport__write(&c->transport, bufs, n, write_cb);
+}
+
+/* All responses of the current request were sent, move to the next one. */
+static void finish_request(struct conn *c)
+{
+	int rv;
+
+	c->handling = false;
+	sqlite3_free(c->handled);
+	c->handled = NULL;
+	buffer_pool__put(c->pool, &c->body);
+
+	if (!QUEUE__IS_EMPTY(&c->pending)) {
+		handle_pending(c);
+		maybe_read_ahead(c);
 		return;
 	}
 
+	/* The client has nothing else to do for now, don't hold connections
+	 * that other clients could use. */
+	gateway__idle(&c->gateway);
+
 	/* Start reading the next request */
-	rv = read_message(c);
+	if (!c->reading) {
+		rv = read_message(c);
+		if (rv != 0) {
+			conn__stop(c);
+		}
+	}
+}
+
+/* Ask the gateway for the next batch of rows of the current query as soon as
+ * a response buffer is free, so stepping overlaps with writing the batches
+ * produced so far. Finish the request once there's nothing left to produce
+ * and all responses were sent. */
+static void produce(struct conn *c)
+{
+	struct buffer *buffer;
+	bool finished;
+	int rv;
+
+	if (c->closed || c->producing || c->n_queued == c->n_write) {
+		return;
+	}
+
+	buffer = next_write_buffer(c);
+	if (buffer == NULL) {
+		conn__stop(c);
+		return;
+	}
+	c->producing = true;
+	rv = gateway__resume(&c->gateway, buffer, &finished);
 	if (rv != 0) {
+		conn__stop(c);
+		return;
+	}
+	if (!finished) {
+		return;
+	}
+	c->producing = false;
+	buffer_pool__put(c->pool, buffer);
+
+	if (c->n_queued == 0) {
+		finish_request(c);
+	}
+}
+
+static void write_cb(struct transport *transport, int status)
+{
+	struct conn *c = transport->data;
+	int rv;
+	if (status != 0) {
 		goto abort;
 	}
+
+	buffer_pool__put(c->pool, write_buffer(c, 0));
+	c->first = (c->first + 1) % c->n_write;
+	c->n_queued--;
+	if (c->n_queued > 0) {
+		rv = write_response(c);
+		if (rv != 0) {
+			goto abort;
+		}
+	}
+
+	produce(c);
 	return;
 abort:
 	conn__stop(c);
@@ -50,9 +217,9 @@ abort:
 static void gateway_handle_cb(struct handle *req, int status, int type)
 {
 	struct conn *c = req->data;
+	struct buffer *buffer = req->buffer;
 	size_t n;
 	void *cursor;
-	uv_buf_t buf;
 	int rv;
 
 	/* Ignore results firing after we started closing. TODO: instead, we
@@ -65,23 +232,41 @@ static void gateway_handle_cb(struct handle *req, int status, int type)
 		goto abort;
 	}
 
-	n = buffer__offset(&c->write) - message__sizeof(&c->response);
+	c->producing = false;
+
+	n = buffer__size(buffer) - message__sizeof(&c->response);
 	assert(n % 8 == 0);
 
 	c->response.type = type;
 	c->response.words = n / 8;
 	c->response.flags = 0;
 	c->response.extra = 0;
+	if (c->current.flags & DQLITE_MESSAGE_TAGGED) {
+		c->response.flags |= DQLITE_MESSAGE_TAGGED;
+		c->response.extra = c->current.extra;
+	}
+	if (type == DQLITE_RESPONSE_ROWS) {
+		/* The gateway might have implied the flag, see
+		 * DQLITE_CAPABILITY_COLUMNAR. */
+		c->response.flags |= req->flags & DQLITE_MESSAGE_COLUMNAR;
+	}
 
-	cursor = buffer__cursor(&c->write, 0);
+	cursor = buffer__cursor(buffer, 0);
 	message__encode(&c->response, &cursor);
 
-	buf.base = buffer__cursor(&c->write, 0);
-	buf.len = buffer__offset(&c->write);
+	/* Responses are written in order, one at a time. */
+	c->n_queued++;
+	if (c->n_queued == 1) {
+		rv = write_response(c);
+		if (rv != 0) {
+			goto abort;
+		}
+	}
 
-	rv = transport__write(&c->transport, &buf, write_cb);
-	if (rv != 0) {
-		goto abort;
+	/* Prefetch the next batch of rows, or the next chunk of a dump, while
+	 * this one is being sent. */
+	if (type == DQLITE_RESPONSE_ROWS || type == DQLITE_RESPONSE_CHUNK) {
+		produce(c);
 	}
 	return;
 abort:
@@ -91,9 +276,17 @@ abort:
 static void close_cb(struct transport *transport)
 {
 	struct conn *c = transport->data;
+	c->gateway.registry->metrics.connections--;
 	gateway__close(&c->gateway);
-	buffer__close(&c->write);
-	buffer__close(&c->read);
+	while (!QUEUE__IS_EMPTY(&c->pending)) {
+		queue *head = QUEUE__HEAD(&c->pending);
+		QUEUE__REMOVE(head);
+		sqlite3_free(QUEUE__DATA(head, struct pipelined, queue));
+	}
+	sqlite3_free(c->handled);
+	close_write(c);
+	buffer_pool__put(c->pool, &c->body);
+	buffer_pool__put(c->pool, &c->read);
 	if (c->close_cb != NULL) {
 		c->close_cb(c);
 	}
@@ -103,6 +296,12 @@ static void raft_connect(struct conn *c, struct cursor *cursor)
 {
 	struct request_connect request;
 	int rv;
+	/* The stream can't be handed over to raft if more data was read from
+	 * it, or is being read. */
+	if (c->reading || c->n_pending > 0) {
+		conn__stop(c);
+		return;
+	}
 	rv = request_connect__decode(cursor, &request);
 	if (rv != 0) {
 		conn__stop(c);
@@ -116,35 +315,101 @@ static void raft_connect(struct conn *c, struct cursor *cursor)
 	close_cb(&c->transport);
 }
 
+/* Dispatch the current request to the gateway. */
+static void handle_request(struct conn *c, struct cursor *cursor)
+{
+	struct buffer *buffer;
+	int rv;
+
+	c->handling = true;
+	buffer = next_write_buffer(c);
+	if (buffer == NULL) {
+		conn__stop(c);
+		return;
+	}
+
+	switch (c->current.type) {
+		case DQLITE_REQUEST_CONNECT:
+			raft_connect(c, cursor);
+			return;
+	}
+
+	c->handle.flags = c->current.flags;
+	c->producing = true;
+	rv = gateway__handle(&c->gateway, &c->handle, c->current.type, cursor,
+			     buffer, gateway_handle_cb);
+	if (rv != 0) {
+		conn__stop(c);
+		return;
+	}
+
+	if (c->current.flags & DQLITE_MESSAGE_TAGGED) {
+		maybe_read_ahead(c);
+	}
+}
+
+/* Save the request just read in the pending queue. */
+static int enqueue_request(struct conn *c)
+{
+	struct pipelined *p;
+	size_t n = buffer__offset(&c->read);
+
+	p = sqlite3_malloc64(sizeof *p + n);
+	if (p == NULL) {
+		return DQLITE_NOMEM;
+	}
+	p->message = c->request;
+	p->len = n;
+	memcpy(p->body, buffer__cursor(&c->read, 0), n);
+	QUEUE__PUSH(&c->pending, &p->queue);
+	c->n_pending++;
+	buffer_pool__put(c->pool, &c->read);
+
+	return 0;
+}
+
 static void read_request_cb(struct transport *transport, int status)
 {
 	struct conn *c = transport->data;
 	struct cursor cursor;
 	int rv;
 
+	c->reading = false;
+
 	if (status != 0) {
 		// errorf(c->logger, "read error");
 		conn__stop(c);
 		return;
 	}
 
-	cursor.p = buffer__cursor(&c->read, 0);
-	cursor.cap = buffer__offset(&c->read);
-
-	buffer__reset(&c->write);
-	buffer__advance(&c->write, message__sizeof(&c->response)); /* Header */
-
-	switch (c->request.type) {
-		case DQLITE_REQUEST_CONNECT:
-			raft_connect(c, &cursor);
+	if (c->handling) {
+		rv = enqueue_request(c);
+		if (rv != 0) {
+			conn__stop(c);
 			return;
+		}
+		/* An interrupt meant for the query being streamed shouldn't
+		 * wait for all of its rows to be sent. */
+		if (c->request.type == DQLITE_REQUEST_INTERRUPT &&
+		    c->n_pending == 1) {
+			gateway__interrupt(&c->gateway);
+		}
+		if (c->request.flags & DQLITE_MESSAGE_TAGGED) {
+			maybe_read_ahead(c);
+		}
+		return;
 	}
 
-	rv = gateway__handle(&c->gateway, &c->handle, c->request.type, &cursor,
-			     &c->write, gateway_handle_cb);
-	if (rv != 0) {
-		conn__stop(c);
-	}
+	/* Hand the payload over to the gateway, so the read buffer is free to
+	 * read ahead the next request. */
+	assert(c->body.data == NULL);
+	c->body = c->read;
+	c->read.data = NULL;
+
+	c->current = c->request;
+	cursor.p = buffer__cursor(&c->body, 0);
+	cursor.cap = buffer__offset(&c->body);
+	handle_request(c, &cursor);
 }
 
 /* Start reading the body of the next request */
@@ -160,6 +425,7 @@ static int read_request(struct conn *c)
 	if (rv != 0) {
 		return rv;
 	}
+	c->reading = true;
 	return 0;
 }
 
@@ -169,14 +435,16 @@ static void read_message_cb(struct transport *transport, int status)
 	struct cursor cursor;
 	int rv;
 
+	c->reading = false;
+
 	if (status != 0) {
 		// errorf(c->logger, "read error");
 		conn__stop(c);
 		return;
 	}
 
-	cursor.p = buffer__cursor(&c->read, 0);
-	cursor.cap = buffer__offset(&c->read);
+	cursor.p = &c->preamble;
+	cursor.cap = message__sizeof(&c->request);
 
 	rv = message__decode(&cursor, &c->request);
 	assert(rv == 0); /* Can't fail, we know we have enough bytes */
@@ -193,14 +461,12 @@ static int read_message(struct conn *c)
 {
 	uv_buf_t buf;
 	int rv;
-	rv = init_read(c, &buf, message__sizeof(&c->request));
-	if (rv != 0) {
-		return rv;
-	}
+	init_preamble(c, &buf, message__sizeof(&c->request));
 	rv = transport__read(&c->transport, &buf, read_message_cb);
 	if (rv != 0) {
 		return rv;
 	}
+	c->reading = true;
 	return 0;
 }
 
@@ -215,12 +481,14 @@ static void read_protocol_cb(struct transport *transport, int status)
 		goto abort;
 	}
 
-	cursor.p = buffer__cursor(&c->read, 0);
-	cursor.cap = buffer__offset(&c->read);
+	cursor.p = &c->preamble;
+	cursor.cap = sizeof c->protocol;
 
 	rv = uint64__decode(&cursor, &c->protocol);
 	assert(rv == 0); /* Can't fail, we know we have enough bytes */
 
+	/* Features added after version 1 are negotiated with a CAPABILITIES
+	 * request rather than by bumping the version. */
 	if (c->protocol != DQLITE_PROTOCOL_VERSION && c->protocol != DQLITE_PROTOCOL_VERSION_LEGACY) {
 		/* errorf(c->logger, "unknown protocol version: %lx", */
 		/* c->protocol); */
@@ -245,10 +513,7 @@ static int read_protocol(struct conn *c)
 {
 	uv_buf_t buf;
 	int rv;
-	rv = init_read(c, &buf, sizeof c->protocol);
-	if (rv != 0) {
-		return rv;
-	}
+	init_preamble(c, &buf, sizeof c->protocol);
 	rv = transport__read(&c->transport, &buf, read_protocol_cb);
 	if (rv != 0) {
 		return rv;
@@ -259,6 +524,7 @@ static int read_protocol(struct conn *c)
 int conn__start(struct conn *c,
 		struct config *config,
 		struct uv_loop_s *loop,
+		struct buffer_pool *pool,
 		struct registry *registry,
 		struct raft *raft,
 		struct uv_stream_s *stream,
@@ -272,31 +538,36 @@ int conn__start(struct conn *c,
 		goto err;
 	}
 	c->config = config;
+	c->pool = pool;
 	c->transport.data = c;
 	c->uv_transport = uv_transport;
 	c->close_cb = close_cb;
 	gateway__init(&c->gateway, config, registry, raft);
-	rv = buffer__init(&c->read);
+	c->read.data = NULL;
+	c->body.data = NULL;
+	rv = init_write(c, config->query_prefetch + 1);
 	if (rv != 0) {
 		goto err_after_transport_init;
 	}
-	rv = buffer__init(&c->write);
-	if (rv != 0) {
-		goto err_after_read_buffer_init;
-	}
 	c->handle.data = c;
+	QUEUE__INIT(&c->pending);
+	c->n_pending = 0;
+	c->handled = NULL;
+	c->handling = false;
+	c->producing = false;
+	c->reading = false;
 	c->closed = false;
 	/* First, we expect the client to send us the protocol version. */
 	rv = read_protocol(c);
 	if (rv != 0) {
 		goto err_after_write_buffer_init;
 	}
+	registry->metrics.connections++;
+	registry->metrics.connections_total++;
 	return 0;
 
 err_after_write_buffer_init:
-	buffer__close(&c->write);
-err_after_read_buffer_init:
-	buffer__close(&c->read);
+	close_write(c);
 err_after_transport_init:
 	transport__close(&c->transport, NULL);
 err:
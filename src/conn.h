@@ -20,19 +20,43 @@
 struct conn;
 typedef void (*conn_close_cb)(struct conn *c);
 
+/**
+ * A request read ahead of time, while another one was being handled.
+ */
+struct pipelined
+{
+	struct message message; /* Request message meta data */
+	queue queue;            /* Position in the pending queue */
+	size_t len;             /* Payload size */
+	uint64_t body[];        /* Request payload */
+};
+
 struct conn
 {
 	struct config *config;
+	struct buffer_pool *pool;               /* Memory for buffers */
 	struct raft_uv_transport *uv_transport; /* Raft transport */
 	conn_close_cb close_cb;                 /* Close callback */
 	struct transport transport;             /* Async network read/write */
 	struct gateway gateway;                 /* Request handler */
+	uint64_t preamble;                      /* Protocol or message header */
 	struct buffer read;                     /* Read buffer */
-	struct buffer write;                    /* Write buffer */
+	struct buffer body;                     /* Payload being handled */
+	struct buffer *write;                   /* Ring of response buffers */
+	unsigned n_write;                       /* Size of the ring */
+	unsigned first;                         /* Oldest unsent response */
+	unsigned n_queued;                      /* Responses not yet sent */
 	uint64_t protocol;                      /* Protocol format version */
 	struct message request;                 /* Request message meta data */
+	struct message current;                 /* Request being handled */
 	struct message response;                /* Response message meta data */
 	struct handle handle;
+	queue pending;                          /* Requests read ahead */
+	unsigned n_pending;                     /* Length of the pending queue */
+	struct pipelined *handled;              /* Pending request being handled */
+	bool handling;                          /* Whether a request is handled */
+	bool producing;                         /* Whether a response is due */
+	bool reading;                           /* Whether a read is in progress */
 	bool closed;
 	queue queue;
 };
@@ -42,10 +66,14 @@ struct conn
  *
  * If no error is returned, the connection should be considered started. Any
  * error occurring after this point will trigger the @close_cb callback.
+ *
+ * Buffers for reading requests and writing responses borrow memory from the
+ * given @pool only while in use, so an idle connection holds none.
  */
 int conn__start(struct conn *c,
 		struct config *config,
 		struct uv_loop_s *loop,
+		struct buffer_pool *pool,
 		struct registry *registry,
 		struct raft *raft,
 		struct uv_stream_s *stream,
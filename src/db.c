@@ -5,6 +5,8 @@
 #include "./lib/assert.h"
 
 #include "db.h"
+#include "leader.h"
+#include "metrics.h"
 
 /* Open a SQLite connection and set it to follower mode. */
 static int open_follower_conn(const char *filename,
@@ -21,11 +23,27 @@ void db__init(struct db *db, struct config *config, const char *filename)
 	db->opening = false;
 	db->follower = NULL;
 	db->tx = NULL;
+	checkpoint__init(&db->checkpoint);
+	db->n_queries = 0;
+	db->n_batches = 0;
+	db->n_dumps = 0;
+	db->dumps_since = 0;
+	db->dumps_gen = 0;
 	QUEUE__INIT(&db->leaders);
+	QUEUE__INIT(&db->pool);
+	db->pool_size = 0;
 }
 
 void db__close(struct db *db)
 {
+	while (!QUEUE__IS_EMPTY(&db->pool)) {
+		queue *head = QUEUE__HEAD(&db->pool);
+		struct leader *l = QUEUE__DATA(head, struct leader, idle);
+		QUEUE__REMOVE(head);
+		leader__close(l);
+		sqlite3_free(l);
+	}
+	db->pool_size = 0;
 	assert(QUEUE__IS_EMPTY(&db->leaders));
 	if (db->follower != NULL) {
 		int rc;
@@ -124,3 +142,35 @@ err:
 	}
 	return rc;
 }
+
+unsigned long long db__dump_start(struct db *db)
+{
+	if (db->n_dumps == 0) {
+		db->dumps_since = metrics__now();
+	}
+	db->n_dumps++;
+	return db->dumps_gen;
+}
+
+void db__dump_stop(struct db *db, unsigned long long gen)
+{
+	if (gen != db->dumps_gen) {
+		return;
+	}
+	assert(db->n_dumps > 0);
+	db->n_dumps--;
+}
+
+bool db__dumping(struct db *db)
+{
+	uint64_t timeout = (uint64_t)db->config->dump_timeout * 1000 * 1000;
+	if (db->n_dumps == 0) {
+		return false;
+	}
+	if (timeout == 0 || metrics__now() - db->dumps_since < timeout) {
+		return true;
+	}
+	db->n_dumps = 0;
+	db->dumps_gen++;
+	return false;
+}
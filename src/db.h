@@ -7,18 +7,27 @@
 
 #include "lib/queue.h"
 
+#include "checkpoint.h"
 #include "config.h"
 #include "tx.h"
 
 struct db
 {
-	struct config *config; /* Dqlite configuration */
-	char *filename;        /* Database filename */
-	bool opening;          /* Whether an Open request is in progress */
-	sqlite3 *follower;     /* Follower connection */
-	queue leaders;         /* Open leader connections */
-	struct tx *tx;         /* Current ongoing transaction, if any */
-	queue queue;           /* Prev/next database, used by the registry */
+	struct config *config;        /* Dqlite configuration */
+	char *filename;               /* Database filename */
+	bool opening;                 /* Whether an Open is in progress */
+	sqlite3 *follower;            /* Follower connection */
+	queue leaders;                /* Open leader connections */
+	queue pool;                   /* Idle leader connections */
+	unsigned pool_size;           /* Number of idle leader connections */
+	struct tx *tx;                /* Current ongoing transaction, if any */
+	struct checkpoint checkpoint; /* Checkpoint scheduling state */
+	unsigned long long n_queries; /* Number of queries completed */
+	unsigned long long n_batches; /* Number of row batches sent */
+	unsigned n_dumps;             /* Streaming dumps in progress */
+	uint64_t dumps_since;         /* When the dumps in progress started */
+	unsigned long long dumps_gen; /* Bumped when dumps get aborted */
+	queue queue;                  /* Prev/next database, used by registry */
 };
 
 /**
@@ -31,7 +40,8 @@ void db__init(struct db *db, struct config *config, const char *filename);
 /**
  * Release all memory associated with a database object.
  *
- * If the follower connection was opened, it will be closed.
+ * Any idle leader connection will be closed, and if the follower connection was
+ * opened, it will be closed too.
  */
 void db__close(struct db *db);
 
@@ -54,4 +64,26 @@ int db__create_tx(struct db *db, unsigned long long id, sqlite3 *conn);
  */
 void db__delete_tx(struct db *db);
 
+/**
+ * Register a new streamed dump of this database, which holds off checkpoints
+ * until it's stopped. Return the generation of the dump, to be passed to
+ * db__dump_stop().
+ */
+unsigned long long db__dump_start(struct db *db);
+
+/**
+ * Unregister a streamed dump, unless it was already aborted.
+ */
+void db__dump_stop(struct db *db, unsigned long long gen);
+
+/**
+ * Whether streamed dumps are in progress, so the database file must not be
+ * checkpointed.
+ *
+ * Dumps can hold off checkpoints for at most the configured dump timeout:
+ * past that, all the dumps in progress are aborted, which dumpers notice by
+ * comparing their generation with @dumps_gen, and this returns false.
+ */
+bool db__dumping(struct db *db);
+
 #endif /* DB_H_*/
@@ -3,8 +3,11 @@
 #include "lib/assert.h"
 #include "lib/serialize.h"
 
+#include "checkpoint.h"
 #include "command.h"
 #include "fsm.h"
+#include "leader.h"
+#include "readers.h"
 #include "vfs.h"
 
 struct fsm
@@ -151,24 +154,46 @@ static int apply_undo(struct fsm *f, const struct command_undo *c)
 static int apply_checkpoint(struct fsm *f, const struct command_checkpoint *c)
 {
 	struct db *db;
+	uint64_t start;
 	int size;
 	int ckpt;
 	int rv;
 
 	rv = registry__db_get(f->registry, c->filename, &db);
-	assert(rv == 0);        /* We have registered this filename before. */
-	assert(db->tx == NULL); /* No transaction is in progress. */
+	assert(rv == 0); /* We have registered this filename before. */
+
+	/* Checkpoint commands are submitted asynchronously, so by the time this
+	 * one gets applied the leader might have started a new write
+	 * transaction. In that case just skip it, the leader will submit a new
+	 * one later. */
+	if (db->tx != NULL) {
+		checkpoint__applied(db, CHECKPOINT_SKIPPED, 0);
+		return 0;
+	}
+
+	/* Same if a streamed dump is in progress on this node, since the
+	 * database file must not change until it's done. */
+	if (db__dumping(db)) {
+		checkpoint__applied(db, CHECKPOINT_SKIPPED, 0);
+		return 0;
+	}
 
+	/* Readers might be holding a read lock, for example stale reads on
+	 * followers, in which case the checkpoint is either refused with
+	 * SQLITE_BUSY or only partially completed. That's fine: each node's WAL
+	 * is local, and the leader will issue another checkpoint later. */
+	start = metrics__now();
 	rv = sqlite3_wal_checkpoint_v2(
 	    db->follower, "main", SQLITE_CHECKPOINT_TRUNCATE, &size, &ckpt);
+	if (rv == SQLITE_BUSY) {
+		checkpoint__applied(db, CHECKPOINT_BUSY, 0);
+		return 0;
+	}
 	if (rv != 0) {
+		checkpoint__applied(db, CHECKPOINT_FAILED, 0);
 		return rv;
 	}
-
-	/* Since no reader transaction is in progress, we must be able to
-	 * checkpoint the entire WAL */
-	assert(size == 0);
-	assert(ckpt == 0);
+	checkpoint__applied(db, CHECKPOINT_DONE, metrics__now() - start);
 
 	return 0;
 }
@@ -178,6 +203,8 @@ static int fsm__apply(struct raft_fsm *fsm,
 		      void **result)
 {
 	struct fsm *f = fsm->data;
+	struct metrics *metrics = &f->registry->metrics;
+	uint64_t start = metrics__now();
 	int type;
 	void *command;
 	int rc;
@@ -205,6 +232,11 @@ static int fsm__apply(struct raft_fsm *fsm,
 	}
 	raft_free(command);
 
+	if (type < METRICS__COMMAND_TYPES) {
+		metrics->commands[type]++;
+		metrics__observe_since(&metrics->command_latency[type], start);
+	}
+
 	*result = NULL;
 
 	return 0;
@@ -423,6 +455,40 @@ err:
 	return rv;
 }
 
+/* Fail the queries that reader threads are running, or are about to run,
+ * against the databases of the given snapshot, since their files are going to
+ * be rewritten. */
+static int interruptReaders(struct fsm *f, struct cursor cursor, unsigned n)
+{
+	struct snapshotDatabase header;
+	struct db *db;
+	struct leader *l;
+	queue *head;
+	unsigned i;
+	int rv;
+
+	for (i = 0; i < n; i++) {
+		rv = snapshotDatabase__decode(&cursor, &header);
+		if (rv != 0) {
+			return rv;
+		}
+		rv = registry__db_get(f->registry, header.filename, &db);
+		if (rv != 0) {
+			return rv;
+		}
+		QUEUE__FOREACH(head, &db->leaders)
+		{
+			l = QUEUE__DATA(head, struct leader, queue);
+			if (l->reading) {
+				leader__interrupt(l);
+			}
+		}
+		cursor.p += header.main_size + header.wal_size;
+	}
+
+	return 0;
+}
+
 static int fsm__restore(struct raft_fsm *fsm, struct raft_buffer *buf)
 {
 	struct fsm *f = fsm->data;
@@ -439,12 +505,29 @@ static int fsm__restore(struct raft_fsm *fsm, struct raft_buffer *buf)
 		return RAFT_MALFORMED;
 	}
 
+	/* Database files are rewritten one VFS call at a time, so reader
+	 * threads must not step through them meanwhile, and they must not
+	 * resume afterwards queries that started before, which would mix rows
+	 * of the two versions. */
+	if (f->registry->readers != NULL) {
+		rv = interruptReaders(f, cursor, header.n);
+		if (rv != 0) {
+			return rv;
+		}
+		readers__pause(f->registry->readers);
+	}
 	for (i = 0; i < header.n; i++) {
 		rv = decodeDatabase(f, &cursor);
 		if (rv != 0) {
-			return rv;
+			break;
 		}
 	}
+	if (f->registry->readers != NULL) {
+		readers__resume(f->registry->readers);
+	}
+	if (rv != 0) {
+		return rv;
+	}
 
 	raft_free(buf->base);
 
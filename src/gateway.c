@@ -1,12 +1,22 @@
+#include <ctype.h>
+#include <stdio.h>
+
 #include "gateway.h"
 
 #include "bind.h"
+#include "checkpoint.h"
+#include "format.h"
 #include "protocol.h"
 #include "query.h"
 #include "request.h"
 #include "response.h"
 #include "vfs.h"
 
+static void query_read_work_cb(struct reader_work *w);
+static void query_read_done_cb(struct reader_work *w);
+static bool is_query(int type);
+static void dump_stop(struct gateway *g);
+
 void gateway__init(struct gateway *g,
 		   struct config *config,
 		   struct registry *registry,
@@ -16,29 +26,184 @@ void gateway__init(struct gateway *g,
 	g->registry = registry;
 	g->raft = raft;
 	g->leader = NULL;
+	g->dbs = NULL;
+	g->leaders = NULL;
+	g->n_dbs = 0;
 	g->req = NULL;
 	g->stmt = NULL;
-	g->stmt_finalize = false;
+	g->stmt_cached = false;
+	g->types = NULL;
+	query_columns__init(&g->cols);
+	g->row_pending = false;
+	g->read.data = g;
+	g->read.work = query_read_work_cb;
+	g->read.done = query_read_done_cb;
+	g->read.state = READER_WORK_IDLE;
+	g->read.readers = NULL;
+	g->reading = false;
+	g->interrupted = false;
+	g->read_rc = 0;
 	g->exec.data = g;
 	g->sql = NULL;
+	g->bulk.n = 0;
+	g->bulk.i = 0;
+	g->bulk.results = NULL;
+	g->bulk.commit = NULL;
+	g->bulk.cached = false;
+	g->bulk.implicit = false;
+	g->bulk.tx_control = false;
+	g->bulk.pending = false;
+	g->bulk.stepping = false;
+	g->dump.db = NULL;
+	g->dump.wal = NULL;
 	stmt__registry_init(&g->stmts);
 	g->barrier.data = g;
+	g->budget.bytes = config->query_batch_bytes;
+	g->budget.rows = config->query_batch_rows;
+	g->time_budget = config->query_time_budget;
+	g->time_left = 0;
+	g->trace.on = false;
 	g->protocol = DQLITE_PROTOCOL_VERSION;
+	g->capabilities = 0;
+}
+
+/* Stop the reader thread producing a batch of rows, waiting for it to give up
+ * the leader connection. */
+static void stop_reading(struct gateway *g)
+{
+	leader__interrupt(g->leader);
+	readers__cancel(&g->read);
+	g->leader->interrupted = false;
+	g->leader->reading = false;
+	g->reading = false;
 }
 
 void gateway__close(struct gateway *g)
 {
+	unsigned i;
+	if (g->reading) {
+		/* A reader thread is producing a batch of rows: stop it before
+		 * finalizing anything. */
+		stop_reading(g);
+		if (!g->stmt_cached) {
+			g->stmt = NULL;
+			g->req = NULL;
+		}
+	}
+	if (g->dump.db != NULL) {
+		dump_stop(g);
+		g->req = NULL;
+	}
 	stmt__registry_close(&g->stmts);
 	if (g->leader != NULL) {
+		if (g->stmt_cached) {
+			/* A query is in progress. */
+			stmt_cache__release(&g->leader->cache, g->stmt);
+			g->stmt_cached = false;
+			g->stmt = NULL;
+			g->req = NULL;
+		}
+		if (g->req != NULL && is_query(g->req->type)) {
+			/* A query of a prepared statement is in progress: the
+			 * statement itself was just finalized. */
+			g->stmt = NULL;
+			g->req = NULL;
+		}
 		if (g->stmt != NULL) {
 			struct raft_apply *req = &g->leader->inflight->req;
 			req->cb(req, RAFT_SHUTDOWN, NULL);
 			assert(g->req == NULL);
 			assert(g->stmt == NULL);
 		}
-		leader__close(g->leader);
-		sqlite3_free(g->leader);
 	}
+	for (i = 0; i < g->n_dbs; i++) {
+		if (g->leaders[i] != NULL) {
+			leader__release(g->leaders[i]);
+		}
+	}
+	sqlite3_free(g->leaders);
+	sqlite3_free(g->dbs);
+	query_columns__close(&g->cols);
+}
+
+/* Whether a prepared statement of the client lives on the connection of the
+ * database with the given ID. */
+static bool has_stmts(struct gateway *g, unsigned id)
+{
+	size_t i;
+	for (i = 0; i < g->stmts.len; i++) {
+		struct stmt *stmt = g->stmts.buf[i];
+		if (stmt != NULL && stmt->db_id == id) {
+			return true;
+		}
+	}
+	return false;
+}
+
+void gateway__idle(struct gateway *g)
+{
+	unsigned i;
+	if (g->req != NULL) {
+		return;
+	}
+	for (i = 0; i < g->n_dbs; i++) {
+		struct leader *l = g->leaders[i];
+		if (l == NULL || !leader__is_clean(l) || has_stmts(g, i)) {
+			continue;
+		}
+		leader__release(l);
+		g->leaders[i] = NULL;
+	}
+	g->leader = NULL;
+}
+
+/* Make sure the open database with the given ID has a leader connection, taking
+ * one from the pool if it was given back, and make it the current one. */
+static int attach(struct gateway *g, unsigned id)
+{
+	int rc;
+	if (g->leaders[id] == NULL) {
+		rc = leader__acquire(g->dbs[id], g->raft, &g->leaders[id]);
+		if (rc != 0) {
+			return rc;
+		}
+		g->leaders[id]->trace = &g->trace;
+	}
+	g->leader = g->leaders[id];
+	return 0;
+}
+
+/* Invoke the request callback with a response of the given type. Once the
+ * last response of the request is out, account for it in the node metrics and
+ * close its trace. */
+static void respond(struct handle *req, int type)
+{
+	struct gateway *g = req->gateway;
+	struct metrics *metrics = &g->registry->metrics;
+	struct trace *trace = &g->trace;
+	bool last;
+
+	/* Streamed requests stay attached until their last response. */
+	last = (type != DQLITE_RESPONSE_ROWS && type != DQLITE_RESPONSE_CHUNK) ||
+	       g->req != req;
+	if (last && req->type < METRICS__REQUEST_TYPES) {
+		if (type == DQLITE_RESPONSE_FAILURE) {
+			metrics->failures[req->type]++;
+		}
+		metrics__observe_since(&metrics->latency[req->type],
+				       req->started);
+	}
+
+	if (!last || !trace->on || trace->span.type != req->type) {
+		req->cb(req, 0, type);
+		return;
+	}
+
+	trace->span.failed = type == DQLITE_RESPONSE_FAILURE;
+	trace__stamp(trace, DQLITE_TRACE_RESPOND);
+	req->cb(req, 0, type);
+	trace__stamp(trace, DQLITE_TRACE_WRITE);
+	tracer__finish(g->registry->tracer, trace);
 }
 
 /* Declare a request struct and a response struct of the appropriate types and
@@ -71,25 +236,32 @@ void gateway__close(struct gateway *g)
 		 * bytes, this can't fail. */                                  \
 		assert(cursor != NULL);                                        \
 		response_##LOWER##__encode(&response, &cursor);                \
-		req->cb(req, 0, DQLITE_RESPONSE_##UPPER);                      \
+		respond(req, DQLITE_RESPONSE_##UPPER);                         \
 	}
 
-/* Lookup the database with the given ID.
- *
- * TODO: support more than one database per connection? */
+/* Lookup the database with the given ID and make its leader connection the
+ * current one. */
 #define LOOKUP_DB(ID)                                                \
-	if (ID != 0 || req->gateway->leader == NULL) {               \
+	if (ID >= req->gateway->n_dbs ||                             \
+	    req->gateway->dbs[ID] == NULL) {                         \
 		failure(req, SQLITE_NOTFOUND, "no database opened"); \
 		return 0;                                            \
+	}                                                            \
+	{                                                            \
+		int rc_ = attach(req->gateway, ID);                  \
+		if (rc_ != 0) {                                      \
+			return rc_;                                  \
+		}                                                    \
 	}
 
-/* Lookup the statement with the given ID. */
-#define LOOKUP_STMT(ID)                                      \
-	stmt = stmt__registry_get(&req->gateway->stmts, ID); \
-	if (stmt == NULL) {                                  \
-		failure(req, SQLITE_NOTFOUND,                \
-			"no statement with the given id");   \
-		return 0;                                    \
+/* Lookup the statement with the given ID, which must belong to the database
+ * of the request. */
+#define LOOKUP_STMT(ID)                                        \
+	stmt = stmt__registry_get(&req->gateway->stmts, ID);   \
+	if (stmt == NULL || stmt->db_id != request.db_id) {    \
+		failure(req, SQLITE_NOTFOUND,                  \
+			"no statement with the given id");     \
+		return 0;                                      \
 	}
 
 /* Encode fa failure response and invoke the request callback */
@@ -107,7 +279,7 @@ static void failure(struct handle *req, int code, const char *message)
 	 * than that. So this can't fail. */
 	assert(cursor != NULL);
 	response_failure__encode(&failure, &cursor);
-	req->cb(req, 0, DQLITE_RESPONSE_FAILURE);
+	respond(req, DQLITE_RESPONSE_FAILURE);
 }
 
 static int handle_leader_legacy(struct handle *req, struct cursor *cursor)
@@ -159,30 +331,68 @@ static int handle_client(struct handle *req, struct cursor *cursor)
 	return 0;
 }
 
+/* Return the ID of the database with the given filename if this gateway has
+ * it open already, or the first free ID otherwise. */
+static unsigned findDb(struct gateway *g, const char *filename)
+{
+	unsigned free_id = g->n_dbs;
+	unsigned i;
+	for (i = 0; i < g->n_dbs; i++) {
+		struct db *db = g->dbs[i];
+		if (db == NULL) {
+			if (free_id == g->n_dbs) {
+				free_id = i;
+			}
+			continue;
+		}
+		if (strcmp(db->filename, filename) == 0) {
+			return i;
+		}
+	}
+	return free_id;
+}
+
 static int handle_open(struct handle *req, struct cursor *cursor)
 {
 	struct gateway *g = req->gateway;
+	struct leader **leaders;
+	struct db **dbs;
 	struct db *db;
+	unsigned id;
 	int rc;
 	START(open, db);
-	if (g->leader != NULL) {
-		failure(req, SQLITE_BUSY,
-			"a database for this connection is already open");
-		return 0;
+	id = findDb(g, request.filename);
+	if (id < g->n_dbs && g->dbs[id] != NULL) {
+		goto out;
+	}
+	if (id == g->n_dbs) {
+		dbs = sqlite3_realloc64(g->dbs, (id + 1) * sizeof *g->dbs);
+		if (dbs == NULL) {
+			return DQLITE_NOMEM;
+		}
+		g->dbs = dbs;
+		leaders = sqlite3_realloc64(g->leaders,
+					    (id + 1) * sizeof *g->leaders);
+		if (leaders == NULL) {
+			return DQLITE_NOMEM;
+		}
+		g->leaders = leaders;
+		g->dbs[id] = NULL;
+		g->leaders[id] = NULL;
+		g->n_dbs++;
 	}
 	rc = registry__db_get(g->registry, request.filename, &db);
 	if (rc != 0) {
 		return rc;
 	}
-	g->leader = sqlite3_malloc(sizeof *g->leader);
-	if (g->leader == NULL) {
-		return DQLITE_NOMEM;
-	}
-	rc = leader__init(g->leader, db, g->raft);
+	g->dbs[id] = db;
+out:
+	rc = attach(g, id);
 	if (rc != 0) {
 		return rc;
 	}
-	response.id = 0;
+	response.id = id;
+	response.__pad__ = 0;
 	SUCCESS(db, DB);
 	return 0;
 }
@@ -200,12 +410,15 @@ static int handle_prepare(struct handle *req, struct cursor *cursor)
 		return rc;
 	}
 	assert(stmt != NULL);
+	stmt->db_id = (uint32_t)request.db_id;
+	g->leader->tx_control = false;
 	rc = sqlite3_prepare_v2(g->leader->conn, request.sql, -1, &stmt->stmt,
 				&tail);
 	if (rc != SQLITE_OK) {
 		failure(req, rc, sqlite3_errmsg(g->leader->conn));
 		return 0;
 	}
+	stmt->tx_control = g->leader->tx_control;
 	response.db_id = request.db_id;
 	response.id = stmt->id;
 	response.params = sqlite3_bind_parameter_count(stmt->stmt);
@@ -264,22 +477,41 @@ static int handle_exec(struct handle *req, struct cursor *cursor)
 	return 0;
 }
 
-/* Step through the given statement and populate the response buffer of the
- * given request with a single batch of rows.
+/* Step through the given statement and encode a single batch of rows in the
+ * response buffer of the given request.
  *
- * A single batch of rows is typically about the size of a memory page. */
-static void query_batch(sqlite3_stmt *stmt, struct handle *req)
+ * This might run on a reader thread, so it must not touch anything but the
+ * statement, its leader connection and the request buffer. */
+static int query_step(struct gateway *g, sqlite3_stmt *stmt, struct handle *req)
 {
-	struct gateway *g = req->gateway;
-	struct response_rows response;
+	uint64_t elapsed;
 	int rc;
 
-	rc = query__batch(stmt, req->buffer);
-	if (rc != SQLITE_ROW && rc != SQLITE_DONE) {
-		sqlite3_reset(stmt);
-		failure(req, rc, sqlite3_errmsg(g->leader->conn));
-		goto done;
+	if (g->time_budget != 0) {
+		leader__start_budget(g->leader, g->time_left);
+	}
+	if (req->flags & DQLITE_MESSAGE_COLUMNAR) {
+		rc = query__batch_columnar(stmt, g->types, &g->cols,
+					   req->buffer, &g->budget,
+					   &g->row_pending);
+	} else {
+		rc = query__batch(stmt, g->types, req->buffer, &g->budget);
+	}
+	if (g->time_budget != 0) {
+		elapsed = leader__stop_budget(g->leader);
+		g->time_left -= elapsed < g->time_left ? elapsed : g->time_left;
 	}
+	return rc;
+}
+
+/* Send the batch of rows encoded by query_step(), or the error it returned. */
+static void query_batch_done(struct gateway *g,
+			     sqlite3_stmt *stmt,
+			     struct handle *req,
+			     int rc)
+{
+	struct response_rows response;
+	char message[64];
 
 	if (rc == SQLITE_ROW) {
 		response.eof = DQLITE_RESPONSE_ROWS_PART;
@@ -287,19 +519,94 @@ static void query_batch(sqlite3_stmt *stmt, struct handle *req)
 		g->stmt = stmt;
 		SUCCESS(rows, ROWS);
 		return;
+	}
+
+	/* Detach the request before sending the last response, so the
+	 * connection can tell that no more batches are coming, even if it tries
+	 * to prefetch one from within the callback. */
+	g->req = NULL;
+
+	if (rc != SQLITE_DONE) {
+		sqlite3_reset(stmt);
+		if (rc == SQLITE_INTERRUPT && g->leader->exceeded) {
+			sprintf(message, "query exceeded its time budget of %u ms",
+				g->time_budget);
+			failure(req, rc, message);
+		} else if (rc == SQLITE_INTERRUPT) {
+			/* The step might not have even started. */
+			failure(req, rc, sqlite3_errstr(rc));
+		} else {
+			failure(req, rc, sqlite3_errmsg(g->leader->conn));
+		}
 	} else {
 		response.eof = DQLITE_RESPONSE_ROWS_DONE;
 		SUCCESS(rows, ROWS);
 	}
 
-done:
-	if (g->stmt_finalize) {
-		/* TODO: do we care about errors? */
-		sqlite3_finalize(stmt);
-		g->stmt_finalize = false;
+	if (g->stmt_cached) {
+		stmt_cache__release(&g->leader->cache, stmt);
+		g->stmt_cached = false;
 	}
+	g->row_pending = false;
 	g->stmt = NULL;
-	g->req = NULL;
+	g->types = NULL;
+	g->leader->db->n_queries++;
+
+	/* This reader might have been the one postponing a checkpoint. */
+	checkpoint__maybe(g->leader->db, g->raft);
+}
+
+static void query_read_work_cb(struct reader_work *w)
+{
+	struct gateway *g = w->data;
+	/* Don't even start if the files of the database might have been
+	 * rewritten since the work was queued, see leader__interrupt(). */
+	if (__atomic_load_n(&g->leader->interrupted, __ATOMIC_RELAXED)) {
+		g->read_rc = SQLITE_INTERRUPT;
+		return;
+	}
+	g->read_rc = query_step(g, g->stmt, g->req);
+}
+
+static void query_read_done_cb(struct reader_work *w)
+{
+	struct gateway *g = w->data;
+	assert(g->reading);
+	g->reading = false;
+	g->leader->interrupted = false;
+	g->leader->reading = false;
+	query_batch_done(g, g->stmt, g->req, g->read_rc);
+}
+
+/* Whether the next batch of rows of the given statement should be produced by
+ * a reader thread. That's the case only for read-only statements running
+ * outside of an explicit transaction, which never reach the replication
+ * hooks. */
+static bool query_offload(struct gateway *g, sqlite3_stmt *stmt)
+{
+	return g->registry->readers != NULL && sqlite3_stmt_readonly(stmt) &&
+	       sqlite3_get_autocommit(g->leader->conn);
+}
+
+/* Produce a single batch of rows of the given statement and send it.
+ *
+ * The size of a batch is bounded by the connection's budget, see query.h. */
+static void query_batch(sqlite3_stmt *stmt, struct handle *req)
+{
+	struct gateway *g = req->gateway;
+	int rc;
+
+	g->leader->db->n_batches++;
+	if (query_offload(g, stmt)) {
+		g->req = req;
+		g->stmt = stmt;
+		g->reading = true;
+		g->leader->reading = true;
+		readers__submit(g->registry->readers, &g->read);
+		return;
+	}
+	rc = query_step(g, stmt, req);
+	query_batch_done(g, stmt, req, rc);
 }
 
 static void query_barrier_cb(struct barrier *barrier, int status)
@@ -319,6 +626,7 @@ static void query_barrier_cb(struct barrier *barrier, int status)
 		return;
 	}
 
+	g->time_left = (uint64_t)g->time_budget * 1000 * 1000;
 	query_batch(stmt, handle);
 }
 
@@ -339,6 +647,7 @@ static int handle_query(struct handle *req, struct cursor *cursor)
 	}
 	g->req = req;
 	g->stmt = stmt->stmt;
+	g->types = &stmt->types;
 	rv = leader__barrier(g->leader, &g->barrier, query_barrier_cb);
 	if (rv != 0) {
 		g->req = NULL;
@@ -375,8 +684,7 @@ static void handle_exec_sql_cb(struct exec *exec, int status)
 		handle_exec_sql_next(req, NULL);
 	} else {
 		failure(req, status, sqlite3_errmsg(g->leader->conn));
-		sqlite3_reset(g->stmt);
-		sqlite3_finalize(g->stmt);
+		stmt_cache__release(&g->leader->cache, g->stmt);
 		g->req = NULL;
 		g->stmt = NULL;
 		g->sql = NULL;
@@ -396,11 +704,12 @@ static void handle_exec_sql_next(struct handle *req, struct cursor *cursor)
 	}
 
 	if (g->stmt != NULL) {
-		sqlite3_finalize(g->stmt);
+		stmt_cache__release(&g->leader->cache, g->stmt);
 		g->stmt = NULL;
 	}
 
-	rv = sqlite3_prepare_v2(g->leader->conn, g->sql, -1, &stmt, &tail);
+	rv = stmt_cache__prepare(&g->leader->cache, g->leader->conn, g->sql,
+				 &stmt, &tail, &g->leader->tx_control);
 	if (rv != SQLITE_OK) {
 		failure(req, rv, sqlite3_errmsg(g->leader->conn));
 		goto done;
@@ -440,7 +749,7 @@ success:
 
 done_after_prepare:
 	if (g->stmt != NULL) {
-		sqlite3_finalize(g->stmt);
+		stmt_cache__release(&g->leader->cache, g->stmt);
 	}
 done:
 	g->req = NULL;
@@ -463,6 +772,340 @@ static int handle_exec_sql(struct handle *req, struct cursor *cursor)
 	return 0;
 }
 
+static void bulk_next(struct handle *req);
+
+static void bulk_cb(struct exec *exec, int status)
+{
+	struct gateway *g = exec->data;
+	(void)status;
+	if (g->bulk.stepping) {
+		/* The step completed synchronously, bulk_next() will pick up
+		 * its result. */
+		return;
+	}
+	bulk_next(g->req);
+}
+
+/* Release the statement of the batch item that was just executed. */
+static void batch_item_done(struct gateway *g)
+{
+	if (g->bulk.cached) {
+		stmt_cache__release(&g->leader->cache, g->stmt);
+		g->bulk.cached = false;
+	} else if (g->stmt != NULL) {
+		sqlite3_reset(g->stmt);
+	}
+	g->stmt = NULL;
+}
+
+/* Decode the next item of a BATCH request, and set the gateway statement to
+ * the one it refers to, with its parameters bound. */
+static int batch_item(struct gateway *g, char *message, size_t size)
+{
+	struct bulk *b = &g->bulk;
+	struct request_batch_item item;
+	struct stmt *stmt;
+	const char *tail;
+	int rv;
+
+	rv = request_batch_item__decode(&b->cursor, &item);
+	if (rv != 0) {
+		snprintf(message, size, "decode statement");
+		return rv;
+	}
+
+	if (strcmp(item.sql, "") == 0) {
+		stmt = stmt__registry_get(&g->stmts, item.stmt_id);
+		if (stmt == NULL || stmt->db_id != b->db_id) {
+			snprintf(message, size, "no statement with the given id");
+			return SQLITE_NOTFOUND;
+		}
+		g->stmt = stmt->stmt;
+		b->tx_control = stmt->tx_control;
+	} else {
+		rv = stmt_cache__prepare(&g->leader->cache, g->leader->conn,
+					 item.sql, &g->stmt, &tail,
+					 &g->leader->tx_control);
+		if (rv != SQLITE_OK) {
+			snprintf(message, size, "%s",
+				 sqlite3_errmsg(g->leader->conn));
+			return rv;
+		}
+		if (g->stmt == NULL) {
+			snprintf(message, size, "empty statement");
+			return SQLITE_MISUSE;
+		}
+		g->bulk.cached = true;
+		b->tx_control = g->leader->tx_control;
+		while (isspace((unsigned char)*tail)) {
+			tail++;
+		}
+		if (*tail != '\0') {
+			snprintf(message, size, "more than one statement");
+			return SQLITE_MISUSE;
+		}
+	}
+
+	rv = bind__params(g->stmt, &b->cursor);
+	if (rv != 0) {
+		snprintf(message, size, "%s", sqlite3_errmsg(g->leader->conn));
+		return rv;
+	}
+
+	return 0;
+}
+
+/* Encode the response of a BATCH request, with one result per statement. */
+static void batch_success(struct handle *req)
+{
+	struct gateway *g = req->gateway;
+	struct response_results response;
+	void *cursor;
+	size_t n;
+	uint64_t i;
+
+	response.n = g->bulk.i;
+	n = response_results__sizeof(&response);
+	for (i = 0; i < response.n; i++) {
+		n += response_result__sizeof(&g->bulk.results[i]);
+	}
+	cursor = buffer__advance(req->buffer, n);
+	if (cursor == NULL) {
+		failure(req, DQLITE_NOMEM, "encode results");
+		return;
+	}
+	response_results__encode(&response, &cursor);
+	for (i = 0; i < response.n; i++) {
+		response_result__encode(&g->bulk.results[i], &cursor);
+	}
+	respond(req, DQLITE_RESPONSE_RESULTS);
+}
+
+/* Drive an EXEC_BULK or BATCH request, executing one statement for each of the
+ * remaining items and then committing the implicit transaction, if we opened
+ * one.
+ *
+ * Steps run in a loop rather than recursively from the exec callback, since
+ * inside a transaction they usually complete synchronously. The loop returns
+ * early when a step needs to wait for raft, and bulk_cb() resumes it. */
+static void bulk_next(struct handle *req)
+{
+	struct gateway *g = req->gateway;
+	struct bulk *b = &g->bulk;
+	struct response_result response;
+	bool is_batch = req->type == DQLITE_REQUEST_BATCH;
+	char message[256];
+	sqlite3_stmt *stmt;
+	const char *tail;
+	int rv;
+
+	while (1) {
+		if (b->pending) {
+			if (!g->exec.done) {
+				return;
+			}
+			b->pending = false;
+			if (g->exec.status != SQLITE_DONE) {
+				rv = g->exec.status;
+				goto err;
+			}
+			if (g->exec.stmt == b->commit) {
+				break;
+			}
+			/* Safety net for statements that ended the transaction
+			 * without being recognized as doing so. */
+			if (b->implicit && sqlite3_get_autocommit(g->leader->conn)) {
+				rv = SQLITE_MISUSE;
+				snprintf(message, sizeof message,
+					 "transaction ended by statement");
+				goto err_with_message;
+			}
+			if (is_batch) {
+				fill_result(g, &b->results[b->i]);
+				batch_item_done(g);
+			} else {
+				b->rows_affected +=
+				    sqlite3_changes(g->leader->conn);
+			}
+			b->i++;
+		}
+
+		if (b->i < b->n) {
+			if (is_batch) {
+				rv = batch_item(g, message, sizeof message);
+				if (rv != 0) {
+					goto err_with_message;
+				}
+			} else {
+				rv = bind__params(g->stmt, &b->cursor);
+				if (rv != 0) {
+					goto err;
+				}
+			}
+			/* The whole request must be applied with a single
+			 * commit, so it can't end our transaction itself. */
+			if (b->implicit && b->tx_control) {
+				rv = SQLITE_MISUSE;
+				snprintf(message, sizeof message,
+					 "transaction control statement");
+				goto err_with_message;
+			}
+			stmt = g->stmt;
+		} else if (b->implicit && b->commit == NULL) {
+			/* All items were executed: committing now replicates
+			 * the whole request with a single frames command. */
+			rv = stmt_cache__prepare(&g->leader->cache,
+						 g->leader->conn, "COMMIT",
+						 &b->commit, &tail,
+						 &g->leader->tx_control);
+			if (rv != SQLITE_OK) {
+				goto err;
+			}
+			stmt = b->commit;
+		} else {
+			break;
+		}
+
+		b->pending = true;
+		b->stepping = true;
+		rv = leader__exec(g->leader, &g->exec, stmt, bulk_cb);
+		b->stepping = false;
+		if (rv != 0) {
+			b->pending = false;
+			goto err;
+		}
+	}
+
+	if (b->commit != NULL) {
+		stmt_cache__release(&g->leader->cache, b->commit);
+		b->commit = NULL;
+	}
+	b->implicit = false;
+	g->req = NULL;
+	g->stmt = NULL;
+	if (is_batch) {
+		batch_success(req);
+		sqlite3_free(b->results);
+		b->results = NULL;
+	} else {
+		response.last_insert_id =
+		    sqlite3_last_insert_rowid(g->leader->conn);
+		response.rows_affected = b->rows_affected;
+		SUCCESS(result, RESULT);
+	}
+	return;
+
+err:
+	snprintf(message, sizeof message, "%s",
+		 sqlite3_errmsg(g->leader->conn));
+err_with_message:
+	if (is_batch) {
+		char prefixed[sizeof message + 32];
+		snprintf(prefixed, sizeof prefixed, "statement %llu: %s",
+			 (unsigned long long)b->i, message);
+		failure(req, rv, prefixed);
+		batch_item_done(g);
+		sqlite3_free(b->results);
+		b->results = NULL;
+	} else {
+		failure(req, rv, message);
+		sqlite3_reset(g->stmt);
+	}
+	if (b->commit != NULL) {
+		stmt_cache__release(&g->leader->cache, b->commit);
+		b->commit = NULL;
+	}
+	/* Don't leave a half-applied request behind. If the client had started
+	 * the transaction itself, it's up to the client to roll it back. */
+	if (b->implicit && !sqlite3_get_autocommit(g->leader->conn)) {
+		sqlite3_exec(g->leader->conn, "ROLLBACK", NULL, NULL, NULL);
+	}
+	b->implicit = false;
+	g->req = NULL;
+	g->stmt = NULL;
+}
+
+/* Unless the client is already in a transaction, open one of our own to wrap
+ * all the statements of an EXEC_BULK or BATCH request. */
+static int bulk_begin(struct gateway *g, uint64_t n)
+{
+	int rv;
+	g->bulk.implicit = false;
+	if (n > 0 && sqlite3_get_autocommit(g->leader->conn)) {
+		rv = sqlite3_exec(g->leader->conn, "BEGIN", NULL, NULL, NULL);
+		if (rv != SQLITE_OK) {
+			return rv;
+		}
+		g->bulk.implicit = true;
+	}
+	return 0;
+}
+
+static int handle_exec_bulk(struct handle *req, struct cursor *cursor)
+{
+	struct gateway *g = req->gateway;
+	struct stmt *stmt;
+	int rv;
+	START(exec_bulk, result);
+	CHECK_LEADER(req);
+	LOOKUP_DB(request.db_id);
+	LOOKUP_STMT(request.stmt_id);
+	(void)response;
+	assert(g->req == NULL);
+	assert(g->stmt == NULL);
+	rv = bulk_begin(g, request.n);
+	if (rv != 0) {
+		failure(req, rv, sqlite3_errmsg(g->leader->conn));
+		return 0;
+	}
+	g->bulk.cursor = *cursor;
+	g->bulk.db_id = (uint32_t)request.db_id;
+	g->bulk.n = request.n;
+	g->bulk.i = 0;
+	g->bulk.rows_affected = 0;
+	g->bulk.tx_control = stmt->tx_control;
+	g->req = req;
+	g->stmt = stmt->stmt;
+	bulk_next(req);
+	return 0;
+}
+
+static int handle_batch(struct handle *req, struct cursor *cursor)
+{
+	struct gateway *g = req->gateway;
+	int rv;
+	START(batch, results);
+	CHECK_LEADER(req);
+	LOOKUP_DB(request.db_id);
+	(void)response;
+	assert(g->req == NULL);
+	assert(g->stmt == NULL);
+
+	/* Each item takes at least three words: the statement ID, the SQL text
+	 * and the parameters header. */
+	if (request.n > cursor->cap / 24) {
+		return DQLITE_PARSE;
+	}
+	g->bulk.results = sqlite3_malloc64(request.n * sizeof *g->bulk.results);
+	if (request.n > 0 && g->bulk.results == NULL) {
+		return DQLITE_NOMEM;
+	}
+	rv = bulk_begin(g, request.n);
+	if (rv != 0) {
+		sqlite3_free(g->bulk.results);
+		g->bulk.results = NULL;
+		failure(req, rv, sqlite3_errmsg(g->leader->conn));
+		return 0;
+	}
+	g->bulk.cursor = *cursor;
+	g->bulk.db_id = (uint32_t)request.db_id;
+	g->bulk.n = request.n;
+	g->bulk.i = 0;
+	g->req = req;
+	bulk_next(req);
+	return 0;
+}
+
 static int handle_query_sql(struct handle *req, struct cursor *cursor)
 {
 	struct gateway *g = req->gateway;
@@ -472,23 +1115,27 @@ static int handle_query_sql(struct handle *req, struct cursor *cursor)
 	CHECK_LEADER(req);
 	LOOKUP_DB(request.db_id);
 	(void)response;
-	rv = sqlite3_prepare_v2(g->leader->conn, request.sql, -1, &g->stmt,
-				&tail);
+	rv = stmt_cache__prepare(&g->leader->cache, g->leader->conn,
+				 request.sql, &g->stmt, &tail,
+				 &g->leader->tx_control);
 	if (rv != SQLITE_OK) {
 		failure(req, rv, sqlite3_errmsg(g->leader->conn));
 		return 0;
 	}
 	rv = bind__params(g->stmt, cursor);
 	if (rv != 0) {
-		sqlite3_finalize(g->stmt);
+		stmt_cache__release(&g->leader->cache, g->stmt);
 		g->stmt = NULL;
 		failure(req, rv, sqlite3_errmsg(g->leader->conn));
 		return 0;
 	}
-	g->stmt_finalize = true;
+	g->stmt_cached = true;
+	g->types = stmt_cache__types(&g->leader->cache, g->stmt);
 	g->req = req;
 	rv = leader__barrier(g->leader, &g->barrier, query_barrier_cb);
 	if (rv != 0) {
+		stmt_cache__release(&g->leader->cache, g->stmt);
+		g->stmt_cached = false;
 		g->req = NULL;
 		g->stmt = NULL;
 		return rv;
@@ -496,24 +1143,256 @@ static int handle_query_sql(struct handle *req, struct cursor *cursor)
 	return 0;
 }
 
-static int handle_interrupt(struct handle *req, struct cursor *cursor)
+/* Serve a stale read of the statement currently set on the gateway.
+ *
+ * On the leader this is no different than a regular query, and a barrier is
+ * submitted as usual. On any other node the statement is run against the local
+ * copy of the database, as long as the FSM has applied at least the log entry
+ * with the given index. If it hasn't, the read is rejected with SQLITE_BUSY and
+ * the client is expected to retry later or against another node. */
+static int query_stale(struct handle *req, uint64_t min_index)
 {
 	struct gateway *g = req->gateway;
-	START(interrupt, empty);
+	raft_index applied;
+	char message[128];
+	int rv;
+
+	if (!sqlite3_stmt_readonly(g->stmt)) {
+		strcpy(message, "statement is not read-only");
+		rv = SQLITE_READONLY;
+		goto err;
+	}
+
+	if (raft_state(g->raft) == RAFT_LEADER) {
+		rv = leader__barrier(g->leader, &g->barrier, query_barrier_cb);
+		if (rv != 0) {
+			goto err_after_stmt;
+		}
+		return 0;
+	}
+
+	applied = raft_last_applied(g->raft);
+	if (applied < min_index) {
+		sprintf(message, "applied index %llu is behind %llu",
+			(unsigned long long)applied,
+			(unsigned long long)min_index);
+		rv = SQLITE_BUSY;
+		goto err;
+	}
 
+	query_barrier_cb(&g->barrier, 0);
+	return 0;
+
+err:
+	failure(req, rv, message);
+	rv = 0;
+err_after_stmt:
+	if (g->stmt_cached) {
+		stmt_cache__release(&g->leader->cache, g->stmt);
+		g->stmt_cached = false;
+	}
+	g->req = NULL;
+	g->stmt = NULL;
+	return rv;
+}
+
+static int handle_query_stale(struct handle *req, struct cursor *cursor)
+{
+	struct gateway *g = req->gateway;
+	struct stmt *stmt;
+	int rv;
+	START(query_stale, rows);
+	LOOKUP_DB(request.db_id);
+	LOOKUP_STMT(request.stmt_id);
+	(void)response;
+	rv = bind__params(stmt->stmt, cursor);
+	if (rv != 0) {
+		failure(req, rv, sqlite3_errmsg(g->leader->conn));
+		return 0;
+	}
+	g->req = req;
+	g->stmt = stmt->stmt;
+	g->types = &stmt->types;
+	return query_stale(req, request.min_index);
+}
+
+static int handle_query_sql_stale(struct handle *req, struct cursor *cursor)
+{
+	struct gateway *g = req->gateway;
+	const char *tail;
+	int rv;
+	START(query_sql_stale, rows);
+	LOOKUP_DB(request.db_id);
+	(void)response;
+	rv = stmt_cache__prepare(&g->leader->cache, g->leader->conn,
+				 request.sql, &g->stmt, &tail,
+				 &g->leader->tx_control);
+	if (rv != SQLITE_OK) {
+		failure(req, rv, sqlite3_errmsg(g->leader->conn));
+		return 0;
+	}
+	rv = bind__params(g->stmt, cursor);
+	if (rv != 0) {
+		stmt_cache__release(&g->leader->cache, g->stmt);
+		g->stmt = NULL;
+		failure(req, rv, sqlite3_errmsg(g->leader->conn));
+		return 0;
+	}
+	g->stmt_cached = true;
+	g->types = stmt_cache__types(&g->leader->cache, g->stmt);
+	g->req = req;
+	return query_stale(req, request.min_index);
+}
+
+/* Drop the query or dump in progress, if any, without sending anything. */
+static void drop_request(struct gateway *g)
+{
 	/* Take appropriate action depending on the cleanup code. */
-	if (g->stmt_finalize) {
-		sqlite3_finalize(g->stmt);
-		g->stmt_finalize = false;
+	if (g->reading) {
+		stop_reading(g);
 	}
+	if (g->dump.db != NULL) {
+		dump_stop(g);
+	}
+	if (g->stmt_cached) {
+		stmt_cache__release(&g->leader->cache, g->stmt);
+		g->stmt_cached = false;
+	}
+	g->row_pending = false;
 	g->stmt = NULL;
 	g->req = NULL;
+}
+
+static int handle_interrupt(struct handle *req, struct cursor *cursor)
+{
+	struct gateway *g = req->gateway;
+	START(interrupt, empty);
+
+	drop_request(g);
+	g->interrupted = false;
 
 	SUCCESS(empty, EMPTY);
 
 	return 0;
 }
 
+/* Upper bound for the size of a batch of query rows that clients can ask
+ * for. */
+#define MAX_QUERY_BATCH_BYTES (16 * 1024 * 1024)
+
+static int handle_option(struct handle *req, struct cursor *cursor)
+{
+	struct gateway *g = req->gateway;
+	unsigned max;
+	START(option, empty);
+	switch (request.option) {
+		case DQLITE_OPTION_BATCH_BYTES:
+			if (request.value == 0) {
+				request.value = g->config->query_batch_bytes;
+			}
+			if (request.value > MAX_QUERY_BATCH_BYTES) {
+				request.value = MAX_QUERY_BATCH_BYTES;
+			}
+			g->budget.bytes = (size_t)request.value;
+			break;
+		case DQLITE_OPTION_BATCH_ROWS:
+			if (request.value > UINT32_MAX) {
+				request.value = 0;
+			}
+			g->budget.rows = (unsigned)request.value;
+			break;
+		case DQLITE_OPTION_TIME_BUDGET:
+			/* Clients can lower the node-wide limit, if any, but
+			 * not raise it. */
+			max = g->config->query_time_budget;
+			if (request.value == 0 ||
+			    (max != 0 && request.value > max)) {
+				request.value = max;
+			}
+			if (request.value > UINT32_MAX) {
+				request.value = UINT32_MAX;
+			}
+			g->time_budget = (unsigned)request.value;
+			break;
+		default:
+			failure(req, SQLITE_NOTFOUND, "unknown option");
+			return 0;
+	}
+	SUCCESS(empty, EMPTY);
+	return 0;
+}
+
+static int handle_capabilities(struct handle *req, struct cursor *cursor)
+{
+	struct gateway *g = req->gateway;
+	START(capabilities, capabilities);
+
+	/* Settle on the capabilities that both sides support. Unknown bits are
+	 * dropped, so clients can advertise capabilities of later versions. */
+	g->capabilities = request.capabilities & DQLITE_CAPABILITIES;
+	response.capabilities = g->capabilities;
+
+	SUCCESS(capabilities, CAPABILITIES);
+	return 0;
+}
+
+/* Encode the node counters, followed by the number of requests, failures and
+ * total time in microseconds of each request type that was ever handled. */
+static int handle_metrics(struct handle *req, struct cursor *cursor)
+{
+	struct gateway *g = req->gateway;
+	struct dqlite_node_metrics metrics;
+	uint64_t values[4];
+	uint64_t type;
+	unsigned i;
+	void *cur;
+	START(metrics, metrics);
+
+	metrics__snapshot(g->registry, g->raft, &metrics);
+
+	response.term = metrics.term;
+	response.commit_index = metrics.commit_index;
+	response.last_applied = metrics.last_applied;
+	response.last_index = metrics.last_index;
+	response.databases = metrics.databases;
+	response.connections = metrics.connections;
+	response.applies = metrics.applies;
+	response.apply_failures = metrics.apply_failures;
+	response.apply_bytes = metrics.apply_bytes;
+	response.queries = metrics.queries;
+	response.checkpoints = metrics.checkpoints;
+	response.n = 0;
+	for (type = 0; type < DQLITE_METRICS_REQUEST_TYPES; type++) {
+		if (metrics.requests[type] > 0) {
+			response.n++;
+		}
+	}
+
+	cur = buffer__advance(req->buffer,
+			      response_metrics__sizeof(&response) +
+				  response.n * sizeof values);
+	if (cur == NULL) {
+		failure(req, DQLITE_NOMEM, "failed to encode metrics");
+		return 0;
+	}
+	response_metrics__encode(&response, &cur);
+	for (type = 0; type < DQLITE_METRICS_REQUEST_TYPES; type++) {
+		if (metrics.requests[type] == 0) {
+			continue;
+		}
+		values[0] = type;
+		values[1] = metrics.requests[type];
+		values[2] = metrics.request_failures[type];
+		values[3] = metrics.request_latency[type].sum;
+		for (i = 0; i < 4; i++) {
+			uint64__encode(&values[i], &cur);
+		}
+	}
+
+	respond(req, DQLITE_RESPONSE_METRICS);
+	return 0;
+}
+
 /* Translate a raft error to a dqlite one. */
 static int translateRaftErrCode(int code)
 {
@@ -698,13 +1577,12 @@ static int dumpFile(struct gateway *g,
 	assert(len % 8 == 0);
 	assert(buf != NULL);
 
-	cur = buffer__advance(buffer, len);
-	if (cur == NULL) {
+	/* Reference the file content instead of copying it into the response
+	 * buffer, it will be released once sent. */
+	rv = buffer__attach(buffer, buf, len, sqlite3_free);
+	if (rv != 0) {
 		goto oom;
 	}
-	memcpy(cur, buf, len);
-
-	sqlite3_free(buf);
 
 	return 0;
 
@@ -713,6 +1591,168 @@ oom:
 	return DQLITE_NOMEM;
 }
 
+/* Smallest chunk of a streamed dump, fitting the WAL header and a frame of the
+ * largest page size. */
+#define MIN_DUMP_CHUNK_BYTES                                   \
+	(FORMAT__WAL_HDR_SIZE + FORMAT__WAL_FRAME_HDR_SIZE + \
+	 FORMAT__PAGE_SIZE_MAX)
+
+static void dump_stop(struct gateway *g)
+{
+	assert(g->dump.db != NULL);
+	db__dump_stop(g->dump.db, g->dump.gen);
+	g->dump.db = NULL;
+	sqlite3_free(g->dump.wal);
+	g->dump.wal = NULL;
+}
+
+/* Send the next chunk of a streamed dump. Each chunk holds whole pages, read
+ * straight from the VFS into the response buffer, and is followed by a marker
+ * telling whether more chunks will follow. */
+static void dump_chunk(struct gateway *g, struct handle *req)
+{
+	struct dump *d = &g->dump;
+	struct response_chunk response;
+	const char *filename;
+	size_t header;
+	size_t chunk;
+	size_t size;
+	size_t n;
+	uint64_t eof;
+	void *cur;
+	int rv;
+
+	/* The dump took too long and checkpoints were let go ahead. */
+	if (!db__dumping(d->db) || d->gen != d->db->dumps_gen) {
+		rv = SQLITE_ABORT;
+		goto err;
+	}
+
+	filename = d->file == 0 ? d->db->filename : d->wal;
+
+	chunk = g->config->dump_chunk_bytes;
+	if (chunk < MIN_DUMP_CHUNK_BYTES) {
+		chunk = MIN_DUMP_CHUNK_BYTES;
+	}
+	if (chunk > d->size[d->file] - d->offset) {
+		/* Leave out content added after the dump started. */
+		chunk = d->size[d->file] - d->offset;
+	}
+
+	response.filename = filename;
+	response.size = d->size[d->file];
+	response.offset = d->offset;
+	response.len = 0;
+
+	/* The header is encoded once the size of the chunk is known. */
+	header = buffer__offset(req->buffer);
+	if (buffer__advance(req->buffer, response_chunk__sizeof(&response)) ==
+	    NULL) {
+		rv = DQLITE_NOMEM;
+		goto err;
+	}
+	cur = buffer__reserve(req->buffer, chunk + sizeof eof);
+	if (cur == NULL) {
+		rv = DQLITE_NOMEM;
+		goto err;
+	}
+	rv = VfsFileReadChunk(g->config->name, filename, d->offset, cur, chunk,
+			      &n, &size);
+	if (rv != 0) {
+		goto err;
+	}
+	if (n == 0 && chunk > 0) {
+		/* The file shrank, which means it was checkpointed or
+		 * truncated by some other node. */
+		rv = SQLITE_ABORT;
+		goto err;
+	}
+	assert(n % 8 == 0);
+	buffer__advance(req->buffer, n);
+
+	response.len = n;
+	cur = buffer__cursor(req->buffer, header);
+	response_chunk__encode(&response, &cur);
+
+	d->offset += n;
+	if (d->offset == d->size[d->file]) {
+		d->file++;
+		d->offset = 0;
+	}
+
+	eof = d->file == 2 ? DQLITE_RESPONSE_ROWS_DONE
+			   : DQLITE_RESPONSE_ROWS_PART;
+	cur = buffer__advance(req->buffer, uint64__sizeof(&eof));
+	assert(cur != NULL); /* Space was reserved above. */
+	uint64__encode(&eof, &cur);
+
+	if (eof == DQLITE_RESPONSE_ROWS_DONE) {
+		dump_stop(g);
+		g->req = NULL;
+	} else {
+		g->req = req;
+	}
+	respond(req, DQLITE_RESPONSE_CHUNK);
+	return;
+
+err:
+	dump_stop(g);
+	g->req = NULL;
+	buffer__reset(req->buffer);
+	failure(req, rv, "failed to dump database");
+}
+
+/* Start streaming the database and WAL files, as they are now, in chunks. */
+static int dump_start(struct handle *req, const char *filename)
+{
+	struct gateway *g = req->gateway;
+	struct db *db;
+	size_t n;
+	int rv;
+
+	assert(g->dump.db == NULL);
+
+	g->dump.wal = sqlite3_mprintf("%s-wal", filename);
+	if (g->dump.wal == NULL) {
+		failure(req, DQLITE_NOMEM, "failed to dump database");
+		return 0;
+	}
+
+	/* Snapshot the current file sizes: checkpoints are postponed until the
+	 * dump is done or times out, so the database content won't change, and
+	 * the WAL will only grow past its current size. */
+	rv = VfsFileReadChunk(g->config->name, filename, 0, NULL, 0, &n,
+			      &g->dump.size[0]);
+	if (rv != 0) {
+		goto err;
+	}
+	rv = VfsFileReadChunk(g->config->name, g->dump.wal, 0, NULL, 0, &n,
+			      &g->dump.size[1]);
+	if (rv != 0) {
+		goto err;
+	}
+
+	rv = registry__db_get(g->registry, filename, &db);
+	if (rv != 0) {
+		goto err;
+	}
+
+	g->dump.gen = db__dump_start(db);
+	g->dump.db = db;
+	g->dump.file = 0;
+	g->dump.offset = 0;
+
+	dump_chunk(g, req);
+
+	return 0;
+
+err:
+	sqlite3_free(g->dump.wal);
+	g->dump.wal = NULL;
+	failure(req, rv, "failed to dump database");
+	return 0;
+}
+
 static int handle_dump(struct handle *req, struct cursor *cursor)
 {
 	struct gateway *g = req->gateway;
@@ -721,6 +1761,10 @@ static int handle_dump(struct handle *req, struct cursor *cursor)
 	char filename[1024];
 	START(dump, files);
 
+	if (req->flags & DQLITE_MESSAGE_CHUNKED) {
+		return dump_start(req, request.filename);
+	}
+
 	response.n = 2;
 	cur = buffer__advance(req->buffer, response_files__sizeof(&response));
 	assert(cur != NULL);
@@ -741,7 +1785,7 @@ static int handle_dump(struct handle *req, struct cursor *cursor)
 		return 0;
 	}
 
-	req->cb(req, 0, DQLITE_RESPONSE_FILES);
+	respond(req, DQLITE_RESPONSE_FILES);
 
 	return 0;
 }
@@ -822,7 +1866,7 @@ static int handle_cluster(struct handle *req, struct cursor *cursor)
 		}
 	}
 
-	req->cb(req, 0, DQLITE_RESPONSE_SERVERS);
+	respond(req, DQLITE_RESPONSE_SERVERS);
 
 	return 0;
 }
@@ -868,6 +1912,15 @@ static int handle_transfer(struct handle *req, struct cursor *cursor)
 	return 0;
 }
 
+/* Return true if the given request type streams back rows. */
+static bool is_query(int type)
+{
+	return type == DQLITE_REQUEST_QUERY ||
+	       type == DQLITE_REQUEST_QUERY_SQL ||
+	       type == DQLITE_REQUEST_QUERY_STALE ||
+	       type == DQLITE_REQUEST_QUERY_SQL_STALE;
+}
+
 int gateway__handle(struct gateway *g,
 		    struct handle *req,
 		    int type,
@@ -879,24 +1932,50 @@ int gateway__handle(struct gateway *g,
 
 	/* Check if there is a request in progress. */
 	if (g->req != NULL && type != DQLITE_REQUEST_HEARTBEAT) {
-		if (g->req->type == DQLITE_REQUEST_QUERY ||
-		    g->req->type == DQLITE_REQUEST_QUERY_SQL) {
-			/* TODO: handle interrupt requests */
-			assert(type == DQLITE_REQUEST_INTERRUPT);
+		if (is_query(g->req->type) ||
+		    g->req->type == DQLITE_REQUEST_DUMP) {
+			/* Only interrupts are allowed while rows or chunks are
+			 * being sent. Runaway steps on the loop thread are cut
+			 * off by the query time budget instead, since the loop
+			 * is blocked while stepping, see also
+			 * gateway__interrupt(). */
+			if (type != DQLITE_REQUEST_INTERRUPT) {
+				return SQLITE_BUSY;
+			}
 			goto handle;
 		}
 		if (g->req->type == DQLITE_REQUEST_EXEC ||
-		    g->req->type == DQLITE_REQUEST_EXEC_SQL) {
+		    g->req->type == DQLITE_REQUEST_EXEC_SQL ||
+		    g->req->type == DQLITE_REQUEST_EXEC_BULK ||
+		    g->req->type == DQLITE_REQUEST_BATCH) {
 			return SQLITE_BUSY;
 		}
 		assert(0);
 	}
 
 handle:
+	/* Requests handled while another one is in progress are not traced,
+	 * since the trace belongs to the latter. */
+	if (g->req == NULL) {
+		tracer__start(g->registry->tracer, &g->trace, type);
+	}
+
+	/* Agreed capabilities apply to every request, as if the client had set
+	 * the matching message flags. */
+	if (g->capabilities & DQLITE_CAPABILITY_COLUMNAR) {
+		req->flags |= DQLITE_MESSAGE_COLUMNAR;
+	}
+	if (g->capabilities & DQLITE_CAPABILITY_CHUNKED) {
+		req->flags |= DQLITE_MESSAGE_CHUNKED;
+	}
 	req->type = type;
 	req->gateway = g;
 	req->cb = cb;
 	req->buffer = buffer;
+	req->started = metrics__now();
+	if (type < METRICS__REQUEST_TYPES) {
+		g->registry->metrics.requests[type]++;
+	}
 
 	switch (type) {
 #define DISPATCH(LOWER, UPPER, _)                 \
@@ -909,15 +1988,44 @@ handle:
 	return rc;
 }
 
-int gateway__resume(struct gateway *g, bool *finished)
+int gateway__resume(struct gateway *g, struct buffer *buffer, bool *finished)
 {
-	if (g->req == NULL || (g->req->type != DQLITE_REQUEST_QUERY &&
-			       g->req->type != DQLITE_REQUEST_QUERY_SQL)) {
+	if (g->interrupted) {
+		/* The client gave up on this request, see
+		 * gateway__interrupt(). */
+		drop_request(g);
 		*finished = true;
 		return 0;
 	}
+	if (g->req != NULL && g->req->type == DQLITE_REQUEST_DUMP) {
+		assert(g->dump.db != NULL);
+		*finished = false;
+		g->req->buffer = buffer;
+		dump_chunk(g, g->req);
+		return 0;
+	}
+	if (g->req == NULL || !is_query(g->req->type)) {
+		*finished = true;
+		return 0;
+	}
+	assert(!g->reading);
 	assert(g->stmt != NULL);
 	*finished = false;
+	g->req->buffer = buffer;
 	query_batch(g->stmt, g->req);
 	return 0;
 }
+
+void gateway__interrupt(struct gateway *g)
+{
+	if (g->req == NULL) {
+		return;
+	}
+	if (!is_query(g->req->type) && g->req->type != DQLITE_REQUEST_DUMP) {
+		return;
+	}
+	g->interrupted = true;
+	if (g->reading) {
+		leader__interrupt(g->leader);
+	}
+}
@@ -14,11 +14,48 @@
 
 #include "config.h"
 #include "leader.h"
+#include "query.h"
+#include "readers.h"
 #include "registry.h"
+#include "response.h"
 #include "stmt.h"
+#include "trace.h"
 
 struct handle;
 
+/**
+ * State of an EXEC_BULK or BATCH request, executing a sequence of statements
+ * inside a single transaction.
+ */
+struct bulk
+{
+	struct cursor cursor;            /* Items not yet executed */
+	uint32_t db_id;                  /* Database the request targets */
+	uint64_t n;                      /* Total number of items */
+	uint64_t i;                      /* Index of the current item */
+	uint64_t rows_affected;          /* Sum of the changes made so far */
+	struct response_result *results; /* Per-statement results of BATCH */
+	sqlite3_stmt *commit;            /* COMMIT statement, once all done */
+	bool implicit;                   /* Whether we opened the transaction */
+	bool tx_control;                 /* Whether the item ends a transaction */
+	bool cached;                     /* Whether the statement is cached */
+	bool pending;                    /* Whether a step was submitted */
+	bool stepping;                   /* Whether leader__exec() is running */
+};
+
+/**
+ * State of a DUMP request streamed in chunks, see DQLITE_MESSAGE_CHUNKED.
+ */
+struct dump
+{
+	struct db *db;          /* Database being dumped, NULL if none */
+	char *wal;              /* Name of the WAL file */
+	unsigned file;          /* 0 for the database and 1 for the WAL */
+	size_t offset;          /* Offset of the next chunk of the file */
+	size_t size[2];         /* Database and WAL size at the start */
+	unsigned long long gen; /* Generation, see db__dump_start() */
+};
+
 /**
  * Handle requests from a single connected client and forward them to
  * SQLite.
@@ -28,15 +65,32 @@ struct gateway
 	struct config *config;       /* Configuration */
 	struct registry *registry;   /* Register of existing databases */
 	struct raft *raft;           /* Raft instance */
-	struct leader *leader;       /* Leader connection to the database */
+	struct leader *leader;       /* Leader connection of current request */
+	struct db **dbs;             /* Open databases, indexed by ID */
+	struct leader **leaders;     /* Their connections, NULL if idle */
+	unsigned n_dbs;              /* Size of the dbs and leaders arrays */
 	struct handle *req;          /* Asynchronous request being handled */
 	sqlite3_stmt *stmt;          /* Statement being processed */
-	bool stmt_finalize;          /* Whether to finalize the statement */
+	bool stmt_cached;            /* Whether the statement is from the cache */
+	struct query_types *types;   /* Declared column types of the statement */
+	struct query_columns cols;   /* Buffers of columnar batches */
+	bool row_pending;            /* Current row not yet sent, see query.h */
+	struct reader_work read;     /* Batch of rows produced by a reader */
+	bool reading;                /* Whether a reader is producing rows */
+	bool interrupted;            /* Whether the client sent an interrupt */
+	int read_rc;                 /* Result of the batch produced by a reader */
 	struct exec exec;            /* Low-level exec async request */
 	const char *sql;             /* SQL query for exec_sql requests */
+	struct bulk bulk;            /* State of exec_bulk/batch requests */
+	struct dump dump;            /* State of streamed dump requests */
 	struct stmt__registry stmts; /* Registry of prepared statements */
 	struct barrier barrier;      /* Barrier for query requests */
+	struct query_budget budget;  /* Size of batches of query rows */
+	unsigned time_budget;        /* Query time in ms, 0 for no limit */
+	uint64_t time_left;          /* Time left to the current query, in ns */
 	uint64_t protocol;           /* Protocol format version */
+	uint64_t capabilities;       /* Agreed with the client, if any */
+	struct trace trace;          /* Stages of the current request */
 };
 
 void gateway__init(struct gateway *g,
@@ -46,14 +100,27 @@ void gateway__init(struct gateway *g,
 
 void gateway__close(struct gateway *g);
 
+/**
+ * Give back to the pool the leader connections that this gateway doesn't need
+ * to hold anymore, since no request is in progress.
+ *
+ * A connection is kept only if it has a transaction in progress, if it's still
+ * used by a prepared statement of the client, or if the client changed its
+ * session, for example by setting a PRAGMA (see leader__release()). Otherwise
+ * the database is attached again to a pooled connection by its next request.
+ */
+void gateway__idle(struct gateway *g);
+
 /**
  * Asynchronous request to handle a client command.
  */
 typedef void (*handle_cb)(struct handle *req, int status, int type);
 struct handle
 {
-	void *data; /* User data */
-	int type;   /* Request type */
+	void *data;       /* User data */
+	int type;         /* Request type */
+	unsigned flags;   /* Message flags, e.g. DQLITE_MESSAGE_COLUMNAR */
+	uint64_t started; /* When handling started, see metrics__now() */
 	struct gateway *gateway;
 	struct buffer *buffer;
 	handle_cb cb;
@@ -79,9 +146,25 @@ int gateway__handle(struct gateway *g,
 
 /**
  * Resume execution of a query that was yielding a lot of rows and has been
- * interrupted in order to start sending a first batch of rows. The response
- * write buffer associated with the request must have been reset.
+ * interrupted in order to start sending a first batch of rows, or of a dump
+ * being streamed in chunks.
+ *
+ * The next batch is written to the given @buffer, which must have been reset
+ * and might differ from the one of the previous batch, still being sent. If
+ * the query is over, @finished is set to true and nothing else happens.
+ */
+int gateway__resume(struct gateway *g, struct buffer *buffer, bool *finished);
+
+/**
+ * Stop the query or dump in progress as soon as possible, because the next
+ * request of the client, read ahead while this one is still being handled, is
+ * an interrupt.
+ *
+ * A batch of rows being produced by a reader thread is cut short, and fails
+ * with SQLITE_INTERRUPT. Otherwise the next call to gateway__resume() drops the
+ * request and reports it as finished. The interrupt request itself must still
+ * be handled once its turn comes.
  */
-int gateway__resume(struct gateway *g, bool *finished);
+void gateway__interrupt(struct gateway *g);
 
 #endif /* DQLITE_GATEWAY_H_ */
@@ -1,15 +1,18 @@
 #include <stdio.h>
+#include <time.h>
 
 #include "../include/dqlite.h"
 
 #include "./lib/assert.h"
 
-#include "command.h"
-#include "format.h"
+#include "checkpoint.h"
 #include "leader.h"
 
 #define LOOP_CORO_STACK_SIZE 1024 * 1024 /* TODO: make this configurable? */
 
+/* Number of virtual machine instructions between checks of the deadline. */
+#define PROGRESS_OPS 1000
+
 static void maybeExecDone(struct exec *req)
 {
 	if (!req->done) {
@@ -21,94 +24,39 @@ static void maybeExecDone(struct exec *req)
 	}
 }
 
-static void checkpointApplyCb(struct raft_apply *req, int status, void *result)
-{
-	struct leader *l = req->data;
-	(void)result;
-	(void)status;       /* TODO: log a warning in case of errors. */
-	co_switch(l->loop); /* Resume apply() */
-	maybeExecDone(l->exec);
-}
-
-static int maybeCheckpoint(void *ctx,
-			   sqlite3 *db,
-			   const char *schema,
-			   int pages)
+/* WAL hook recording the size of the WAL after each commit. The checkpoint
+ * scheduler takes care of actually triggering a checkpoint if needed. */
+static int walHook(void *ctx, sqlite3 *db, const char *schema, int pages)
 {
 	struct leader *l = ctx;
-	struct sqlite3_file *file;
-	struct raft_buffer buf;
-	struct command_checkpoint command;
-	volatile void *region;
-	uint32_t mx_frame;
-	uint32_t read_marks[FORMAT__WAL_NREADER];
-	int i;
-	int rv;
 	(void)db;
 	(void)schema;
+	checkpoint__commit(l->db, l->raft, (unsigned)pages);
+	return SQLITE_OK;
+}
 
-	/* Check if the size of the WAL is beyond the threshold. */
-	if ((unsigned)pages < l->db->config->checkpoint_threshold) {
-		/* Nothing to do yet. */
-		return SQLITE_OK;
-	}
-
-	/* Get the database file associated with this connection */
-	rv = sqlite3_file_control(l->conn, "main", SQLITE_FCNTL_FILE_POINTER,
-				  &file);
-	assert(rv == SQLITE_OK); /* Should never fail */
-
-	/* Get the first SHM region, which contains the WAL header. */
-	rv = file->pMethods->xShmMap(file, 0, 0, 0, &region);
-	assert(rv == SQLITE_OK); /* Should never fail */
-
-	/* Get the current value of mxFrame. */
-	format__get_mx_frame((const uint8_t *)region, &mx_frame);
-
-	/* Get the content of the read marks. */
-	format__get_read_marks((const uint8_t *)region, read_marks);
-
-	/* Check each mark and associated lock. This logic is similar to the one
-	 * in the walCheckpoint function of wal.c, in the SQLite code. */
-	for (i = 0; i < SQLITE_SHM_NLOCK; i++) {
-		int flags = SQLITE_SHM_LOCK | SQLITE_SHM_EXCLUSIVE;
-
-		rv = file->pMethods->xShmLock(file, i, 1, flags);
-		if (rv == SQLITE_BUSY) {
-			/* It's locked. Let's postpone the checkpoint
-			 * for now. */
-			return SQLITE_OK;
-		}
-
-		/* Not locked. Let's release the lock we just
-		 * acquired. */
-		flags = SQLITE_SHM_UNLOCK | SQLITE_SHM_EXCLUSIVE;
-		file->pMethods->xShmLock(file, i, 1, flags);
-	}
+/* Current monotonic time in nanoseconds. The raft clock can't be used, since
+ * it doesn't advance while the event loop is blocked in a step. */
+static uint64_t nowNs(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
 
-	/* Attempt to perfom a checkpoint across all nodes.
-	 *
-	 * TODO: reason about if it's indeed fine to ignore all kind of
-	 * errors. */
-	command.filename = l->db->filename;
-	rv = command__encode(COMMAND_CHECKPOINT, &command, &buf);
-	if (rv != 0) {
-		goto abort;
+/* Progress handler interrupting steps that run past the deadline, or that were
+ * interrupted from another thread. */
+static int progressHandler(void *ctx)
+{
+	struct leader *l = ctx;
+	if (__atomic_load_n(&l->interrupted, __ATOMIC_RELAXED)) {
+		return 1;
 	}
-	rv = raft_apply(l->raft, &l->apply, &buf, 1, checkpointApplyCb);
-	if (rv != 0) {
-		goto abort_after_command_encode;
+	if (l->deadline == 0 || nowNs() < l->deadline) {
+		return 0;
 	}
-	co_switch(l->main);
-
-	return SQLITE_OK;
-
-abort_after_command_encode:
-	raft_free(buf.base);
-abort:
-	assert(rv != 0);
-	/* TODO: log a warning. */
-	return SQLITE_OK;
+	l->exceeded = true;
+	return 1;
 }
 
 /* Open a SQLite connection and set it to leader replication mode. */
@@ -179,6 +127,46 @@ err:
 	return rc;
 }
 
+/* Authorizer flagging statements that change the state of the connection's
+ * session in a way that would be visible to the next client, were the
+ * connection handed to another one: setting a PRAGMA, attaching a database or
+ * creating a temporary object. It also flags statements beginning or ending a
+ * transaction or a savepoint. It's invoked while statements are prepared, so
+ * it costs nothing when they're stepped. */
+static int authorizerCb(void *arg,
+			int action,
+			const char *arg1,
+			const char *arg2,
+			const char *schema,
+			const char *trigger)
+{
+	struct leader *l = arg;
+	(void)arg1;
+	(void)schema;
+	(void)trigger;
+	switch (action) {
+		case SQLITE_PRAGMA:
+			/* Reading a setting leaves it untouched. */
+			if (arg2 != NULL) {
+				l->dirty = true;
+			}
+			break;
+		case SQLITE_ATTACH:
+		case SQLITE_DETACH:
+		case SQLITE_CREATE_TEMP_INDEX:
+		case SQLITE_CREATE_TEMP_TABLE:
+		case SQLITE_CREATE_TEMP_TRIGGER:
+		case SQLITE_CREATE_TEMP_VIEW:
+			l->dirty = true;
+			break;
+		case SQLITE_TRANSACTION:
+		case SQLITE_SAVEPOINT:
+			l->tx_control = true;
+			break;
+	}
+	return SQLITE_OK;
+}
+
 static struct leader *loop_arg_leader; /* For initializing the loop coroutine */
 static struct exec *loop_arg_exec;     /* Next exec request to execute */
 
@@ -189,7 +177,9 @@ static void loop()
 	while (1) {
 		struct exec *req = loop_arg_exec;
 		int rc;
+		trace__stamp(l->trace, DQLITE_TRACE_STEP);
 		rc = sqlite3_step(req->stmt);
+		trace__stamp(l->trace, DQLITE_TRACE_STEP_DONE);
 		req->done = true;
 		req->status = rc;
 		co_switch(l->main);
@@ -231,11 +221,21 @@ int leader__init(struct leader *l, struct db *db, struct raft *raft)
 	if (rc != 0) {
 		goto err_after_loop_create;
 	}
-	sqlite3_wal_hook(l->conn, maybeCheckpoint, l);
+	sqlite3_wal_hook(l->conn, walHook, l);
+	sqlite3_progress_handler(l->conn, PROGRESS_OPS, progressHandler, l);
+	sqlite3_set_authorizer(l->conn, authorizerCb, l);
 
 	l->exec = NULL;
-	l->apply.data = l;
+	l->dirty = false;
+	l->tx_control = false;
+	l->deadline = 0;
+	l->started = 0;
+	l->exceeded = false;
+	l->interrupted = false;
+	l->reading = false;
 	l->inflight = NULL;
+	l->trace = NULL;
+	stmt_cache__init(&l->cache, db->config->stmt_cache);
 	QUEUE__PUSH(&db->leaders, &l->queue);
 	return 0;
 
@@ -255,6 +255,7 @@ void leader__close(struct leader *l)
 		l->exec->status = SQLITE_ERROR;
 		maybeExecDone(l->exec);
 	}
+	stmt_cache__close(&l->cache);
 	rc = sqlite3_close(l->conn);
 	assert(rc == 0);
 
@@ -268,6 +269,85 @@ void leader__close(struct leader *l)
 	QUEUE__REMOVE(&l->queue);
 }
 
+bool leader__is_clean(struct leader *l)
+{
+	sqlite3_stmt *stmt;
+
+	if (l->dirty || l->exec != NULL || l->inflight != NULL) {
+		return false;
+	}
+	if (!sqlite3_get_autocommit(l->conn)) {
+		return false;
+	}
+	/* Only idle cached statements are allowed. */
+	for (stmt = sqlite3_next_stmt(l->conn, NULL); stmt != NULL;
+	     stmt = sqlite3_next_stmt(l->conn, stmt)) {
+		if (sqlite3_stmt_busy(stmt)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+int leader__acquire(struct db *db, struct raft *raft, struct leader **l)
+{
+	queue *head;
+	int rc;
+
+	if (!QUEUE__IS_EMPTY(&db->pool)) {
+		head = QUEUE__HEAD(&db->pool);
+		QUEUE__REMOVE(head);
+		db->pool_size--;
+		*l = QUEUE__DATA(head, struct leader, idle);
+		assert((*l)->raft == raft);
+		return 0;
+	}
+
+	*l = sqlite3_malloc(sizeof **l);
+	if (*l == NULL) {
+		return DQLITE_NOMEM;
+	}
+	rc = leader__init(*l, db, raft);
+	if (rc != 0) {
+		sqlite3_free(*l);
+		*l = NULL;
+		return rc;
+	}
+	return 0;
+}
+
+void leader__release(struct leader *l)
+{
+	struct db *db = l->db;
+	l->trace = NULL;
+	if (db->pool_size < db->config->leader_pool && leader__is_clean(l)) {
+		QUEUE__PUSH(&db->pool, &l->idle);
+		db->pool_size++;
+		return;
+	}
+	leader__close(l);
+	sqlite3_free(l);
+}
+
+void leader__start_budget(struct leader *l, uint64_t ns)
+{
+	l->started = nowNs();
+	l->deadline = l->started + ns;
+	l->exceeded = false;
+}
+
+void leader__interrupt(struct leader *l)
+{
+	__atomic_store_n(&l->interrupted, true, __ATOMIC_RELAXED);
+	sqlite3_interrupt(l->conn);
+}
+
+uint64_t leader__stop_budget(struct leader *l)
+{
+	l->deadline = 0;
+	return nowNs() - l->started;
+}
+
 static void execBarrierCb(struct barrier *barrier, int status)
 {
 	struct exec *req = barrier->data;
@@ -311,6 +391,7 @@ static void raftBarrierCb(struct raft_barrier *req, int status)
 {
 	struct barrier *barrier = req->data;
 	int rv = 0;
+	trace__stamp(barrier->trace, DQLITE_TRACE_BARRIER_DONE);
 	if (status != 0) {
 		if (status == RAFT_LEADERSHIPLOST) {
 			rv = SQLITE_IOERR_LEADERSHIP_LOST;
@@ -331,6 +412,8 @@ int leader__barrier(struct leader *l, struct barrier *barrier, barrier_cb cb)
 	barrier->cb = cb;
 	barrier->leader = l;
 	barrier->req.data = barrier;
+	barrier->trace = l->trace;
+	trace__stamp(barrier->trace, DQLITE_TRACE_BARRIER);
 	rv = raft_barrier(l->raft, &barrier->req, raftBarrierCb);
 	if (rv != 0) {
 		return rv;
@@ -13,6 +13,8 @@
 #include "./lib/queue.h"
 #include "db.h"
 #include "replication.h"
+#include "stmt.h"
+#include "trace.h"
 
 struct exec;
 struct barrier;
@@ -29,9 +31,18 @@ struct leader
 	sqlite3 *conn;           /* Underlying SQLite connection. */
 	struct raft *raft;       /* Raft instance. */
 	struct exec *exec;       /* Exec request in progress, if any. */
-	struct raft_apply apply; /* To apply checkpoint commands */
 	queue queue;             /* Prev/next leader, used by struct db. */
+	queue idle;              /* Prev/next idle leader in the db's pool. */
 	struct apply *inflight;  /* TODO: make leader__close async */
+	struct stmt_cache cache; /* Statements prepared from SQL text. */
+	uint64_t deadline;       /* Monotonic time limit of steps, 0 for none. */
+	uint64_t started;        /* When the current time budget started. */
+	bool exceeded;           /* Whether a step ran past the deadline. */
+	bool interrupted;        /* Whether steps should stop right away. */
+	bool reading;            /* Whether a reader thread may step on it. */
+	struct trace *trace;     /* Trace of the owner's request, if any. */
+	bool dirty;              /* Whether a client changed the session. */
+	bool tx_control;         /* Set when preparing BEGIN, SAVEPOINT, etc. */
 };
 
 struct barrier
@@ -39,6 +50,7 @@ struct barrier
 	void *data;
 	struct leader *leader;
 	struct raft_barrier req;
+	struct trace *trace;
 	barrier_cb cb;
 };
 
@@ -68,6 +80,32 @@ int leader__init(struct leader *l, struct db *db, struct raft *raft);
 
 void leader__close(struct leader *l);
 
+/**
+ * Get a leader connection against the given database.
+ *
+ * An idle connection is taken from the database's pool if available, so its
+ * schema and page cache get reused, otherwise a new one is allocated and
+ * initialized with leader__init().
+ */
+int leader__acquire(struct db *db, struct raft *raft, struct leader **l);
+
+/**
+ * Give back a connection obtained with leader__acquire().
+ *
+ * If the connection is in a clean state and the pool is not full, it's kept
+ * idle for reuse. Otherwise it's closed and freed. A clean connection has no
+ * transaction, statement or exec request in progress, and it's not @dirty: no
+ * statement setting a PRAGMA, attaching a database or creating a temporary
+ * object was ever prepared on it.
+ */
+void leader__release(struct leader *l);
+
+/**
+ * Whether the connection can be handed to another client, see
+ * leader__release().
+ */
+bool leader__is_clean(struct leader *l);
+
 /**
  * Submit a request to step a SQLite statement.
  *
@@ -88,6 +126,32 @@ int leader__exec(struct leader *l,
 		 sqlite3_stmt *stmt,
 		 exec_cb cb);
 
+/**
+ * Limit the time that statements stepped on this connection can take to the
+ * given amount of nanoseconds, starting now.
+ *
+ * Steps running past the limit are cut off by a progress handler, and fail with
+ * SQLITE_INTERRUPT. In that case the @exceeded flag of the leader is set.
+ */
+void leader__start_budget(struct leader *l, uint64_t ns);
+
+/**
+ * Make the step running on this connection, possibly on a reader thread, or
+ * the next one to start, fail with SQLITE_INTERRUPT. This can be called from
+ * any thread, and lasts until the @interrupted flag is cleared by the caller,
+ * once no step can be running anymore.
+ *
+ * Unlike a bare sqlite3_interrupt(), this also catches a step that a reader
+ * thread is just about to start.
+ */
+void leader__interrupt(struct leader *l);
+
+/**
+ * Lift the limit set with leader__start_budget(), and return the time elapsed
+ * since it was set, in nanoseconds.
+ */
+uint64_t leader__stop_budget(struct leader *l);
+
 /**
  * Submit a raft barrier request if there is no transaction in progress in the
  * underlying database and the FSM is behind the last log index.
@@ -1,13 +1,15 @@
 #include <stdbool.h>
 #include <stdlib.h>
+#include <sys/mman.h>
 #include <unistd.h>
 
+#include "assert.h"
 #include "buffer.h"
 
 #include "../../include/dqlite.h"
 
 /* How large is the buffer currently */
-#define SIZE(B) (B->n_pages * B->page_size)
+#define SIZE(B) ((size_t)B->n_pages * B->page_size)
 
 /* How many remaining bytes the buffer currently */
 #define CAP(B) (SIZE(B) - B->offset)
@@ -16,32 +18,58 @@ int buffer__init(struct buffer *b)
 {
 	b->page_size = sysconf(_SC_PAGESIZE);
 	b->n_pages = 1;
-	b->data = malloc(SIZE(b));
-	if (b->data == NULL) {
+	b->data = mmap(NULL, SIZE(b), PROT_READ | PROT_WRITE,
+		       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (b->data == MAP_FAILED) {
 		return DQLITE_NOMEM;
 	}
 	b->offset = 0;
+	b->n_refs = 0;
+	b->attached = 0;
 	return 0;
 }
 
+/* Release all attached data. */
+static void release_refs(struct buffer *b)
+{
+	unsigned i;
+	for (i = 0; i < b->n_refs; i++) {
+		b->refs[i].release(b->refs[i].base);
+	}
+	b->n_refs = 0;
+	b->attached = 0;
+}
+
 void buffer__close(struct buffer *b)
 {
-	free(b->data);
+	if (b->data == NULL) {
+		return;
+	}
+	release_refs(b);
+	munmap(b->data, SIZE(b));
 }
 
 /* Ensure that the buffer as at least @size spare bytes */
 static bool ensure(struct buffer *b, size_t size)
 {
+	unsigned n_pages = b->n_pages;
+	void *data;
+
+	if (size <= CAP(b)) {
+		return true;
+	}
+
 	/* Double the buffer until we have enough capacity */
-	while (size > CAP(b)) {
-		void *data;
-		b->n_pages *= 2;
-		data = realloc(b->data, SIZE(b));
-		if (data == NULL) {
-			return false;
-		}
-		b->data = data;
+	while (size > (size_t)n_pages * b->page_size - b->offset) {
+		n_pages *= 2;
+	}
+	data = mremap(b->data, SIZE(b), (size_t)n_pages * b->page_size,
+		      MREMAP_MAYMOVE);
+	if (data == MAP_FAILED) {
+		return false;
 	}
+	b->data = data;
+	b->n_pages = n_pages;
 	return true;
 }
 
@@ -58,6 +86,14 @@ void *buffer__advance(struct buffer *b, size_t size)
 	return cursor;
 }
 
+void *buffer__reserve(struct buffer *b, size_t size)
+{
+	if (!ensure(b, size)) {
+		return NULL;
+	}
+	return buffer__cursor(b, b->offset);
+}
+
 size_t buffer__offset(struct buffer *b) {
 	return b->offset;
 }
@@ -69,5 +105,184 @@ void *buffer__cursor(struct buffer *b, size_t offset)
 
 void buffer__reset(struct buffer *b)
 {
+	release_refs(b);
+	b->offset = 0;
+}
+
+int buffer__attach(struct buffer *b,
+		   void *base,
+		   size_t len,
+		   void (*release)(void *base))
+{
+	struct buffer_ref *ref;
+	if (b->n_refs == BUFFER__MAX_REFS) {
+		return DQLITE_ERROR;
+	}
+	ref = &b->refs[b->n_refs];
+	ref->offset = b->offset;
+	ref->base = base;
+	ref->len = len;
+	ref->release = release;
+	b->n_refs++;
+	b->attached += len;
+	return 0;
+}
+
+size_t buffer__size(struct buffer *b)
+{
+	return b->offset + b->attached;
+}
+
+unsigned buffer__segments(struct buffer *b, uv_buf_t *bufs)
+{
+	size_t offset = 0;
+	unsigned n = 0;
+	unsigned i;
+
+	for (i = 0; i < b->n_refs; i++) {
+		struct buffer_ref *ref = &b->refs[i];
+		if (ref->offset > offset) {
+			bufs[n].base = buffer__cursor(b, offset);
+			bufs[n].len = ref->offset - offset;
+			n++;
+			offset = ref->offset;
+		}
+		bufs[n].base = ref->base;
+		bufs[n].len = ref->len;
+		n++;
+	}
+	if (b->offset > offset) {
+		bufs[n].base = buffer__cursor(b, offset);
+		bufs[n].len = b->offset - offset;
+		n++;
+	}
+
+	return n;
+}
+
+/* Header of idle memory kept by a pool, stored in the memory itself. */
+struct chunk
+{
+	queue queue;      /* Position in the list of its size class */
+	unsigned n_pages; /* Size of the chunk */
+};
+
+/* Return the size class holding chunks of at least @n_pages pages. */
+static unsigned class_of(unsigned n_pages)
+{
+	unsigned i = 0;
+	while (i < BUFFER_POOL__CLASSES - 1 && (2u << i) <= n_pages) {
+		i++;
+	}
+	return i;
+}
+
+void buffer_pool__init(struct buffer_pool *p, size_t max_size, size_t max_cached)
+{
+	unsigned i;
+	p->page_size = sysconf(_SC_PAGESIZE);
+	for (i = 0; i < BUFFER_POOL__CLASSES; i++) {
+		QUEUE__INIT(&p->free[i]);
+	}
+	p->max_size = max_size;
+	p->max_cached = max_cached;
+	p->cached = 0;
+	p->n_gets = 0;
+	p->n_hits = 0;
+}
+
+void buffer_pool__close(struct buffer_pool *p)
+{
+	buffer_pool__trim(p);
+}
+
+void buffer_pool__trim(struct buffer_pool *p)
+{
+	unsigned i;
+	for (i = 0; i < BUFFER_POOL__CLASSES; i++) {
+		while (!QUEUE__IS_EMPTY(&p->free[i])) {
+			queue *head = QUEUE__HEAD(&p->free[i]);
+			struct chunk *chunk = QUEUE__DATA(head, struct chunk, queue);
+			QUEUE__REMOVE(head);
+			munmap(chunk, (size_t)chunk->n_pages * p->page_size);
+		}
+	}
+	p->cached = 0;
+}
+
+int buffer_pool__get(struct buffer_pool *p, struct buffer *b, size_t size)
+{
+	unsigned n_pages = (size + p->page_size - 1) / p->page_size;
+	unsigned i;
+
+	assert(b->data == NULL);
+	p->n_gets++;
+
+	/* Memory of a class is at least as large as the class size, so start
+	 * from the class matching the next power of two. */
+	if (n_pages == 0) {
+		n_pages = 1;
+	}
+	i = class_of(n_pages);
+	if ((1u << i) < n_pages) {
+		i++;
+	}
+
+	for (; i < BUFFER_POOL__CLASSES; i++) {
+		struct chunk *chunk;
+		queue *head;
+		if (QUEUE__IS_EMPTY(&p->free[i])) {
+			continue;
+		}
+		head = QUEUE__HEAD(&p->free[i]);
+		QUEUE__REMOVE(head);
+		chunk = QUEUE__DATA(head, struct chunk, queue);
+		b->page_size = p->page_size;
+		b->n_pages = chunk->n_pages;
+		b->data = chunk;
+		b->offset = 0;
+		b->n_refs = 0;
+		b->attached = 0;
+		p->cached -= SIZE(b);
+		p->n_hits++;
+		return 0;
+	}
+
+	b->page_size = p->page_size;
+	b->n_pages = 1;
+	while (b->n_pages < n_pages) {
+		b->n_pages *= 2;
+	}
+	b->data = mmap(NULL, SIZE(b), PROT_READ | PROT_WRITE,
+		       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (b->data == MAP_FAILED) {
+		b->data = NULL;
+		return DQLITE_NOMEM;
+	}
 	b->offset = 0;
+	b->n_refs = 0;
+	b->attached = 0;
+	return 0;
+}
+
+void buffer_pool__put(struct buffer_pool *p, struct buffer *b)
+{
+	struct chunk *chunk;
+
+	if (b->data == NULL) {
+		return;
+	}
+	release_refs(b);
+
+	if (SIZE(b) > p->max_size || p->cached + SIZE(b) > p->max_cached) {
+		munmap(b->data, SIZE(b));
+		b->data = NULL;
+		return;
+	}
+
+	chunk = b->data;
+	chunk->n_pages = b->n_pages;
+	QUEUE__PUSH(&p->free[class_of(b->n_pages)], &chunk->queue);
+	p->cached += SIZE(b);
+	b->data = NULL;
 }
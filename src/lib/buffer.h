@@ -1,12 +1,15 @@
 /**
  * A dynamic buffer which can grow as needed when writing to it.
  *
- * The buffer size is always a multiple of the OS virtual memory page size, so
- * resizing the buffer *should* not incur in memory being copied.
+ * The buffer size is always a multiple of the OS virtual memory page size, and
+ * its memory is mapped directly, so growing it remaps pages instead of copying
+ * them.
  *
- * See https://stackoverflow.com/questions/16765389
+ * Large payloads that already live in memory of their own can be attached to
+ * the buffer instead of being copied into it. The buffer content is then a
+ * sequence of segments, alternating stretches of the buffer's own memory with
+ * attached data, meant to be sent with a single vectored write.
  *
- * TODO: consider using mremap.
  */
 
 #ifndef LIB_BUFFER_H_
@@ -14,12 +17,36 @@
 
 #include <unistd.h>
 
+#include <uv.h>
+
+#include "queue.h"
+
+/* Maximum number of chunks of data attached to a buffer. */
+#define BUFFER__MAX_REFS 4
+
+/* Maximum number of segments of a buffer's content. */
+#define BUFFER__MAX_SEGMENTS (2 * BUFFER__MAX_REFS + 1)
+
+/**
+ * Chunk of data attached to a buffer, see buffer__attach().
+ */
+struct buffer_ref
+{
+	size_t offset;               /* Position of the chunk in the content */
+	void *base;                  /* Attached data */
+	size_t len;                  /* Size of the attached data */
+	void (*release)(void *base); /* Release the data when done */
+};
+
 struct buffer
 {
 	void *data;	 /* Allocated buffer */
 	unsigned page_size; /* Size of an OS page */
 	unsigned n_pages;   /* Number of pages allocated */
 	size_t offset;      /* Next byte to write in the buffer */
+	struct buffer_ref refs[BUFFER__MAX_REFS]; /* Attached data */
+	unsigned n_refs;                          /* Number of attached chunks */
+	size_t attached;                          /* Total attached bytes */
 };
 
 /**
@@ -40,6 +67,16 @@ void buffer__close(struct buffer *b);
  */
 void *buffer__advance(struct buffer *b, size_t size);
 
+/**
+ * Return a write cursor pointing to the next byte to write, ensuring that the
+ * buffer has at least @size spare bytes, like buffer__advance() but without
+ * moving the write offset. It's meant for content of a size only known once
+ * written, after which buffer__advance() can be called with the actual size.
+ *
+ * Return #NULL in case of out-of-memory errors.
+ */
+void *buffer__reserve(struct buffer *b, size_t size);
+
 /**
  * Return the offset of next byte to write.
  */
@@ -51,8 +88,86 @@ size_t buffer__offset(struct buffer *b);
 void *buffer__cursor(struct buffer *b, size_t offset);
 
 /**
- * Reset the write offset of the buffer.
+ * Reset the write offset of the buffer, releasing any attached data.
  */
 void buffer__reset(struct buffer *b);
 
+/**
+ * Append @len bytes at @base to the buffer content without copying them. The
+ * buffer takes ownership of the data and passes it to @release once reset or
+ * closed.
+ *
+ * Return #DQLITE_ERROR if #BUFFER__MAX_REFS chunks are already attached, in
+ * which case the caller keeps ownership of the data.
+ */
+int buffer__attach(struct buffer *b,
+		   void *base,
+		   size_t len,
+		   void (*release)(void *base));
+
+/**
+ * Return the size of the buffer content, including attached data.
+ */
+size_t buffer__size(struct buffer *b);
+
+/**
+ * Fill @bufs with the segments of the buffer content and return how many they
+ * are. The @bufs array must have room for #BUFFER__MAX_SEGMENTS items.
+ */
+unsigned buffer__segments(struct buffer *b, uv_buf_t *bufs);
+
+/* Number of size classes of a buffer pool. Class i holds memory of at least
+ * 2^i pages. */
+#define BUFFER_POOL__CLASSES 16
+
+/**
+ * Memory for buffers that are only needed for a while, e.g. to read a request
+ * or write a response, shared by all the users of the pool.
+ *
+ * A buffer borrowing memory from the pool gives it back once done, and the
+ * pool keeps it for the next borrower, up to a cap on the idle memory it
+ * holds.
+ */
+struct buffer_pool
+{
+	unsigned page_size;                 /* Size of an OS page */
+	queue free[BUFFER_POOL__CLASSES];   /* Idle memory, by size class */
+	size_t max_size;                    /* Larger memory is not kept */
+	size_t max_cached;                  /* Cap on the idle memory kept */
+	size_t cached;                      /* Idle memory kept */
+	unsigned long long n_gets;          /* Number of borrowed buffers */
+	unsigned long long n_hits;          /* Served with idle memory */
+};
+
+/**
+ * Initialize a pool keeping up to @max_cached bytes of idle memory, in chunks
+ * of at most @max_size bytes.
+ */
+void buffer_pool__init(struct buffer_pool *p,
+		       size_t max_size,
+		       size_t max_cached);
+
+/**
+ * Release all idle memory of the pool. Borrowed memory must have been given
+ * back.
+ */
+void buffer_pool__close(struct buffer_pool *p);
+
+/**
+ * Release all idle memory of the pool.
+ */
+void buffer_pool__trim(struct buffer_pool *p);
+
+/**
+ * Give the buffer @b memory from the pool, with room for at least @size bytes.
+ * The buffer must not hold any memory.
+ */
+int buffer_pool__get(struct buffer_pool *p, struct buffer *b, size_t size);
+
+/**
+ * Give the memory of buffer @b back to the pool, releasing its attached data.
+ * The buffer is left without memory, which is a no-op if it had none.
+ */
+void buffer_pool__put(struct buffer_pool *p, struct buffer *b);
+
 #endif /* LIB_BUFFER_H_ */
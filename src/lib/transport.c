@@ -170,12 +170,15 @@ static void write_cb(uv_write_t *req, int status)
 	cb(t, status);
 }
 
-int transport__write(struct transport *t, uv_buf_t *buf, transport_write_cb cb)
+int transport__write(struct transport *t,
+		     uv_buf_t *bufs,
+		     unsigned n,
+		     transport_write_cb cb)
 {
 	int rv;
 	assert(t->write_cb == NULL);
 	t->write_cb = cb;
-	rv = uv_write(&t->write, t->stream, buf, 1, write_cb);
+	rv = uv_write(&t->write, t->stream, bufs, n, write_cb);
 	if (rv != 0) {
 		return rv;
 	}
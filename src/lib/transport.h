@@ -49,9 +49,13 @@ void transport__close(struct transport *t, transport_close_cb cb);
 int transport__read(struct transport *t, uv_buf_t *buf, transport_read_cb cb);
 
 /**
- * Write the given buffer to the transport.
+ * Write the given @n buffers to the transport, in order, with a single
+ * vectored write.
  */
-int transport__write(struct transport *t, uv_buf_t *buf, transport_write_cb cb);
+int transport__write(struct transport *t,
+		     uv_buf_t *bufs,
+		     unsigned n,
+		     transport_write_cb cb);
 
 /* Create an UV stream object from the given fd. */
 int transport__stream(struct uv_loop_s *loop, int fd, struct uv_stream_s **stream);
@@ -23,6 +23,11 @@ struct logger
 /* Default implementation of dqlite_emit, using stderr. */
 void loggerDefaultEmit(void *data, int level, const char *fmt, va_list args);
 
+/* Emit a log message with the given level through the given logger. */
+void loggerEmit(struct logger *l, int level, const char *fmt, ...);
+
+#define warnf(L, FORMAT, ...) loggerEmit(L, DQLITE_WARN, FORMAT, ##__VA_ARGS__)
+
 /* Emit a log message with a certain level. */
 /* #define debugf(L, FORMAT, ...) \ */
 /* 	logger__emit(L, DQLITE_DEBUG, FORMAT, ##__VA_ARGS__) */
@@ -1,12 +1,88 @@
-#include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 #include "./lib/assert.h"
 
 #include "metrics.h"
+#include "registry.h"
 
-void dqlite__metrics_init(struct dqlite__metrics *m) {
+void metrics__init(struct metrics *m)
+{
 	assert(m != NULL);
+	memset(m, 0, sizeof *m);
+}
+
+uint64_t metrics__now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+void metrics__observe(struct dqlite_histogram *h, uint64_t ns)
+{
+	uint64_t us = ns / 1000;
+	unsigned i = 0;
+
+	/* Find the first bucket whose bound, 2^i microseconds, is above the
+	 * observation. */
+	while (i < DQLITE_HISTOGRAM_BUCKETS - 1 && us >= ((uint64_t)1 << i)) {
+		i++;
+	}
+
+	h->count++;
+	h->sum += us;
+	h->buckets[i]++;
+}
+
+void metrics__observe_since(struct dqlite_histogram *h, uint64_t start)
+{
+	uint64_t now = metrics__now();
+	metrics__observe(h, now > start ? now - start : 0);
+}
+
+void metrics__snapshot(struct registry *registry,
+		       struct raft *raft,
+		       struct dqlite_node_metrics *m)
+{
+	const struct metrics *metrics = &registry->metrics;
+	queue *head;
+
+	memset(m, 0, sizeof *m);
+
+	memcpy(m->requests, metrics->requests, sizeof m->requests);
+	memcpy(m->request_failures, metrics->failures,
+	       sizeof m->request_failures);
+	memcpy(m->request_latency, metrics->latency,
+	       sizeof m->request_latency);
+
+	m->applies = metrics->applies;
+	m->apply_failures = metrics->apply_failures;
+	m->apply_bytes = metrics->apply_bytes;
+	m->apply_latency = metrics->apply_latency;
+
+	memcpy(m->commands, metrics->commands, sizeof m->commands);
+	memcpy(m->command_latency, metrics->command_latency,
+	       sizeof m->command_latency);
+
+	QUEUE__FOREACH(head, &registry->dbs)
+	{
+		struct db *db = QUEUE__DATA(head, struct db, queue);
+		m->checkpoints += db->checkpoint.n;
+		m->checkpoint_busy += db->checkpoint.n_busy;
+		m->checkpoint_skipped += db->checkpoint.n_skipped;
+		m->checkpoint_failures += db->checkpoint.n_fail;
+		m->checkpoint_duration += db->checkpoint.total / (1000 * 1000);
+		m->queries += db->n_queries;
+		m->query_batches += db->n_batches;
+		m->databases++;
+	}
+
+	m->term = raft->current_term;
+	m->commit_index = raft->commit_index;
+	m->last_applied = raft_last_applied(raft);
+	m->last_index = raft_last_index(raft);
 
-	m->requests = 0;
-	m->duration = 0;
+	m->connections = metrics->connections;
+	m->connections_total = metrics->connections_total;
 }
@@ -1,19 +1,66 @@
-/******************************************************************************
+/**
+ * Collect node-wide performance metrics.
  *
- * Collect various performance metrics.
- *
- *****************************************************************************/
+ * All counters are updated on the main loop thread only, so they are plain
+ * integers. Subsystems that already keep their own counters (checkpoints,
+ * admission control, buffer pool, queries) keep doing so, and the snapshot
+ * taken by dqlite_node_get_metrics() sums them up with these ones.
+ */
 
-#ifndef DQLITE_METRICS_H
-#define DQLITE_METRICS_H
+#ifndef METRICS_H_
+#define METRICS_H_
 
 #include <stdint.h>
 
-struct dqlite__metrics {
-	uint64_t requests; /* Total number of requests served. */
-	uint64_t duration; /* Total time spent to server requests. */
+#include <raft.h>
+
+#include "../include/dqlite.h"
+
+struct registry;
+
+#define METRICS__REQUEST_TYPES DQLITE_METRICS_REQUEST_TYPES
+#define METRICS__COMMAND_TYPES DQLITE_METRICS_COMMAND_TYPES
+
+struct metrics
+{
+	unsigned long long requests[METRICS__REQUEST_TYPES];
+	unsigned long long failures[METRICS__REQUEST_TYPES];
+	struct dqlite_histogram latency[METRICS__REQUEST_TYPES];
+	unsigned long long applies;        /* Raft commands submitted */
+	unsigned long long apply_failures; /* Raft commands failed */
+	unsigned long long apply_bytes;    /* Size of raft commands submitted */
+	struct dqlite_histogram apply_latency;
+	unsigned long long commands[METRICS__COMMAND_TYPES];
+	struct dqlite_histogram command_latency[METRICS__COMMAND_TYPES];
+	unsigned long long connections;       /* Currently open */
+	unsigned long long connections_total; /* Ever opened */
 };
 
-void dqlite__metrics_init(struct dqlite__metrics *m);
+void metrics__init(struct metrics *m);
+
+/**
+ * Current monotonic time in nanoseconds, for measuring latencies.
+ */
+uint64_t metrics__now(void);
+
+/**
+ * Record an observation of @ns nanoseconds in the given histogram.
+ */
+void metrics__observe(struct dqlite_histogram *h, uint64_t ns);
+
+/**
+ * Record an observation of the time elapsed since @start, as returned by
+ * metrics__now().
+ */
+void metrics__observe_since(struct dqlite_histogram *h, uint64_t start);
+
+/**
+ * Fill the given snapshot with the counters of the given registry, including
+ * the ones of its databases, and with the state of the given raft instance.
+ * Counters owned by other node subsystems are left to zero.
+ */
+void metrics__snapshot(struct registry *registry,
+		       struct raft *raft,
+		       struct dqlite_node_metrics *m);
 
-#endif /* DQLITE_METRICS_H */
+#endif /* METRICS_H_ */
@@ -0,0 +1,541 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <sqlite3.h>
+
+#include "./lib/assert.h"
+
+#include "command.h"
+#include "prometheus.h"
+#include "protocol.h"
+#include "request.h"
+
+/* Maximum size of the HTTP request headers that we read. */
+#define MAX_REQUEST 4096
+
+/* A single client connection, answered with one metrics snapshot. */
+struct scrape
+{
+	struct prometheus *prometheus;
+	struct uv_tcp_s tcp;
+	struct uv_timer_s timer;   /* Close the connection when idle */
+	unsigned handles;          /* Handles not yet closed */
+	struct uv_write_s write;
+	char request[MAX_REQUEST]; /* Request read so far */
+	size_t n;                  /* Size of the request read so far */
+	char header[128];          /* Response status line and headers */
+	struct buffer body;        /* Response body */
+	queue queue;               /* Link in the scrapes queue */
+};
+
+/* Append formatted text to the given buffer. */
+static int append(struct buffer *b, const char *format, ...)
+{
+	va_list args;
+	size_t room = 256;
+	char *cursor;
+	int n;
+
+	while (1) {
+		cursor = buffer__reserve(b, room);
+		if (cursor == NULL) {
+			return DQLITE_NOMEM;
+		}
+		va_start(args, format);
+		n = vsnprintf(cursor, room, format, args);
+		va_end(args);
+		if (n < 0) {
+			return DQLITE_ERROR;
+		}
+		if ((size_t)n < room) {
+			break;
+		}
+		room = (size_t)n + 1;
+	}
+	buffer__advance(b, (size_t)n);
+
+	return 0;
+}
+
+/* Return the lower case name of the given request type, or NULL. */
+static const char *requestName(unsigned type)
+{
+	switch (type) {
+#define REQUEST_NAME(LOWER, UPPER, _) \
+	case DQLITE_REQUEST_##UPPER:  \
+		return #LOWER;
+		REQUEST__TYPES(REQUEST_NAME);
+	}
+	return NULL;
+}
+
+/* Return the lower case name of the given command type, or NULL. */
+static const char *commandName(unsigned type)
+{
+	switch (type) {
+#define COMMAND_NAME(LOWER, UPPER, _) \
+	case COMMAND_##UPPER:         \
+		return #LOWER;
+		COMMAND__TYPES(COMMAND_NAME);
+	}
+	return NULL;
+}
+
+/* Append the HELP and TYPE lines of a metric family. */
+static int family(struct buffer *b,
+		  const char *name,
+		  const char *type,
+		  const char *help)
+{
+	return append(b, "# HELP %s %s\n# TYPE %s %s\n", name, help, name,
+		      type);
+}
+
+/* Append a sample without labels. */
+static int sample(struct buffer *b, const char *name, unsigned long long value)
+{
+	return append(b, "%s %llu\n", name, value);
+}
+
+/* Append a metric family holding a single sample. */
+static int single(struct buffer *b,
+		  const char *name,
+		  const char *type,
+		  const char *help,
+		  unsigned long long value)
+{
+	int rv;
+	rv = family(b, name, type, help);
+	if (rv != 0) {
+		return rv;
+	}
+	return sample(b, name, value);
+}
+
+/* Append the samples of a histogram, with the given label, if any. Buckets
+ * are cumulative and their bounds in seconds. */
+static int histogram(struct buffer *b,
+		     const char *name,
+		     const char *label,
+		     const char *value,
+		     const struct dqlite_histogram *h)
+{
+	unsigned long long count = 0;
+	char labels[64];
+	const char *sep = label != NULL ? "," : "";
+	unsigned i;
+	int rv;
+
+	if (label != NULL) {
+		snprintf(labels, sizeof labels, "%s=\"%s\"", label, value);
+	} else {
+		labels[0] = 0;
+	}
+
+	for (i = 0; i < DQLITE_HISTOGRAM_BUCKETS; i++) {
+		count += h->buckets[i];
+		if (i == DQLITE_HISTOGRAM_BUCKETS - 1) {
+			break;
+		}
+		rv = append(b, "%s_bucket{%s%sle=\"%g\"} %llu\n", name, labels,
+			    sep, (double)(1ULL << i) / 1e6, count);
+		if (rv != 0) {
+			return rv;
+		}
+	}
+	rv = append(b, "%s_bucket{%s%sle=\"+Inf\"} %llu\n", name, labels, sep,
+		    h->count);
+	if (rv != 0) {
+		return rv;
+	}
+	if (label != NULL) {
+		return append(b, "%s_sum{%s} %.6f\n%s_count{%s} %llu\n", name,
+			      labels, (double)h->sum / 1e6, name, labels,
+			      h->count);
+	}
+	return append(b, "%s_sum %.6f\n%s_count %llu\n", name,
+		      (double)h->sum / 1e6, name, h->count);
+}
+
+#define CHECK(EXPR)              \
+	{                        \
+		int rv_ = (EXPR); \
+		if (rv_ != 0) {  \
+			return rv_; \
+		}                \
+	}
+
+static int formatRequests(const dqlite_node_metrics *m, struct buffer *b)
+{
+	unsigned i;
+
+	CHECK(family(b, "dqlite_requests_total", "counter",
+		     "Client requests handled, by request type."));
+	for (i = 0; i < DQLITE_METRICS_REQUEST_TYPES; i++) {
+		if (m->requests[i] == 0 || requestName(i) == NULL) {
+			continue;
+		}
+		CHECK(append(b, "dqlite_requests_total{type=\"%s\"} %llu\n",
+			     requestName(i), m->requests[i]));
+	}
+
+	CHECK(family(b, "dqlite_request_failures_total", "counter",
+		     "Client requests that failed, by request type."));
+	for (i = 0; i < DQLITE_METRICS_REQUEST_TYPES; i++) {
+		if (m->requests[i] == 0 || requestName(i) == NULL) {
+			continue;
+		}
+		CHECK(append(b,
+			     "dqlite_request_failures_total{type=\"%s\"} %llu\n",
+			     requestName(i), m->request_failures[i]));
+	}
+
+	CHECK(family(b, "dqlite_request_duration_seconds", "histogram",
+		     "Time to handle client requests, by request type."));
+	for (i = 0; i < DQLITE_METRICS_REQUEST_TYPES; i++) {
+		if (m->requests[i] == 0 || requestName(i) == NULL) {
+			continue;
+		}
+		CHECK(histogram(b, "dqlite_request_duration_seconds", "type",
+				requestName(i), &m->request_latency[i]));
+	}
+
+	return 0;
+}
+
+static int formatRaft(const dqlite_node_metrics *m, struct buffer *b)
+{
+	unsigned i;
+
+	CHECK(single(b, "dqlite_raft_applies_total", "counter",
+		     "Raft commands submitted as leader.", m->applies));
+	CHECK(single(b, "dqlite_raft_apply_failures_total", "counter",
+		     "Raft commands that failed.", m->apply_failures));
+	CHECK(single(b, "dqlite_raft_apply_bytes_total", "counter",
+		     "Size of the raft commands submitted.", m->apply_bytes));
+	CHECK(family(b, "dqlite_raft_apply_duration_seconds", "histogram",
+		     "Time for raft commands to be applied."));
+	CHECK(histogram(b, "dqlite_raft_apply_duration_seconds", NULL, NULL,
+			&m->apply_latency));
+	CHECK(single(b, "dqlite_writes_shed_total", "counter",
+		     "Write transactions refused by admission control.",
+		     m->writes_shed));
+
+	CHECK(family(b, "dqlite_fsm_commands_total", "counter",
+		     "Raft commands applied locally, by command type."));
+	for (i = 0; i < DQLITE_METRICS_COMMAND_TYPES; i++) {
+		if (commandName(i) == NULL) {
+			continue;
+		}
+		CHECK(append(b, "dqlite_fsm_commands_total{command=\"%s\"} %llu\n",
+			     commandName(i), m->commands[i]));
+	}
+	CHECK(family(b, "dqlite_fsm_command_duration_seconds", "histogram",
+		     "Time to apply raft commands locally, by command type."));
+	for (i = 0; i < DQLITE_METRICS_COMMAND_TYPES; i++) {
+		if (commandName(i) == NULL) {
+			continue;
+		}
+		CHECK(histogram(b, "dqlite_fsm_command_duration_seconds",
+				"command", commandName(i),
+				&m->command_latency[i]));
+	}
+
+	CHECK(single(b, "dqlite_raft_term", "gauge", "Current raft term.",
+		     m->term));
+	CHECK(single(b, "dqlite_raft_commit_index", "gauge",
+		     "Index of the last committed raft entry.",
+		     m->commit_index));
+	CHECK(single(b, "dqlite_raft_last_applied", "gauge",
+		     "Index of the last applied raft entry.", m->last_applied));
+	CHECK(single(b, "dqlite_raft_last_index", "gauge",
+		     "Index of the last raft entry in the log.", m->last_index));
+
+	return 0;
+}
+
+static int formatOthers(const dqlite_node_metrics *m, struct buffer *b)
+{
+	CHECK(single(b, "dqlite_checkpoints_total", "counter",
+		     "WAL checkpoints taken.", m->checkpoints));
+	CHECK(single(b, "dqlite_checkpoints_busy_total", "counter",
+		     "WAL checkpoints postponed because of readers.",
+		     m->checkpoint_busy));
+	CHECK(single(b, "dqlite_checkpoints_skipped_total", "counter",
+		     "WAL checkpoints skipped because of a write or a dump.",
+		     m->checkpoint_skipped));
+	CHECK(single(b, "dqlite_checkpoint_failures_total", "counter",
+		     "WAL checkpoints that failed.", m->checkpoint_failures));
+	CHECK(append(b,
+		     "# HELP dqlite_checkpoint_duration_seconds_total Time "
+		     "spent checkpointing.\n"
+		     "# TYPE dqlite_checkpoint_duration_seconds_total counter\n"
+		     "dqlite_checkpoint_duration_seconds_total %.3f\n",
+		     (double)m->checkpoint_duration / 1e3));
+
+	CHECK(single(b, "dqlite_queries_total", "counter", "Queries completed.",
+		     m->queries));
+	CHECK(single(b, "dqlite_query_batches_total", "counter",
+		     "Batches of query rows sent.", m->query_batches));
+	CHECK(single(b, "dqlite_databases", "gauge", "Databases registered.",
+		     m->databases));
+
+	CHECK(single(b, "dqlite_connections", "gauge",
+		     "Client connections currently open.", m->connections));
+	CHECK(single(b, "dqlite_connections_total", "counter",
+		     "Client connections opened.", m->connections_total));
+
+	CHECK(single(b, "dqlite_buffer_gets_total", "counter",
+		     "Connection buffers taken from the pool.", m->buffer_gets));
+	CHECK(single(b, "dqlite_buffer_hits_total", "counter",
+		     "Connection buffers served by memory kept in the pool.",
+		     m->buffer_hits));
+
+	return 0;
+}
+
+int prometheus__format(const dqlite_node_metrics *m, struct buffer *b)
+{
+	CHECK(formatRequests(m, b));
+	CHECK(formatRaft(m, b));
+	CHECK(formatOthers(m, b));
+	return 0;
+}
+
+static void scrapeCloseCb(struct uv_handle_s *handle)
+{
+	struct scrape *s = handle->data;
+	s->handles--;
+	if (s->handles > 0) {
+		return;
+	}
+	QUEUE__REMOVE(&s->queue);
+	buffer__close(&s->body);
+	sqlite3_free(s);
+}
+
+static void scrapeClose(struct scrape *s)
+{
+	if (uv_is_closing((struct uv_handle_s *)&s->tcp)) {
+		return;
+	}
+	uv_close((struct uv_handle_s *)&s->tcp, scrapeCloseCb);
+	uv_close((struct uv_handle_s *)&s->timer, scrapeCloseCb);
+}
+
+static void timerCb(struct uv_timer_s *timer)
+{
+	struct scrape *s = timer->data;
+	scrapeClose(s);
+}
+
+static void writeCb(struct uv_write_s *req, int status)
+{
+	struct scrape *s = req->data;
+	(void)status;
+	scrapeClose(s);
+}
+
+static const char badRequest[] = "400 Bad Request";
+static const char notFound[] = "404 Not Found";
+static const char notAllowed[] = "405 Method Not Allowed";
+
+/* Return the status of the error response to the given request, or NULL if
+ * it's a GET request for the metrics. */
+static const char *route(const char *request, size_t n)
+{
+	const char *path;
+	size_t len;
+
+	path = memchr(request, ' ', n);
+	if (path == NULL) {
+		return badRequest;
+	}
+	path++;
+	for (len = 0; path + len < request + n; len++) {
+		char c = path[len];
+		if (c == ' ' || c == '?' || c == '\r' || c == '\n') {
+			break;
+		}
+	}
+	if (len != strlen("/metrics") || memcmp(path, "/metrics", len) != 0) {
+		return notFound;
+	}
+	if (path - request != 4 || memcmp(request, "GET", 3) != 0) {
+		return notAllowed;
+	}
+	return NULL;
+}
+
+/* Send the response, once the request headers are complete. */
+static void respond(struct scrape *s)
+{
+	struct prometheus *p = s->prometheus;
+	dqlite_node_metrics metrics;
+	const char *error;
+	uv_buf_t bufs[2];
+	int n;
+	int rv;
+
+	error = route(s->request, s->n);
+	if (error != NULL) {
+		n = snprintf(s->header, sizeof s->header,
+			     "HTTP/1.0 %s\r\n"
+			     "%s"
+			     "Content-Length: 0\r\n\r\n",
+			     error, error == notAllowed ? "Allow: GET\r\n" : "");
+		goto write;
+	}
+
+	p->collect(p->data, &metrics);
+
+	rv = prometheus__format(&metrics, &s->body);
+	if (rv != 0) {
+		buffer__reset(&s->body);
+		n = snprintf(s->header, sizeof s->header,
+			     "HTTP/1.0 500 Internal Server Error\r\n"
+			     "Content-Length: 0\r\n\r\n");
+	} else {
+		n = snprintf(s->header, sizeof s->header,
+			     "HTTP/1.0 200 OK\r\n"
+			     "Content-Type: text/plain; version=0.0.4\r\n"
+			     "Content-Length: %zu\r\n\r\n",
+			     buffer__offset(&s->body));
+	}
+
+write:
+	bufs[0] = uv_buf_init(s->header, (unsigned)n);
+	bufs[1] = uv_buf_init(buffer__cursor(&s->body, 0),
+			      (unsigned)buffer__offset(&s->body));
+	s->write.data = s;
+	rv = uv_write(&s->write, (struct uv_stream_s *)&s->tcp, bufs, 2,
+		      writeCb);
+	if (rv != 0) {
+		scrapeClose(s);
+	}
+}
+
+static void allocCb(struct uv_handle_s *handle, size_t size, uv_buf_t *buf)
+{
+	struct scrape *s = handle->data;
+	(void)size;
+	buf->base = s->request + s->n;
+	buf->len = sizeof s->request - s->n;
+}
+
+static void readCb(struct uv_stream_s *stream, ssize_t n, const uv_buf_t *buf)
+{
+	struct scrape *s = stream->data;
+	(void)buf;
+
+	if (n < 0) {
+		scrapeClose(s);
+		return;
+	}
+	s->n += (size_t)n;
+	uv_timer_again(&s->timer);
+
+	/* Wait for the end of the headers, or until we can't read more. */
+	if (s->n < sizeof s->request &&
+	    memmem(s->request, s->n, "\r\n\r\n", 4) == NULL &&
+	    memmem(s->request, s->n, "\n\n", 2) == NULL) {
+		return;
+	}
+
+	uv_read_stop(stream);
+	respond(s);
+}
+
+static void connectionCb(struct uv_stream_s *listener, int status)
+{
+	struct prometheus *p = listener->data;
+	struct scrape *s;
+	int rv;
+
+	if (status != 0) {
+		return;
+	}
+
+	s = sqlite3_malloc(sizeof *s);
+	if (s == NULL) {
+		return;
+	}
+	s->prometheus = p;
+	s->n = 0;
+	rv = buffer__init(&s->body);
+	if (rv != 0) {
+		sqlite3_free(s);
+		return;
+	}
+	rv = uv_tcp_init(listener->loop, &s->tcp);
+	assert(rv == 0);
+	s->tcp.data = s;
+	rv = uv_timer_init(listener->loop, &s->timer);
+	assert(rv == 0);
+	s->timer.data = s;
+	s->handles = 2;
+	QUEUE__PUSH(&p->scrapes, &s->queue);
+
+	/* The timer keeps running while the response is written, so a client
+	 * that doesn't read it doesn't hold the connection either. */
+	rv = uv_timer_start(&s->timer, timerCb, p->timeout, p->timeout);
+	assert(rv == 0);
+
+	rv = uv_accept(listener, (struct uv_stream_s *)&s->tcp);
+	if (rv != 0) {
+		scrapeClose(s);
+		return;
+	}
+	rv = uv_read_start((struct uv_stream_s *)&s->tcp, allocCb, readCb);
+	if (rv != 0) {
+		scrapeClose(s);
+	}
+}
+
+int prometheus__start(struct prometheus *p,
+		      struct uv_loop_s *loop,
+		      const struct sockaddr *addr,
+		      unsigned timeout,
+		      prometheus_collect_cb collect,
+		      void *data)
+{
+	int rv;
+
+	p->collect = collect;
+	p->data = data;
+	p->timeout = timeout;
+	QUEUE__INIT(&p->scrapes);
+
+	rv = uv_tcp_init(loop, &p->listener);
+	if (rv != 0) {
+		return DQLITE_ERROR;
+	}
+	p->listener.data = p;
+
+	rv = uv_tcp_bind(&p->listener, addr, 0);
+	if (rv != 0) {
+		goto err;
+	}
+	rv = uv_listen((struct uv_stream_s *)&p->listener, 16, connectionCb);
+	if (rv != 0) {
+		goto err;
+	}
+
+	return 0;
+
+err:
+	uv_close((struct uv_handle_s *)&p->listener, NULL);
+	return DQLITE_ERROR;
+}
+
+void prometheus__stop(struct prometheus *p)
+{
+	queue *head;
+	uv_close((struct uv_handle_s *)&p->listener, NULL);
+	QUEUE__FOREACH(head, &p->scrapes)
+	{
+		struct scrape *s = QUEUE__DATA(head, struct scrape, queue);
+		scrapeClose(s);
+	}
+}
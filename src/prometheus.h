@@ -0,0 +1,57 @@
+/**
+ * Serve node metrics in the Prometheus text exposition format over HTTP.
+ *
+ * This is a minimal HTTP/1.0 server running on the node's main loop: a GET
+ * request for /metrics gets a snapshot of the metrics as response, any other
+ * path gets a 404 and any other method a 405, after which the connection is
+ * closed. Connections that stay idle for too long are closed too.
+ */
+
+#ifndef PROMETHEUS_H_
+#define PROMETHEUS_H_
+
+#include <uv.h>
+
+#include "../include/dqlite.h"
+
+#include "lib/buffer.h"
+#include "lib/queue.h"
+
+/* Time after which a connection with no activity is closed, in milliseconds. */
+#define PROMETHEUS__TIMEOUT 10000
+
+/* Fill a metrics snapshot to be served. */
+typedef void (*prometheus_collect_cb)(void *data, dqlite_node_metrics *m);
+
+struct prometheus
+{
+	struct uv_tcp_s listener;      /* Listening socket */
+	prometheus_collect_cb collect; /* Take a metrics snapshot */
+	void *data;                    /* Argument of the collect callback */
+	unsigned timeout;              /* Idle connections timeout, in ms */
+	queue scrapes;                 /* Connected clients */
+};
+
+/**
+ * Start listening on the given address, closing client connections with no
+ * activity for @timeout milliseconds, see #PROMETHEUS__TIMEOUT.
+ */
+int prometheus__start(struct prometheus *p,
+		      struct uv_loop_s *loop,
+		      const struct sockaddr *addr,
+		      unsigned timeout,
+		      prometheus_collect_cb collect,
+		      void *data);
+
+/**
+ * Stop listening and close all client connections. The handles are closed
+ * asynchronously, so the loop must run for their memory to be released.
+ */
+void prometheus__stop(struct prometheus *p);
+
+/**
+ * Append the text exposition of the given metrics to the given buffer.
+ */
+int prometheus__format(const dqlite_node_metrics *m, struct buffer *b);
+
+#endif /* PROMETHEUS_H_ */
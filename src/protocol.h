@@ -25,6 +25,37 @@
 /* Special value indicating that the result set is complete. */
 #define DQLITE_RESPONSE_ROWS_DONE 0xffffffffffffffff
 
+/* Message flag marking a tagged request. The extra field of the message header
+ * holds a tag chosen by the client, which is echoed back in the header of the
+ * response. A client sending tagged requests may send more of them without
+ * waiting for the responses, which come back in the same order. */
+#define DQLITE_MESSAGE_TAGGED 1
+
+/* Message flag asking for query results in the columnar format, see
+ * query__batch_columnar(). It's echoed back in the header of ROWS responses
+ * using that format. */
+#define DQLITE_MESSAGE_COLUMNAR 2
+
+/* Message flag asking for a DUMP to be streamed as a sequence of CHUNK
+ * responses, each holding a bounded part of a file, instead of a single FILES
+ * response. The last one ends with DQLITE_RESPONSE_ROWS_DONE, the others with
+ * DQLITE_RESPONSE_ROWS_PART. */
+#define DQLITE_MESSAGE_CHUNKED 4
+
+/* Capabilities that a client and a server can agree on with a CAPABILITIES
+ * request, which carries the client ones. The response carries the ones
+ * supported by both, which apply to the rest of the connection. Message flags
+ * of agreed capabilities are implied by every request. */
+#define DQLITE_CAPABILITY_TAGGED 1   /* Pipelining of tagged requests */
+#define DQLITE_CAPABILITY_COLUMNAR 2 /* Rows in the columnar format */
+#define DQLITE_CAPABILITY_CHUNKED 4  /* Dumps streamed in chunks */
+#define DQLITE_CAPABILITY_BATCH 8    /* EXEC_BULK, BATCH and OPTION requests */
+
+/* All capabilities supported by this version. */
+#define DQLITE_CAPABILITIES                                      \
+	(DQLITE_CAPABILITY_TAGGED | DQLITE_CAPABILITY_COLUMNAR | \
+	 DQLITE_CAPABILITY_CHUNKED | DQLITE_CAPABILITY_BATCH)
+
 /* Request types */
 #define DQLITE_REQUEST_LEADER 0
 #define DQLITE_REQUEST_CLIENT 1
@@ -44,10 +75,22 @@
 #define DQLITE_REQUEST_DUMP 15
 #define DQLITE_REQUEST_CLUSTER 16
 #define DQLITE_REQUEST_TRANSFER 17
+#define DQLITE_REQUEST_QUERY_STALE 18
+#define DQLITE_REQUEST_QUERY_SQL_STALE 19
+#define DQLITE_REQUEST_EXEC_BULK 20
+#define DQLITE_REQUEST_BATCH 21
+#define DQLITE_REQUEST_OPTION 22
+#define DQLITE_REQUEST_CAPABILITIES 23
+#define DQLITE_REQUEST_METRICS 24
 
 #define DQLITE_REQUEST_CLUSTER_FORMAT_V0 0 /* ID and address */
 #define DQLITE_REQUEST_CLUSTER_FORMAT_V1 1 /* ID, address and role */
 
+/* Connection options, set with an OPTION request */
+#define DQLITE_OPTION_BATCH_BYTES 0 /* Bytes per batch of rows, 0 for default */
+#define DQLITE_OPTION_BATCH_ROWS 1  /* Rows per batch of rows, 0 for any */
+#define DQLITE_OPTION_TIME_BUDGET 2 /* Query time in ms, 0 for default */
+
 /* Response types */
 #define DQLITE_RESPONSE_FAILURE 0
 #define DQLITE_RESPONSE_SERVER 1
@@ -60,5 +103,9 @@
 #define DQLITE_RESPONSE_ROWS 7
 #define DQLITE_RESPONSE_EMPTY 8
 #define DQLITE_RESPONSE_FILES 9
+#define DQLITE_RESPONSE_RESULTS 10
+#define DQLITE_RESPONSE_CHUNK 11
+#define DQLITE_RESPONSE_CAPABILITIES 12
+#define DQLITE_RESPONSE_METRICS 13
 
 #endif /* DQLITE_PROTOCOL_H_ */
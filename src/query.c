@@ -2,17 +2,79 @@
 #include "tuple.h"
 
 
-/* Return the type code of the i'th column value.
+/* Classes of declared column types that get a dqlite-specific type code. */
+enum { DECL_PLAIN = 0, DECL_TIME, DECL_BOOLEAN };
+
+/* Map the declared type of the i'th column to its class.
  *
  * TODO: find a better way to handle time types. */
-static int value_type(sqlite3_stmt *stmt, int i)
+static unsigned char decl_class(sqlite3_stmt *stmt, int i)
 {
-	int type = sqlite3_column_type(stmt, i);
 	const char *column_type_name = sqlite3_column_decltype(stmt, i);
-	if (column_type_name != NULL) {
-		if ((strcasecmp(column_type_name, "DATETIME") == 0)  ||
-		    (strcasecmp(column_type_name, "DATE") == 0)      ||
-		    (strcasecmp(column_type_name, "TIMESTAMP") == 0)) {
+	if (column_type_name == NULL) {
+		return DECL_PLAIN;
+	}
+	if ((strcasecmp(column_type_name, "DATETIME") == 0) ||
+	    (strcasecmp(column_type_name, "DATE") == 0) ||
+	    (strcasecmp(column_type_name, "TIMESTAMP") == 0)) {
+		return DECL_TIME;
+	}
+	if (strcasecmp(column_type_name, "BOOLEAN") == 0) {
+		return DECL_BOOLEAN;
+	}
+	return DECL_PLAIN;
+}
+
+void query_types__init(struct query_types *t)
+{
+	t->decls = NULL;
+	t->n = 0;
+	t->reprepares = 0;
+}
+
+void query_types__close(struct query_types *t)
+{
+	sqlite3_free(t->decls);
+}
+
+/* Compute the declared type classes of the columns of the given statement,
+ * unless they were already computed and SQLite didn't re-prepare the statement
+ * since then, e.g. because of a schema change. */
+static int query_types__refresh(struct query_types *t, sqlite3_stmt *stmt)
+{
+	int reprepares = sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_REPREPARE, 0);
+	int n = sqlite3_column_count(stmt);
+	unsigned char *decls;
+	int i;
+
+	if (t->decls != NULL && t->n == n && t->reprepares == reprepares) {
+		return SQLITE_OK;
+	}
+
+	assert(n > 0);
+	decls = sqlite3_realloc64(t->decls, (size_t)n);
+	if (decls == NULL) {
+		return SQLITE_NOMEM;
+	}
+	for (i = 0; i < n; i++) {
+		decls[i] = decl_class(stmt, i);
+	}
+	t->decls = decls;
+	t->n = n;
+	t->reprepares = reprepares;
+
+	return SQLITE_OK;
+}
+
+/* Return the type code of the i'th column value. */
+static int value_type(sqlite3_stmt *stmt,
+		      const struct query_types *types,
+		      int i)
+{
+	int type = sqlite3_column_type(stmt, i);
+	assert(i < types->n);
+	switch (types->decls[i]) {
+		case DECL_TIME:
 			if (type == SQLITE_INTEGER) {
 				type = DQLITE_UNIXTIME;
 			} else {
@@ -20,10 +82,13 @@ static int value_type(sqlite3_stmt *stmt, int i)
 				       type == SQLITE_NULL);
 				type = DQLITE_ISO8601;
 			}
-		} else if (strcasecmp(column_type_name, "BOOLEAN") == 0) {
+			break;
+		case DECL_BOOLEAN:
 			assert(type == SQLITE_INTEGER || type == SQLITE_NULL);
 			type = DQLITE_BOOLEAN;
-		}
+			break;
+		default:
+			break;
 	}
 
 	assert(type < 16);
@@ -31,7 +96,10 @@ static int value_type(sqlite3_stmt *stmt, int i)
 }
 
 /* Append a single row to the message. */
-static int encode_row(sqlite3_stmt *stmt, struct buffer *buffer, int n)
+static int encode_row(sqlite3_stmt *stmt,
+		      const struct query_types *types,
+		      struct buffer *buffer,
+		      int n)
 {
 	struct tuple_encoder encoder;
 	int rc;
@@ -46,7 +114,7 @@ static int encode_row(sqlite3_stmt *stmt, struct buffer *buffer, int n)
 	for (i = 0; i < n; i++) {
 		/* Figure the type */
 		struct value value;
-		value.type = value_type(stmt, i);
+		value.type = value_type(stmt, types, i);
 		switch (value.type) {
 			case SQLITE_INTEGER:
 				value.integer =
@@ -97,24 +165,19 @@ static int encode_row(sqlite3_stmt *stmt, struct buffer *buffer, int n)
 	return SQLITE_OK;
 }
 
-int query__batch(sqlite3_stmt *stmt, struct buffer *buffer) {
-	int n; /* Column count */
-	int i;
-	uint64_t n64;
+/* Insert the column count and the column names. */
+static int encode_header(sqlite3_stmt *stmt, struct buffer *buffer, int n)
+{
+	uint64_t n64 = n;
 	void *cursor;
-	int rc;
-
-	n = sqlite3_column_count(stmt);
-	if (n <= 0) {
-		return SQLITE_ERROR;
-	}
-	n64 = n;
+	int i;
 
-	/* Insert the column count */
 	cursor = buffer__advance(buffer, sizeof(uint64_t));
+	if (cursor == NULL) {
+		return SQLITE_NOMEM;
+	}
 	uint64__encode(&n64, &cursor);
 
-	/* Insert the column names */
 	for (i = 0; i < n; i++) {
 		const char *name = sqlite3_column_name(stmt, i);
 		cursor = buffer__advance(buffer, text__sizeof(&name));
@@ -124,12 +187,48 @@ int query__batch(sqlite3_stmt *stmt, struct buffer *buffer) {
 		text__encode(&name, &cursor);
 	}
 
+	return SQLITE_OK;
+}
+
+/* Whether a batch with the given size and number of rows used up its budget. */
+static bool is_full(const struct query_budget *budget,
+		    size_t size,
+		    unsigned rows)
+{
+	return size >= budget->bytes ||
+	       (budget->rows != 0 && rows >= budget->rows);
+}
+
+int query__batch(sqlite3_stmt *stmt,
+		 struct query_types *types,
+		 struct buffer *buffer,
+		 const struct query_budget *budget)
+{
+	struct query_types local;
+	unsigned n_rows = 0;
+	int n; /* Column count */
+	int rc;
+
+	n = sqlite3_column_count(stmt);
+	if (n <= 0) {
+		return SQLITE_ERROR;
+	}
+
+	if (types == NULL) {
+		query_types__init(&local);
+		types = &local;
+	}
+
+	rc = encode_header(stmt, buffer, n);
+	if (rc != SQLITE_OK) {
+		goto out;
+	}
+
 	/* Insert the rows. */
 	do {
-		if (buffer__offset(buffer) >= buffer->page_size) {
-			/* If we are already filled a memory page, let's break
-			 * for now, we'll send more rows in a separate
-			 * response. */
+		if (is_full(budget, buffer__offset(buffer), n_rows)) {
+			/* If we have already filled the batch, let's break for
+			 * now, we'll send more rows in a separate response. */
 			rc = SQLITE_ROW;
 			break;
 		}
@@ -137,13 +236,415 @@ int query__batch(sqlite3_stmt *stmt, struct buffer *buffer) {
 		if (rc != SQLITE_ROW) {
 			break;
 		}
-		rc = encode_row(stmt, buffer, n);
+		if (n_rows == 0) {
+			/* The statement gets re-prepared, if needed, only when
+			 * stepping it for the first time. */
+			rc = query_types__refresh(types, stmt);
+			if (rc != SQLITE_OK) {
+				break;
+			}
+		}
+		rc = encode_row(stmt, types, buffer, n);
 		if (rc != SQLITE_OK) {
 			break;
 		}
+		n_rows++;
 
 	} while (1);
 
+out:
+	if (types == &local) {
+		query_types__close(&local);
+	}
 	return rc;
 }
 
+/* Values of a single column of a columnar batch, accumulated row by row. */
+struct query_column
+{
+	int type;             /* Type of non-NULL values, SQLITE_NULL if none */
+	unsigned first;       /* Row of the first non-NULL value */
+	struct buffer nulls;  /* Null bitmap, one native 64-bit word at a time */
+	struct buffer values; /* Encoded values, or end offsets of text/blobs */
+	struct buffer data;   /* Text and blob bytes */
+};
+
+static void column_close(struct query_column *c)
+{
+	buffer__close(&c->nulls);
+	buffer__close(&c->values);
+	buffer__close(&c->data);
+}
+
+static int column_init(struct query_column *c)
+{
+	c->type = SQLITE_NULL;
+	c->first = 0;
+	if (buffer__init(&c->nulls) != 0) {
+		goto err;
+	}
+	if (buffer__init(&c->values) != 0) {
+		goto err_after_nulls;
+	}
+	if (buffer__init(&c->data) != 0) {
+		goto err_after_values;
+	}
+	return 0;
+
+err_after_values:
+	buffer__close(&c->values);
+err_after_nulls:
+	buffer__close(&c->nulls);
+err:
+	return SQLITE_NOMEM;
+}
+
+/* Empty the column, keeping the memory of its buffers. */
+static void column_reset(struct query_column *c)
+{
+	c->type = SQLITE_NULL;
+	c->first = 0;
+	buffer__reset(&c->nulls);
+	buffer__reset(&c->values);
+	buffer__reset(&c->data);
+}
+
+void query_columns__init(struct query_columns *c)
+{
+	c->columns = NULL;
+	c->n = 0;
+}
+
+void query_columns__close(struct query_columns *c)
+{
+	int i;
+	for (i = 0; i < c->n; i++) {
+		column_close(&c->columns[i]);
+	}
+	sqlite3_free(c->columns);
+	c->columns = NULL;
+	c->n = 0;
+}
+
+/* Make room for @n empty columns, reusing the ones of previous batches. */
+static int query_columns__prepare(struct query_columns *c, int n)
+{
+	struct query_column *columns;
+	int i;
+	int rc;
+
+	for (i = 0; i < n && i < c->n; i++) {
+		column_reset(&c->columns[i]);
+	}
+	if (n <= c->n) {
+		return SQLITE_OK;
+	}
+	columns = sqlite3_realloc64(c->columns, (size_t)n * sizeof *columns);
+	if (columns == NULL) {
+		return SQLITE_NOMEM;
+	}
+	c->columns = columns;
+	for (; c->n < n; c->n++) {
+		rc = column_init(&c->columns[c->n]);
+		if (rc != SQLITE_OK) {
+			return rc;
+		}
+	}
+	return SQLITE_OK;
+}
+
+/* Whether values of the given type are stored in the data area. */
+static bool is_variable(int type)
+{
+	return type == SQLITE_TEXT || type == DQLITE_ISO8601 ||
+	       type == SQLITE_BLOB;
+}
+
+/* Append the value of the i'th column of the current row, which is the r'th
+ * row of the batch.
+ *
+ * Return SQLITE_MISMATCH if the value has a different type than the previous
+ * non-NULL values of the column: a new batch must be started for it. */
+static int column_append(struct query_column *c,
+			 sqlite3_stmt *stmt,
+			 const struct query_types *types,
+			 int i,
+			 unsigned r)
+{
+	uint64_t *word;
+	uint64_t value = 0;
+	void *cursor;
+	int type;
+	unsigned j;
+
+	if (r % 64 == 0) {
+		word = buffer__advance(&c->nulls, sizeof *word);
+		if (word == NULL) {
+			return SQLITE_NOMEM;
+		}
+		*word = 0;
+	}
+
+	if (sqlite3_column_type(stmt, i) == SQLITE_NULL) {
+		word = buffer__cursor(&c->nulls, (r / 64) * sizeof *word);
+		*word |= (uint64_t)1 << (r % 64);
+		if (c->type == SQLITE_NULL) {
+			return SQLITE_OK;
+		}
+		/* NULL values get a zero integer or float, or an empty string
+		 * or blob. */
+		if (is_variable(c->type)) {
+			value = buffer__offset(&c->data);
+		}
+		goto append;
+	}
+
+	type = value_type(stmt, types, i);
+	if (type != c->type) {
+		if (c->type != SQLITE_NULL) {
+			return SQLITE_MISMATCH;
+		}
+		/* First non-NULL value: fill the slots of the NULLs so far. */
+		c->type = type;
+		c->first = r;
+		for (j = 0; j < r; j++) {
+			cursor = buffer__advance(&c->values, sizeof value);
+			if (cursor == NULL) {
+				return SQLITE_NOMEM;
+			}
+			uint64__encode(&value, &cursor);
+		}
+	}
+
+	switch (type) {
+		case SQLITE_INTEGER:
+		case DQLITE_UNIXTIME:
+		case DQLITE_BOOLEAN:
+			value = (uint64_t)sqlite3_column_int64(stmt, i);
+			break;
+		case SQLITE_FLOAT: {
+			float_t f = sqlite3_column_double(stmt, i);
+			memcpy(&value, &f, sizeof value);
+			break;
+		}
+		case SQLITE_TEXT:
+		case DQLITE_ISO8601:
+		case SQLITE_BLOB: {
+			const void *bytes = type == SQLITE_BLOB
+						? sqlite3_column_blob(stmt, i)
+						: sqlite3_column_text(stmt, i);
+			size_t len = (size_t)sqlite3_column_bytes(stmt, i);
+			void *data = buffer__advance(&c->data, len);
+			if (data == NULL) {
+				return SQLITE_NOMEM;
+			}
+			if (len > 0) {
+				memcpy(data, bytes, len);
+			}
+			value = buffer__offset(&c->data);
+			break;
+		}
+		default:
+			return SQLITE_ERROR;
+	}
+
+append:
+	cursor = buffer__advance(&c->values, sizeof value);
+	if (cursor == NULL) {
+		return SQLITE_NOMEM;
+	}
+	uint64__encode(&value, &cursor);
+	return SQLITE_OK;
+}
+
+/* Drop the value of row r from the column, after another column of the same
+ * row turned out to need a new batch. */
+static void column_truncate(struct query_column *c, unsigned r)
+{
+	uint64_t *word;
+
+	c->nulls.offset = ((r + 63) / 64) * sizeof *word;
+	if (r % 64 != 0) {
+		word = buffer__cursor(&c->nulls, (r / 64) * sizeof *word);
+		*word &= ((uint64_t)1 << (r % 64)) - 1;
+	}
+
+	if (c->type == SQLITE_NULL) {
+		return;
+	}
+	if (c->first >= r) {
+		/* The column has no non-NULL value anymore. */
+		c->type = SQLITE_NULL;
+		c->values.offset = 0;
+		c->data.offset = 0;
+		return;
+	}
+
+	c->values.offset = r * sizeof(uint64_t);
+	if (is_variable(c->type)) {
+		/* Data ends where the value of the previous row ends. */
+		uint64_t *end = buffer__cursor(&c->values,
+					       (r - 1) * sizeof(uint64_t));
+		c->data.offset = (size_t)byte__flip64(*end);
+	}
+}
+
+/* Write out a column accumulated with column_append(). */
+static int column_encode(struct query_column *c,
+			 struct buffer *buffer,
+			 unsigned n)
+{
+	uint64_t type = c->type;
+	size_t n_words = (n + 63) / 64;
+	size_t len;
+	size_t data_len;
+	void *cursor;
+	size_t i;
+
+	data_len = buffer__offset(&c->data);
+	len = sizeof type + n_words * sizeof(uint64_t) +
+	      buffer__offset(&c->values) + byte__pad64(data_len);
+	cursor = buffer__advance(buffer, len);
+	if (cursor == NULL) {
+		return SQLITE_NOMEM;
+	}
+
+	uint64__encode(&type, &cursor);
+	for (i = 0; i < n_words; i++) {
+		uint64_t *word = buffer__cursor(&c->nulls, i * sizeof *word);
+		uint64__encode(word, &cursor);
+	}
+	memcpy(cursor, buffer__cursor(&c->values, 0),
+	       buffer__offset(&c->values));
+	cursor += buffer__offset(&c->values);
+	if (data_len > 0) {
+		memcpy(cursor, buffer__cursor(&c->data, 0), data_len);
+		memset(cursor + data_len, 0, byte__pad64(data_len) - data_len);
+	}
+
+	return SQLITE_OK;
+}
+
+int query__batch_columnar(sqlite3_stmt *stmt,
+			  struct query_types *types,
+			  struct query_columns *cache,
+			  struct buffer *buffer,
+			  const struct query_budget *budget,
+			  bool *pending)
+{
+	struct query_types local;
+	struct query_columns local_cache;
+	struct query_column *columns;
+	uint64_t n_rows = 0;
+	size_t size;
+	void *cursor;
+	int n; /* Column count */
+	int j;
+	int rc;
+	int rv;
+
+	n = sqlite3_column_count(stmt);
+	if (n <= 0) {
+		return SQLITE_ERROR;
+	}
+
+	if (types == NULL) {
+		query_types__init(&local);
+		types = &local;
+	}
+	if (cache == NULL) {
+		query_columns__init(&local_cache);
+		cache = &local_cache;
+	}
+
+	rc = query_columns__prepare(cache, n);
+	if (rc != SQLITE_OK) {
+		goto out;
+	}
+	columns = cache->columns;
+
+	/* Accumulate rows until the budget is used up, like query__batch()
+	 * does. */
+	size = 0;
+	do {
+		if (is_full(budget, size, (unsigned)n_rows)) {
+			rc = SQLITE_ROW;
+			break;
+		}
+		if (*pending) {
+			/* The current row didn't fit in the previous batch. */
+			*pending = false;
+			rc = SQLITE_ROW;
+		} else {
+			rc = sqlite3_step(stmt);
+		}
+		if (rc != SQLITE_ROW) {
+			break;
+		}
+		if (n_rows == 0) {
+			rc = query_types__refresh(types, stmt);
+			if (rc != SQLITE_OK) {
+				goto out;
+			}
+		}
+		for (j = 0; j < n; j++) {
+			rc = column_append(&columns[j], stmt, types, j,
+					   (unsigned)n_rows);
+			if (rc != SQLITE_OK) {
+				break;
+			}
+		}
+		if (rc == SQLITE_MISMATCH) {
+			/* Leave this row for the next batch. This can't happen
+			 * for the first row, since all columns are untyped. */
+			assert(n_rows > 0);
+			for (j = 0; j < n; j++) {
+				column_truncate(&columns[j], (unsigned)n_rows);
+			}
+			*pending = true;
+			rc = SQLITE_ROW;
+			break;
+		}
+		if (rc != SQLITE_OK) {
+			goto out;
+		}
+		n_rows++;
+		size = 0;
+		for (j = 0; j < n; j++) {
+			size += buffer__offset(&columns[j].values) +
+				buffer__offset(&columns[j].data);
+		}
+	} while (1);
+
+	if (rc != SQLITE_ROW && rc != SQLITE_DONE) {
+		goto out;
+	}
+
+	rv = encode_header(stmt, buffer, n);
+	if (rv != SQLITE_OK) {
+		rc = rv;
+		goto out;
+	}
+	cursor = buffer__advance(buffer, sizeof n_rows);
+	if (cursor == NULL) {
+		rc = SQLITE_NOMEM;
+		goto out;
+	}
+	uint64__encode(&n_rows, &cursor);
+	for (j = 0; j < n; j++) {
+		rv = column_encode(&columns[j], buffer, (unsigned)n_rows);
+		if (rv != SQLITE_OK) {
+			rc = rv;
+			goto out;
+		}
+	}
+
+out:
+	if (cache == &local_cache) {
+		query_columns__close(&local_cache);
+	}
+	if (types == &local) {
+		query_types__close(&local);
+	}
+	return rc;
+}
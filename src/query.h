@@ -6,15 +6,108 @@
 #define QUERY_H_
 
 #include <sqlite3.h>
+#include <stdbool.h>
 
 #include "lib/serialize.h"
 #include "lib/buffer.h"
 
+/**
+ * Limits on the size of a single batch of rows. A batch ends as soon as the
+ * buffer holds at least @bytes bytes, or @rows rows were encoded. A row limit of
+ * zero means no limit.
+ */
+struct query_budget
+{
+	size_t bytes;
+	unsigned rows;
+};
+
+/**
+ * Declared types of the columns of a statement, as far as they map to
+ * dqlite-specific type codes (e.g. DATETIME or BOOLEAN).
+ *
+ * Looking them up involves string comparisons, so they are computed only the
+ * first time a statement yields a row and then cached, until SQLite re-prepares
+ * the statement because of a schema change.
+ */
+struct query_types
+{
+	unsigned char *decls; /* Class of the declared type of each column */
+	int n;                /* Number of columns */
+	int reprepares;       /* Re-prepare count of the statement when computed */
+};
+
+void query_types__init(struct query_types *t);
+
+void query_types__close(struct query_types *t);
+
+struct query_column;
+
+/**
+ * Buffers accumulating the values of each column of a columnar batch, see
+ * query__batch_columnar().
+ *
+ * They are kept across batches and only reset, rather than mapped afresh for
+ * every column of every batch.
+ */
+struct query_columns
+{
+	struct query_column *columns; /* Buffers of each column */
+	int n;                        /* Number of columns with buffers */
+};
+
+void query_columns__init(struct query_columns *c);
+
+void query_columns__close(struct query_columns *c);
+
 /**
  * Step through the given query statement progressively encoding the yielded row
- * tuples, either until #SQLITE_DONE is returned or a full page of the given
- * buffer is filled.
+ * tuples, either until #SQLITE_DONE is returned or the given budget is used up.
+ *
+ * The declared column types are cached in @types, which can be NULL if the
+ * statement has no cache of its own.
+ */
+int query__batch(sqlite3_stmt *stmt,
+		 struct query_types *types,
+		 struct buffer *buffer,
+		 const struct query_budget *budget);
+
+/**
+ * Like query__batch(), but encode the rows of the batch column by column,
+ * accumulating values in the buffers of @cache, which can be NULL to use
+ * temporary ones.
+ *
+ * The batch starts with the same column count and names as the row format,
+ * followed by the number of rows N in the batch. Then for each column:
+ *
+ *  64 bits: Type code of the non-NULL values of the column in this batch, or
+ *           SQLITE_NULL if they are all NULL.
+ *  ...      Null bitmap, one 64-bit word per 64 rows. Bit i % 64 of word i / 64
+ *           is set if the value of the i'th row is NULL.
+ *  ...      Unless the type is SQLITE_NULL, N 64-bit values. For integer,
+ *           boolean and unix time columns these are the values themselves,
+ *           for float columns the IEEE 754 bits. For text, ISO 8601 and blob
+ *           columns they are the end offsets of each value in the data area
+ *           that follows, which holds the bytes of all values, with no NUL
+ *           terminators, padded to a word boundary.
+ *
+ * Values of NULL rows are zero, or empty.
+ *
+ * All non-NULL values of a column in a batch have the same type. A row whose
+ * value doesn't match the type of its column starts a new batch: in that case
+ * @pending is set to true, and the next call encodes that row first, without
+ * stepping the statement.
+ *
+ * In the worst case, a column whose values alternate between two types, e.g.
+ * integers and text in a column without declared affinity, yields batches of
+ * a single row each. Clients expecting such data should ask for the row
+ * format instead.
  */
-int query__batch(sqlite3_stmt *stmt, struct buffer *buffer);
+int query__batch_columnar(sqlite3_stmt *stmt,
+			  struct query_types *types,
+			  struct query_columns *cache,
+			  struct buffer *buffer,
+			  const struct query_budget *budget,
+			  bool *pending);
 
 #endif /* QUERY_H_*/
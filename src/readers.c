@@ -0,0 +1,200 @@
+#include <sqlite3.h>
+
+#include "../include/dqlite.h"
+
+#include "./lib/assert.h"
+
+#include "readers.h"
+
+static void *readerStart(void *arg)
+{
+	struct readers *r = arg;
+	struct reader_work *w;
+	queue *head;
+
+	pthread_mutex_lock(&r->mutex);
+	while (1) {
+		while ((QUEUE__IS_EMPTY(&r->pending) || r->paused) &&
+		       !r->stopping) {
+			pthread_cond_wait(&r->wakeup, &r->mutex);
+		}
+		if (r->stopping) {
+			break;
+		}
+		head = QUEUE__HEAD(&r->pending);
+		QUEUE__REMOVE(head);
+		w = QUEUE__DATA(head, struct reader_work, queue);
+		w->state = READER_WORK_RUNNING;
+		r->running++;
+		pthread_mutex_unlock(&r->mutex);
+
+		w->work(w);
+
+		pthread_mutex_lock(&r->mutex);
+		w->state = READER_WORK_DONE;
+		r->running--;
+		QUEUE__PUSH(&r->done, &w->queue);
+		pthread_cond_broadcast(&r->finished);
+		uv_async_send(&r->async);
+	}
+	pthread_mutex_unlock(&r->mutex);
+
+	return NULL;
+}
+
+/* Invoke the done callbacks of all finished work, on the main loop thread. */
+static void asyncCb(uv_async_t *async)
+{
+	struct readers *r = async->data;
+	struct reader_work *w;
+	queue done;
+	queue *head;
+
+	QUEUE__INIT(&done);
+	pthread_mutex_lock(&r->mutex);
+	while (!QUEUE__IS_EMPTY(&r->done)) {
+		head = QUEUE__HEAD(&r->done);
+		QUEUE__REMOVE(head);
+		QUEUE__PUSH(&done, head);
+	}
+	pthread_mutex_unlock(&r->mutex);
+
+	while (!QUEUE__IS_EMPTY(&done)) {
+		head = QUEUE__HEAD(&done);
+		QUEUE__REMOVE(head);
+		w = QUEUE__DATA(head, struct reader_work, queue);
+		w->state = READER_WORK_IDLE;
+		w->done(w);
+	}
+}
+
+void readers__init(struct readers *r)
+{
+	r->threads = NULL;
+	r->n = 0;
+	r->running = 0;
+	r->paused = false;
+	r->stopping = false;
+	QUEUE__INIT(&r->pending);
+	QUEUE__INIT(&r->done);
+	pthread_mutex_init(&r->mutex, NULL);
+	pthread_cond_init(&r->wakeup, NULL);
+	pthread_cond_init(&r->finished, NULL);
+}
+
+int readers__start(struct readers *r, struct uv_loop_s *loop, unsigned n)
+{
+	unsigned i;
+	int rv;
+
+	assert(r->threads == NULL);
+	if (n == 0) {
+		return 0;
+	}
+
+	r->threads = sqlite3_malloc64(n * sizeof *r->threads);
+	if (r->threads == NULL) {
+		return DQLITE_NOMEM;
+	}
+
+	r->async.data = r;
+	rv = uv_async_init(loop, &r->async, asyncCb);
+	if (rv != 0) {
+		sqlite3_free(r->threads);
+		r->threads = NULL;
+		return DQLITE_ERROR;
+	}
+
+	for (i = 0; i < n; i++) {
+		rv = pthread_create(&r->threads[i], NULL, readerStart, r);
+		if (rv != 0) {
+			rv = DQLITE_ERROR;
+			goto err;
+		}
+		r->n++;
+	}
+
+	return 0;
+
+err:
+	readers__stop(r);
+	return rv;
+}
+
+void readers__stop(struct readers *r)
+{
+	unsigned i;
+
+	if (r->threads == NULL) {
+		return;
+	}
+
+	pthread_mutex_lock(&r->mutex);
+	r->stopping = true;
+	pthread_cond_broadcast(&r->wakeup);
+	pthread_mutex_unlock(&r->mutex);
+
+	for (i = 0; i < r->n; i++) {
+		pthread_join(r->threads[i], NULL);
+	}
+	sqlite3_free(r->threads);
+	r->threads = NULL;
+	r->n = 0;
+	r->stopping = false;
+
+	uv_close((struct uv_handle_s *)&r->async, NULL);
+}
+
+void readers__close(struct readers *r)
+{
+	assert(r->threads == NULL);
+	pthread_cond_destroy(&r->finished);
+	pthread_cond_destroy(&r->wakeup);
+	pthread_mutex_destroy(&r->mutex);
+}
+
+void readers__submit(struct readers *r, struct reader_work *w)
+{
+	assert(w->state == READER_WORK_IDLE);
+	w->readers = r;
+	pthread_mutex_lock(&r->mutex);
+	w->state = READER_WORK_PENDING;
+	QUEUE__PUSH(&r->pending, &w->queue);
+	pthread_cond_signal(&r->wakeup);
+	pthread_mutex_unlock(&r->mutex);
+}
+
+void readers__cancel(struct reader_work *w)
+{
+	struct readers *r = w->readers;
+	if (r == NULL) {
+		return;
+	}
+	pthread_mutex_lock(&r->mutex);
+	while (w->state == READER_WORK_RUNNING) {
+		pthread_cond_wait(&r->finished, &r->mutex);
+	}
+	if (w->state == READER_WORK_PENDING || w->state == READER_WORK_DONE) {
+		QUEUE__REMOVE(&w->queue);
+	}
+	w->state = READER_WORK_IDLE;
+	pthread_mutex_unlock(&r->mutex);
+}
+
+void readers__pause(struct readers *r)
+{
+	pthread_mutex_lock(&r->mutex);
+	r->paused = true;
+	while (r->running > 0) {
+		pthread_cond_wait(&r->finished, &r->mutex);
+	}
+	pthread_mutex_unlock(&r->mutex);
+}
+
+void readers__resume(struct readers *r)
+{
+	pthread_mutex_lock(&r->mutex);
+	r->paused = false;
+	pthread_cond_broadcast(&r->wakeup);
+	pthread_mutex_unlock(&r->mutex);
+}
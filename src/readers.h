@@ -0,0 +1,105 @@
+/**
+ * Pool of reader threads running read-only queries off the main loop.
+ *
+ * Stepping a statement blocks the thread running it, so a heavy query served
+ * on the main loop thread stalls raft, writes and every other client. Batches
+ * of rows of read-only queries can instead be produced by one of these
+ * threads, using the leader connection of the gateway serving the query, while
+ * the main loop keeps running. The in-memory VFS serializes access to file
+ * content, so readers see consistent WAL snapshots.
+ */
+
+#ifndef READERS_H_
+#define READERS_H_
+
+#include <pthread.h>
+#include <stdbool.h>
+
+#include <uv.h>
+
+#include "lib/queue.h"
+
+struct reader_work;
+typedef void (*reader_work_cb)(struct reader_work *w);
+
+enum {
+	READER_WORK_IDLE = 0,
+	READER_WORK_PENDING,
+	READER_WORK_RUNNING,
+	READER_WORK_DONE
+};
+
+/**
+ * A unit of work to run on a reader thread.
+ */
+struct reader_work
+{
+	void *data;              /* User data */
+	reader_work_cb work;     /* Run on a reader thread */
+	reader_work_cb done;     /* Run on the loop thread, once work is done */
+	int state;               /* Either idle, pending, running or done */
+	struct readers *readers; /* Pool the work was submitted to */
+	queue queue;             /* Position in the pending or done queue */
+};
+
+struct readers
+{
+	pthread_t *threads;      /* Reader threads */
+	unsigned n;              /* Number of threads, 0 to run work inline */
+	pthread_mutex_t mutex;   /* Protect queues and work states */
+	pthread_cond_t wakeup;   /* Signal new work, or stop, to threads */
+	pthread_cond_t finished; /* Signal work done, for readers__cancel() */
+	queue pending;           /* Work waiting for a thread */
+	queue done;              /* Work waiting for its done callback */
+	unsigned running;        /* Number of threads running work */
+	bool paused;             /* Whether threads should hold off new work */
+	bool stopping;           /* Whether threads should exit */
+	struct uv_async_s async; /* Wake up the main loop when work is done */
+};
+
+void readers__init(struct readers *r);
+
+/**
+ * Start @n reader threads, delivering done callbacks on the given loop. This
+ * must be called from the loop thread.
+ */
+int readers__start(struct readers *r, struct uv_loop_s *loop, unsigned n);
+
+/**
+ * Stop and join the reader threads and close the async handle. Work that was
+ * not run yet is dropped and its done callback never invoked.
+ */
+void readers__stop(struct readers *r);
+
+/**
+ * Release all resources. The threads must not be running.
+ */
+void readers__close(struct readers *r);
+
+/**
+ * Queue the given work. It will run on the first idle reader thread.
+ */
+void readers__submit(struct readers *r, struct reader_work *w);
+
+/**
+ * Withdraw the given work, blocking until it's done if a thread is already
+ * running it. The done callback won't be invoked. The caller should make sure
+ * the work ends quickly, e.g. by calling sqlite3_interrupt().
+ */
+void readers__cancel(struct reader_work *w);
+
+/**
+ * Block until no thread is running work, and keep pending work queued until
+ * readers__resume() is called. This is used to rewrite database files that
+ * reader threads might otherwise be stepping through, e.g. when restoring a
+ * snapshot. It must be called from the loop thread, which is the only one
+ * submitting work.
+ */
+void readers__pause(struct readers *r);
+
+/**
+ * Let reader threads pick pending work again.
+ */
+void readers__resume(struct readers *r);
+
+#endif /* READERS_H_ */
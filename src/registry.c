@@ -10,6 +10,9 @@ void registry__init(struct registry *r, struct config *config)
 {
 	r->config = config;
 	QUEUE__INIT(&r->dbs);
+	r->readers = NULL;
+	r->tracer = NULL;
+	metrics__init(&r->metrics);
 }
 
 void registry__close(struct registry *r)
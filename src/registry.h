@@ -8,11 +8,18 @@
 #include "lib/queue.h"
 
 #include "db.h"
+#include "metrics.h"
+
+struct readers;
+struct tracer;
 
 struct registry
 {
 	struct config *config;
 	queue dbs;
+	struct readers *readers; /* Reader threads, NULL to run queries inline */
+	struct metrics metrics;  /* Node-wide counters */
+	struct tracer *tracer;   /* Sampled request spans, NULL if not tracing */
 };
 
 void registry__init(struct registry *r, struct config *config);
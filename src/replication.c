@@ -4,6 +4,9 @@
 #include <sqlite3.h>
 #include <stddef.h>
 
+#include "../include/dqlite.h"
+
+#include "checkpoint.h"
 #include "command.h"
 #include "leader.h"
 #include "lib/assert.h"
@@ -18,8 +21,11 @@
 /* Implementation of the sqlite3_wal_replication interface */
 struct replication
 {
+	struct config *config;
 	struct logger *logger;
 	struct raft *raft;
+	struct admission admission;
+	struct metrics *metrics;
 	queue apply_reqs;
 };
 
@@ -118,6 +124,7 @@ static void applyCb(struct raft_apply *req, int status, void *result)
 	}
 	r = leader->exec;
 	apply->status = status;
+	trace__stamp(leader->trace, DQLITE_TRACE_APPLY_DONE);
 
 	co_switch(leader->loop); /* Resume apply() */
 
@@ -162,6 +169,8 @@ static int apply(struct replication *r,
 		 const void *command)
 {
 	struct raft_buffer buf;
+	size_t size;
+	uint64_t start;
 	int rc;
 
 	apply->leader = leader;
@@ -173,6 +182,9 @@ static int apply(struct replication *r,
 		goto err;
 	}
 
+	size = buf.len;
+	start = metrics__now();
+	trace__stamp(leader->trace, DQLITE_TRACE_APPLY);
 	rc = raft_apply(r->raft, &apply->req, &buf, 1, applyCb);
 	if (rc != 0) {
 		switch (rc) {
@@ -192,11 +204,22 @@ static int apply(struct replication *r,
 		goto err_after_command_encode;
 	}
 	leader->inflight = apply;
+	r->admission.applies++;
+	r->admission.bytes += size;
 
 	co_switch(leader->main);
 
+	r->admission.applies--;
+	r->admission.bytes -= size;
 	leader->inflight = NULL;
 
+	r->metrics->applies++;
+	r->metrics->apply_bytes += size;
+	metrics__observe_since(&r->metrics->apply_latency, start);
+	if (apply->status != 0) {
+		r->metrics->apply_failures++;
+	}
+
 	if (apply->status != 0) {
 		switch (apply->status) {
 			case RAFT_LEADERSHIPLOST:
@@ -356,6 +379,29 @@ static int maybeHandleInProgressTx(struct replication *r, struct leader *leader)
 	return 0;
 }
 
+/* Whether the raft log entries waiting to be applied, or the size of the
+ * commands being applied, have reached the configured limits.
+ *
+ * Leader connections can't have more than one command in flight per database,
+ * since there's one write transaction at a time, but the log also holds the
+ * barriers of every exec and query request, and entries that followers haven't
+ * caught up with yet. That's the queue that grows when the cluster can't keep
+ * up. */
+static bool isOverloaded(struct replication *r)
+{
+	struct config *config = r->config;
+	raft_index backlog;
+	backlog = raft_last_index(r->raft) - raft_last_applied(r->raft);
+	if (config->max_backlog != 0 && backlog >= config->max_backlog) {
+		return true;
+	}
+	if (config->max_inflight_bytes != 0 &&
+	    r->admission.bytes >= config->max_inflight_bytes) {
+		return true;
+	}
+	return false;
+}
+
 /* The main tasks of the begin hook are to check that no other write transaction
  * is in progress and to cleanup any dangling follower transactions that might
  * have been left open after a leadership change.
@@ -373,7 +419,11 @@ static int maybeHandleInProgressTx(struct replication *r, struct leader *leader)
  *                  hook will propagate the error to sqlite3BtreeBeginTrans and
  *                  bubble up further, eventually failing the statement that
  *                  triggered the write attempt. The client should then execute
- *                  a ROLLBACK and then decide what to do.
+ *                  a ROLLBACK and then decide what to do. The same error is
+ *                  returned if the WAL has grown past the configured hard
+ *                  limit and no checkpoint could be taken yet, while the
+ *                  DQLITE_OVERLOADED extended code is used if too many log
+ *                  entries are already waiting to be applied.
  *
  *  - SQLITE_IOERR: This is returned if we are not the leader when the hook
  *                  fires or if we fail to apply the Open follower command log,
@@ -405,6 +455,11 @@ static int methodBegin(sqlite3_wal_replication *replication, void *arg)
 	/* We are always invoked in the context of an exec request */
 	assert(leader->exec != NULL);
 
+	if (isOverloaded(r)) {
+		r->admission.shed++;
+		return DQLITE_OVERLOADED;
+	}
+
 	rc = maybeAddFollower(r, leader);
 	if (rc != 0) {
 		return rc;
@@ -415,6 +470,12 @@ static int methodBegin(sqlite3_wal_replication *replication, void *arg)
 		return rc;
 	}
 
+	/* Apply backpressure if the WAL has grown too much because readers kept
+	 * preventing checkpoints. */
+	if (checkpoint__over_limit(leader->db)) {
+		return SQLITE_BUSY;
+	}
+
 	/* Use the last applied index as transaction ID.
 	 *
 	 * If this server is still the leader, this number is guaranteed to be
@@ -458,34 +519,63 @@ static int methodFrames(sqlite3_wal_replication *replication,
 	struct tx *tx = leader->db->tx;
 	struct command_frames c;
 	struct apply *req;
+	unsigned max_size = leader->db->config->frames_max_size;
+	int n_max;
+	int i;
+	int n;
 	int rc;
 
 	assert(tx != NULL);
 	assert(tx->conn == leader->conn);
 	assert(tx->state == TX__PENDING || tx->state == TX__WRITING);
 
-	if (raft_state(r->raft) != RAFT_LEADER) {
-		return framesAbortBecauseNotLeader(leader, is_commit);
+	/* Figure out how many frames fit in a single command. */
+	n_max = n_frames;
+	if (max_size != 0 && (unsigned)page_size <= max_size) {
+		n_max = (int)(max_size / (unsigned)page_size);
+	} else if (max_size != 0) {
+		n_max = 1;
 	}
 
 	c.filename = leader->db->filename;
 	c.tx_id = tx->id;
-	c.truncate = truncate;
-	c.is_commit = is_commit;
-	c.frames.n_pages = n_frames;
 	c.frames.page_size = page_size;
-	c.frames.data = frames;
 
-	req = raft_malloc(sizeof *req);
-	if (req == NULL) {
-		return DQLITE_NOMEM;
-	}
+	/* Split the frames in chunks, each applied as a separate command. All
+	 * chunks but the last are non-commit ones, as if SQLite had spilled
+	 * them from its page cache, so followers handle them the usual way. */
+	for (i = 0; i < n_frames; i += n) {
+		bool last;
 
-	req->frames.is_commit = is_commit;
+		n = n_frames - i;
+		if (n > n_max) {
+			n = n_max;
+		}
+		last = i + n == n_frames;
 
-	rc = apply(r, req, leader, COMMAND_FRAMES, &c);
-	if (rc != 0) {
-		return rc;
+		if (raft_state(r->raft) != RAFT_LEADER) {
+			return framesAbortBecauseNotLeader(leader, is_commit);
+		}
+
+		c.truncate = last ? truncate : 0;
+		c.is_commit = last ? is_commit : 0;
+		c.frames.n_pages = n;
+		c.frames.data = frames + i;
+
+		req = raft_malloc(sizeof *req);
+		if (req == NULL) {
+			return DQLITE_NOMEM;
+		}
+
+		/* Failures are handled according to the type of the xFrames
+		 * call, not of the chunk, since that's what determines whether
+		 * SQLite will invoke the xUndo hook. */
+		req->frames.is_commit = is_commit;
+
+		rc = apply(r, req, leader, COMMAND_FRAMES, &c);
+		if (rc != 0) {
+			return rc;
+		}
 	}
 
 	return SQLITE_OK;
@@ -588,7 +678,8 @@ static int methodEnd(sqlite3_wal_replication *replication, void *arg)
 
 int replication__init(struct sqlite3_wal_replication *replication,
 		      struct config *config,
-		      struct raft *raft)
+		      struct raft *raft,
+		      struct metrics *metrics)
 {
 	struct replication *r = sqlite3_malloc(sizeof *r);
 
@@ -596,8 +687,13 @@ int replication__init(struct sqlite3_wal_replication *replication,
 		return DQLITE_NOMEM;
 	}
 
+	r->config = config;
 	r->logger = &config->logger;
 	r->raft = raft;
+	r->admission.applies = 0;
+	r->admission.bytes = 0;
+	r->admission.shed = 0;
+	r->metrics = metrics;
 	QUEUE__INIT(&r->apply_reqs);
 
 	replication->iVersion = 1;
@@ -620,3 +716,10 @@ void replication__close(struct sqlite3_wal_replication *replication)
 	sqlite3_wal_replication_unregister(replication);
 	sqlite3_free(r);
 }
+
+const struct admission *replication__admission(
+    struct sqlite3_wal_replication *replication)
+{
+	struct replication *r = replication->pAppData;
+	return &r->admission;
+}
@@ -9,6 +9,7 @@
 #include <sqlite3.h>
 
 #include "config.h"
+#include "metrics.h"
 
 /* Wrapper around raft_apply, saving context information. */
 struct apply
@@ -25,16 +26,26 @@ struct apply
 	};
 };
 
+/* Counters used for write admission control. */
+struct admission
+{
+	unsigned applies;        /* Commands submitted but not yet applied */
+	size_t bytes;            /* Total size of the commands being applied */
+	unsigned long long shed; /* Write transactions refused */
+};
+
 /**
  * Initialize the given SQLite replication interface with dqlite's raft based
  * implementation.
  *
  * This function also automatically register the implementation in the global
- * SQLite registry, using the given @name.
+ * SQLite registry, using the given @name. Raft commands submitted are accounted
+ * in the given @metrics.
  */
 int replication__init(struct sqlite3_wal_replication *replication,
 		      struct config *config,
-		      struct raft *raft);
+		      struct raft *raft,
+		      struct metrics *metrics);
 
 /**
  * Release all memory associated with the given dqlite raft's based replication
@@ -45,4 +56,11 @@ int replication__init(struct sqlite3_wal_replication *replication,
  */
 void replication__close(struct sqlite3_wal_replication *replication);
 
+/**
+ * Return the admission control counters of the given replication
+ * implementation.
+ */
+const struct admission *replication__admission(
+    struct sqlite3_wal_replication *replication);
+
 #endif /* DQLITE_REPLICATION_H_ */
@@ -40,6 +40,26 @@
 #define REQUEST_DUMP(X, ...) X(text, filename, ##__VA_ARGS__)
 #define REQUEST_CLUSTER(X, ...) X(uint64, format, ##__VA_ARGS__)
 #define REQUEST_TRANSFER(X, ...) X(uint64, id, ##__VA_ARGS__)
+#define REQUEST_QUERY_STALE(X, ...)       \
+	X(uint32, db_id, ##__VA_ARGS__)   \
+	X(uint32, stmt_id, ##__VA_ARGS__) \
+	X(uint64, min_index, ##__VA_ARGS__)
+#define REQUEST_QUERY_SQL_STALE(X, ...)     \
+	X(uint64, db_id, ##__VA_ARGS__)     \
+	X(uint64, min_index, ##__VA_ARGS__) \
+	X(text, sql, ##__VA_ARGS__)
+#define REQUEST_EXEC_BULK(X, ...)         \
+	X(uint32, db_id, ##__VA_ARGS__)   \
+	X(uint32, stmt_id, ##__VA_ARGS__) \
+	X(uint64, n, ##__VA_ARGS__)
+#define REQUEST_BATCH(X, ...)           \
+	X(uint64, db_id, ##__VA_ARGS__) \
+	X(uint64, n, ##__VA_ARGS__)
+#define REQUEST_OPTION(X, ...)           \
+	X(uint64, option, ##__VA_ARGS__) \
+	X(uint64, value, ##__VA_ARGS__)
+#define REQUEST_CAPABILITIES(X, ...) X(uint64, capabilities, ##__VA_ARGS__)
+#define REQUEST_METRICS(X, ...) X(uint64, __unused__, ##__VA_ARGS__)
 
 #define REQUEST__DEFINE(LOWER, UPPER, _) \
 	SERIALIZE__DEFINE(request_##LOWER, REQUEST_##UPPER);
@@ -60,7 +80,14 @@
 	X(remove, REMOVE, __VA_ARGS__)       \
 	X(dump, DUMP, __VA_ARGS__)           \
 	X(cluster, CLUSTER, __VA_ARGS__) \
-	X(transfer, TRANSFER, __VA_ARGS__)
+	X(transfer, TRANSFER, __VA_ARGS__) \
+	X(query_stale, QUERY_STALE, __VA_ARGS__) \
+	X(query_sql_stale, QUERY_SQL_STALE, __VA_ARGS__) \
+	X(exec_bulk, EXEC_BULK, __VA_ARGS__) \
+	X(batch, BATCH, __VA_ARGS__) \
+	X(option, OPTION, __VA_ARGS__) \
+	X(capabilities, CAPABILITIES, __VA_ARGS__) \
+	X(metrics, METRICS, __VA_ARGS__)
 
 REQUEST__TYPES(REQUEST__DEFINE);
 
@@ -70,4 +97,13 @@ REQUEST__TYPES(REQUEST__DEFINE);
 
 SERIALIZE__DEFINE(request_connect, REQUEST_CONNECT);
 
+/* Each statement of a BATCH request. If the SQL text is empty the statement
+ * with the given ID is used, otherwise the text is prepared. Parameters follow,
+ * encoded like for EXEC requests. */
+#define REQUEST_BATCH_ITEM(X, ...)       \
+	X(uint64, stmt_id, ##__VA_ARGS__) \
+	X(text, sql, ##__VA_ARGS__)
+
+SERIALIZE__DEFINE(request_batch_item, REQUEST_BATCH_ITEM);
+
 #endif /* REQUEST_H_ */
@@ -29,6 +29,26 @@
 #define RESPONSE_EMPTY(X, ...) X(uint64, __unused__, ##__VA_ARGS__)
 #define RESPONSE_FILES(X, ...) X(uint64, n, ##__VA_ARGS__)
 #define RESPONSE_SERVERS(X, ...) X(uint64, n, ##__VA_ARGS__)
+#define RESPONSE_RESULTS(X, ...) X(uint64, n, ##__VA_ARGS__)
+#define RESPONSE_CHUNK(X, ...)             \
+	X(text, filename, ##__VA_ARGS__)   \
+	X(uint64, size, ##__VA_ARGS__)     \
+	X(uint64, offset, ##__VA_ARGS__)   \
+	X(uint64, len, ##__VA_ARGS__)
+#define RESPONSE_CAPABILITIES(X, ...) X(uint64, capabilities, ##__VA_ARGS__)
+#define RESPONSE_METRICS(X, ...)               \
+	X(uint64, term, ##__VA_ARGS__)           \
+	X(uint64, commit_index, ##__VA_ARGS__)   \
+	X(uint64, last_applied, ##__VA_ARGS__)   \
+	X(uint64, last_index, ##__VA_ARGS__)     \
+	X(uint64, databases, ##__VA_ARGS__)      \
+	X(uint64, connections, ##__VA_ARGS__)    \
+	X(uint64, applies, ##__VA_ARGS__)        \
+	X(uint64, apply_failures, ##__VA_ARGS__) \
+	X(uint64, apply_bytes, ##__VA_ARGS__)    \
+	X(uint64, queries, ##__VA_ARGS__)        \
+	X(uint64, checkpoints, ##__VA_ARGS__)    \
+	X(uint64, n, ##__VA_ARGS__)
 
 #define RESPONSE__DEFINE(LOWER, UPPER, _) \
 	SERIALIZE__DEFINE(response_##LOWER, RESPONSE_##UPPER);
@@ -44,7 +64,11 @@
 	X(rows, ROWS, __VA_ARGS__)                   \
 	X(empty, EMPTY, __VA_ARGS__)                 \
 	X(files, FILES, __VA_ARGS__)                 \
-	X(servers, SERVERS, __VA_ARGS__)
+	X(servers, SERVERS, __VA_ARGS__)             \
+	X(results, RESULTS, __VA_ARGS__)             \
+	X(chunk, CHUNK, __VA_ARGS__)                 \
+	X(capabilities, CAPABILITIES, __VA_ARGS__)   \
+	X(metrics, METRICS, __VA_ARGS__)
 
 RESPONSE__TYPES(RESPONSE__DEFINE);
 
@@ -5,6 +5,7 @@
 #include <time.h>
 
 #include "../include/dqlite.h"
+#include "checkpoint.h"
 #include "conn.h"
 #include "fsm.h"
 #include "lib/assert.h"
@@ -16,6 +17,14 @@
 /* Special ID for the bootstrap node. Equals to raft_digest("1", 0). */
 #define BOOTSTRAP_ID 0x2dc171858c3155be
 
+/* Interval at which postponed or idle checkpoints are retried, in
+ * milliseconds. */
+#define CHECKPOINT_INTERVAL 1000
+
+/* Interval at which the buffer pool is checked for idle memory to give back,
+ * in milliseconds. */
+#define TRIM_INTERVAL 5000
+
 int dqlite__init(struct dqlite_node *d,
 		 dqlite_node_id id,
 		 const char *address,
@@ -32,6 +41,12 @@ int dqlite__init(struct dqlite_node *d,
 		goto err_after_config_init;
 	}
 	registry__init(&d->registry, &d->config);
+	readers__init(&d->readers);
+	tracer__init(&d->tracer);
+	buffer_pool__init(&d->pool, d->config.buffer_pool_max_size,
+			  d->config.buffer_pool_max);
+	d->trim_gets = 0;
+	d->trim_since = 0;
 	rv = uv_loop_init(&d->loop);
 	if (rv != 0) {
 		/* TODO: better error reporting */
@@ -67,7 +82,8 @@ int dqlite__init(struct dqlite_node *d,
 	raft_set_snapshot_threshold(&d->raft, 1024);
 	raft_set_snapshot_trailing(&d->raft, 8192);
 	raft_set_pre_vote(&d->raft, true);
-	rv = replication__init(&d->replication, &d->config, &d->raft);
+	rv = replication__init(&d->replication, &d->config, &d->raft,
+			       &d->registry.metrics);
 	if (rv != 0) {
 		goto err_after_raft_fsm_init;
 	}
@@ -83,6 +99,12 @@ int dqlite__init(struct dqlite_node *d,
 		rv = DQLITE_ERROR;
 		goto err_after_ready_init;
 	}
+	rv = sem_init(&d->collected, 0, 0);
+	if (rv != 0) {
+		/* TODO: better error reporting */
+		rv = DQLITE_ERROR;
+		goto err_after_stopped_init;
+	}
 
 	rv = pthread_mutex_init(&d->mutex, NULL);
 	assert(rv == 0); /* Docs say that pthread_mutex_init can't fail */
@@ -91,8 +113,12 @@ int dqlite__init(struct dqlite_node *d,
 	d->running = false;
 	d->listener = NULL;
 	d->bind_address = NULL;
+	d->snapshot = NULL;
+	d->exporting = false;
 	return 0;
 
+err_after_stopped_init:
+	sem_destroy(&d->stopped);
 err_after_ready_init:
 	sem_destroy(&d->ready);
 err_after_raft_replication_init:
@@ -106,6 +132,9 @@ err_after_raft_transport_init:
 err_after_loop_init:
 	uv_loop_close(&d->loop);
 err_after_vfs_init:
+	buffer_pool__close(&d->pool);
+	tracer__close(&d->tracer);
+	readers__close(&d->readers);
 	VfsClose(&d->vfs);
 err_after_config_init:
 	config__close(&d->config);
@@ -119,6 +148,8 @@ void dqlite__close(struct dqlite_node *d)
 	raft_free(d->listener);
 	rv = pthread_mutex_destroy(&d->mutex); /* This is a no-op on Linux . */
 	assert(rv == 0);
+	rv = sem_destroy(&d->collected);
+	assert(rv == 0); /* Fails only if sem object is not valid */
 	rv = sem_destroy(&d->stopped);
 	assert(rv == 0); /* Fails only if sem object is not valid */
 	rv = sem_destroy(&d->ready);
@@ -127,6 +158,9 @@ void dqlite__close(struct dqlite_node *d)
 	fsm__close(&d->raft_fsm);
 	uv_loop_close(&d->loop);
 	raftProxyClose(&d->raft_transport);
+	buffer_pool__close(&d->pool);
+	tracer__close(&d->tracer);
+	readers__close(&d->readers);
 	registry__close(&d->registry);
 	VfsClose(&d->vfs);
 	config__close(&d->config);
@@ -300,6 +334,74 @@ int dqlite_node_set_network_latency(dqlite_node *t,
 	return 0;
 }
 
+int dqlite_node_set_reader_threads(dqlite_node *t, unsigned n)
+{
+	if (t->running) {
+		return DQLITE_MISUSE;
+	}
+	if (n > DQLITE_MAX_READER_THREADS) {
+		return DQLITE_MISUSE;
+	}
+	t->config.reader_threads = n;
+	return 0;
+}
+
+int dqlite_node_set_query_prefetch(dqlite_node *t, unsigned depth)
+{
+	if (t->running) {
+		return DQLITE_MISUSE;
+	}
+	if (depth > DQLITE_MAX_QUERY_PREFETCH) {
+		return DQLITE_MISUSE;
+	}
+	t->config.query_prefetch = depth;
+	return 0;
+}
+
+int dqlite_node_set_leader_pool(dqlite_node *t, unsigned size)
+{
+	if (t->running) {
+		return DQLITE_MISUSE;
+	}
+	t->config.leader_pool = size;
+	return 0;
+}
+
+int dqlite_node_set_metrics_address(dqlite_node *t, const char *address)
+{
+	int rv;
+	if (t->running) {
+		return DQLITE_MISUSE;
+	}
+	if (strlen(address) >= 256) {
+		return DQLITE_MISUSE;
+	}
+	memset(&t->export_address, 0, sizeof t->export_address);
+	rv = ipParse(address, &t->export_address);
+	if (rv != 0) {
+		return DQLITE_MISUSE;
+	}
+	t->exporting = true;
+	return 0;
+}
+
+int dqlite_node_set_tracing(dqlite_node *t, unsigned sample, unsigned capacity)
+{
+	int rv;
+	if (t->running) {
+		return DQLITE_MISUSE;
+	}
+	if (sample > 0 && (capacity == 0 || capacity > DQLITE_MAX_TRACE_SPANS)) {
+		return DQLITE_MISUSE;
+	}
+	rv = tracer__setup(&t->tracer, sample, capacity);
+	if (rv != 0) {
+		return rv;
+	}
+	t->registry.tracer = sample > 0 ? &t->tracer : NULL;
+	return 0;
+}
+
 static int maybeBootstrap(dqlite_node *d,
 			  dqlite_node_id id,
 			  const char *address)
@@ -340,8 +442,16 @@ static void raftCloseCb(struct raft *raft)
 {
 	struct dqlite_node *s = raft->data;
 	raft_uv_close(&s->raft_io);
+	s->registry.readers = NULL;
+	readers__stop(&s->readers);
 	uv_close((struct uv_handle_s *)&s->stop, NULL);
+	uv_close((struct uv_handle_s *)&s->collect, NULL);
+	if (s->exporting) {
+		prometheus__stop(&s->prometheus);
+	}
 	uv_close((struct uv_handle_s *)&s->startup, NULL);
+	uv_close((struct uv_handle_s *)&s->checkpoint, NULL);
+	uv_close((struct uv_handle_s *)&s->trim, NULL);
 	uv_close((struct uv_handle_s *)s->listener, NULL);
 }
 
@@ -382,6 +492,64 @@ static void startup_cb(uv_timer_t *startup)
 	assert(rv == 0); /* No reason for which posting should fail */
 }
 
+/* Periodically check if any database needs to be checkpointed. */
+static void checkpointCb(uv_timer_t *checkpoint)
+{
+	struct dqlite_node *d = checkpoint->data;
+	checkpoint__tick(&d->registry, &d->raft);
+}
+
+/* Periodically give back the idle memory of the buffer pool, if it hasn't been
+ * used for a while. */
+static void trimCb(uv_timer_t *trim)
+{
+	struct dqlite_node *d = trim->data;
+	uint64_t now = uv_now(&d->loop);
+	if (d->pool.n_gets != d->trim_gets) {
+		d->trim_gets = d->pool.n_gets;
+		d->trim_since = now;
+		return;
+	}
+	if (d->config.buffer_idle != 0 &&
+	    now - d->trim_since >= d->config.buffer_idle) {
+		buffer_pool__trim(&d->pool);
+	}
+}
+
+/* Fill the given metrics snapshot, adding the counters of node subsystems to
+ * the registry ones. This must run on the loop thread, unless the loop is not
+ * running. */
+static void collectMetrics(struct dqlite_node *d, struct dqlite_node_metrics *m)
+{
+	const struct admission *admission;
+	metrics__snapshot(&d->registry, &d->raft, m);
+	admission = replication__admission(&d->replication);
+	m->writes_shed = admission->shed;
+	m->buffer_gets = d->pool.n_gets;
+	m->buffer_hits = d->pool.n_hits;
+}
+
+/* Take a metrics snapshot to be served over HTTP. */
+static void exportCb(void *data, struct dqlite_node_metrics *m)
+{
+	struct dqlite_node *d = data;
+	collectMetrics(d, m);
+}
+
+/* Take a metrics snapshot requested by dqlite_node_get_metrics(). */
+static void collectCb(uv_async_t *collect)
+{
+	struct dqlite_node *d = collect->data;
+	int rv;
+	if (d->snapshot == NULL) {
+		return;
+	}
+	collectMetrics(d, d->snapshot);
+	d->snapshot = NULL;
+	rv = sem_post(&d->collected);
+	assert(rv == 0); /* No reason for which posting should fail */
+}
+
 static void listenCb(uv_stream_t *listener, int status)
 {
 	struct dqlite_node *t = listener->data;
@@ -441,8 +609,8 @@ static void listenCb(uv_stream_t *listener, int status)
 	if (conn == NULL) {
 		goto err;
 	}
-	rv = conn__start(conn, &t->config, &t->loop, &t->registry, &t->raft,
-			 stream, &t->raft_transport, destroy_conn);
+	rv = conn__start(conn, &t->config, &t->loop, &t->pool, &t->registry,
+			 &t->raft, stream, &t->raft_transport, destroy_conn);
 	if (rv != 0) {
 		goto err_after_conn_alloc;
 	}
@@ -475,6 +643,9 @@ static int taskRun(struct dqlite_node *d)
 	d->stop.data = d;
 	rv = uv_async_init(&d->loop, &d->stop, stop_cb);
 	assert(rv == 0);
+	d->collect.data = d;
+	rv = uv_async_init(&d->loop, &d->collect, collectCb);
+	assert(rv == 0);
 
 	/* Schedule startup_cb to be fired as soon as the loop starts. It will
 	 * unblock clients of taskReady. */
@@ -484,6 +655,42 @@ static int taskRun(struct dqlite_node *d)
 	rv = uv_timer_start(&d->startup, startup_cb, 0, 0);
 	assert(rv == 0);
 
+	d->checkpoint.data = d;
+	rv = uv_timer_init(&d->loop, &d->checkpoint);
+	assert(rv == 0);
+	rv = uv_timer_start(&d->checkpoint, checkpointCb, CHECKPOINT_INTERVAL,
+			    CHECKPOINT_INTERVAL);
+	assert(rv == 0);
+
+	d->trim.data = d;
+	rv = uv_timer_init(&d->loop, &d->trim);
+	assert(rv == 0);
+	rv = uv_timer_start(&d->trim, trimCb, TRIM_INTERVAL, TRIM_INTERVAL);
+	assert(rv == 0);
+
+	if (d->exporting) {
+		rv = prometheus__start(&d->prometheus, &d->loop,
+				       (struct sockaddr *)&d->export_address,
+				       PROMETHEUS__TIMEOUT, exportCb, d);
+		if (rv != 0) {
+			snprintf(d->errmsg, RAFT_ERRMSG_BUF_SIZE,
+				 "failed to serve metrics");
+			sem_post(&d->ready);
+			return rv;
+		}
+	}
+
+	rv = readers__start(&d->readers, &d->loop, d->config.reader_threads);
+	if (rv != 0) {
+		snprintf(d->errmsg, RAFT_ERRMSG_BUF_SIZE,
+			 "failed to start reader threads");
+		sem_post(&d->ready);
+		return rv;
+	}
+	if (d->config.reader_threads > 0) {
+		d->registry.readers = &d->readers;
+	}
+
 	d->raft.data = d;
 	rv = raft_start(&d->raft);
 	if (rv != 0) {
@@ -592,6 +799,50 @@ int dqlite_node_stop(dqlite_node *d)
 	return (uintptr_t)result;
 }
 
+int dqlite_node_get_metrics(dqlite_node *d, dqlite_node_metrics *metrics)
+{
+	int rv;
+
+	/* Called from the loop thread itself, e.g. by a callback run by the loop:
+	 * waiting for the loop to take the snapshot would never return, and
+	 * neither would waiting for the mutex if another thread holds it while
+	 * waiting for the loop. Being on the loop, the snapshot can just be taken
+	 * right away. */
+	if (__atomic_load_n(&d->running, __ATOMIC_RELAXED) &&
+	    pthread_equal(pthread_self(), d->thread)) {
+		collectMetrics(d, metrics);
+		return 0;
+	}
+
+	/* The mutex keeps the node from stopping while the snapshot is taken,
+	 * and serializes concurrent callers. */
+	pthread_mutex_lock(&d->mutex);
+
+	if (!d->running) {
+		collectMetrics(d, metrics);
+		pthread_mutex_unlock(&d->mutex);
+		return 0;
+	}
+
+	d->snapshot = metrics;
+	rv = uv_async_send(&d->collect);
+	assert(rv == 0);
+	sem_wait(&d->collected);
+
+	pthread_mutex_unlock(&d->mutex);
+
+	return 0;
+}
+
+int dqlite_node_get_traces(dqlite_node *d,
+			   dqlite_trace_span *spans,
+			   unsigned n,
+			   unsigned *count)
+{
+	*count = tracer__drain(&d->tracer, spans, n);
+	return 0;
+}
+
 int dqlite_node_recover(dqlite_node *n,
 			struct dqlite_node_info infos[],
 			int n_info)
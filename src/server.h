@@ -4,8 +4,12 @@
 
 #include "config.h"
 #include "lib/assert.h"
+#include "lib/buffer.h"
 #include "logger.h"
+#include "prometheus.h"
+#include "readers.h"
 #include "registry.h"
+#include "trace.h"
 
 /**
  * A single dqlite server instance.
@@ -16,6 +20,8 @@ struct dqlite_node
 	struct config config;                       /* Config values */
 	struct sqlite3_vfs vfs;                     /* In-memory VFS */
 	struct registry registry;                   /* Databases */
+	struct readers readers;                     /* Read-only query threads */
+	struct buffer_pool pool;                    /* Memory for conn buffers */
 	struct uv_loop_s loop;                      /* UV loop */
 	struct raft_uv_transport raft_transport;    /* Raft libuv transport */
 	struct raft_io raft_io;                     /* libuv I/O */
@@ -31,6 +37,17 @@ struct dqlite_node
 	struct uv_stream_s *listener;               /* Listening socket */
 	struct uv_async_s stop;                     /* Trigger UV loop stop */
 	struct uv_timer_s startup;                  /* Unblock ready sem */
+	struct uv_timer_s checkpoint;               /* Checkpoint scheduler */
+	struct uv_timer_s trim;                     /* Idle buffers reclaimer */
+	struct uv_async_s collect;                  /* Trigger metrics snapshot */
+	sem_t collected;                            /* Metrics snapshot taken */
+	struct dqlite_node_metrics *snapshot;       /* Target of the snapshot */
+	bool exporting;                             /* Serve Prometheus metrics */
+	struct sockaddr_in export_address;          /* Metrics HTTP address */
+	struct prometheus prometheus;               /* Metrics HTTP server */
+	struct tracer tracer;                       /* Sampled request spans */
+	unsigned long long trim_gets;               /* Pool gets at last check */
+	uint64_t trim_since;                        /* Last pool use seen */
 	char *bind_address;                         /* Listen address */
 	char errmsg[RAFT_ERRMSG_BUF_SIZE];          /* Last error occurred */
 };
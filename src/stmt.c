@@ -1,4 +1,5 @@
 #include <sqlite3.h>
+#include <string.h>
 
 #include "./lib/assert.h"
 #include "./tuple.h"
@@ -11,7 +12,10 @@
 
 void stmt__init(struct stmt *s)
 {
+	s->db_id = 0;
 	s->stmt = NULL;
+	query_types__init(&s->types);
+	s->tx_control = false;
 }
 
 void stmt__close(struct stmt *s)
@@ -21,6 +25,7 @@ void stmt__close(struct stmt *s)
 		 * most rececent evaluation of the statement failed. */
 		sqlite3_finalize(s->stmt);
 	}
+	query_types__close(&s->types);
 }
 
 const char *stmt__hash(struct stmt *stmt)
@@ -30,3 +35,152 @@ const char *stmt__hash(struct stmt *stmt)
 }
 
 REGISTRY_METHODS(stmt__registry, stmt);
+
+struct stmt_cache_entry
+{
+	sqlite3_stmt *stmt;       /* Prepared statement */
+	size_t tail;              /* Length of the SQL text consumed */
+	bool busy;                /* Whether the statement is currently in use */
+	bool tx_control;          /* Whether it begins or ends a transaction */
+	struct query_types types; /* Cached declared column types */
+	queue queue;              /* Link in the cache entries */
+	char sql[];               /* SQL text, used as key */
+};
+
+void stmt_cache__init(struct stmt_cache *c, unsigned cap)
+{
+	QUEUE__INIT(&c->entries);
+	c->n = 0;
+	c->cap = cap;
+	c->hits = 0;
+	c->misses = 0;
+}
+
+static void stmt_cache__evict(struct stmt_cache *c,
+			      struct stmt_cache_entry *entry)
+{
+	QUEUE__REMOVE(&entry->queue);
+	sqlite3_finalize(entry->stmt);
+	query_types__close(&entry->types);
+	sqlite3_free(entry);
+	c->n--;
+}
+
+void stmt_cache__close(struct stmt_cache *c)
+{
+	while (!QUEUE__IS_EMPTY(&c->entries)) {
+		queue *head = QUEUE__HEAD(&c->entries);
+		stmt_cache__evict(
+		    c, QUEUE__DATA(head, struct stmt_cache_entry, queue));
+	}
+}
+
+/* Make room for a new entry, evicting the least recently used statement that
+ * is not in use. Return false if there's no room. */
+static bool stmt_cache__make_room(struct stmt_cache *c)
+{
+	queue *head;
+	if (c->n < c->cap) {
+		return true;
+	}
+	QUEUE__FOREACH(head, &c->entries)
+	{
+		struct stmt_cache_entry *entry;
+		entry = QUEUE__DATA(head, struct stmt_cache_entry, queue);
+		if (!entry->busy) {
+			stmt_cache__evict(c, entry);
+			return true;
+		}
+	}
+	return false;
+}
+
+int stmt_cache__prepare(struct stmt_cache *c,
+			sqlite3 *conn,
+			const char *sql,
+			sqlite3_stmt **stmt,
+			const char **tail,
+			bool *tx_control)
+{
+	struct stmt_cache_entry *entry;
+	size_t len;
+	queue *head;
+	int rv;
+
+	QUEUE__FOREACH(head, &c->entries)
+	{
+		entry = QUEUE__DATA(head, struct stmt_cache_entry, queue);
+		if (entry->busy || strcmp(entry->sql, sql) != 0) {
+			continue;
+		}
+		/* Move the entry to the back. */
+		QUEUE__REMOVE(&entry->queue);
+		QUEUE__PUSH(&c->entries, &entry->queue);
+		entry->busy = true;
+		c->hits++;
+		*stmt = entry->stmt;
+		*tail = sql + entry->tail;
+		*tx_control = entry->tx_control;
+		return SQLITE_OK;
+	}
+
+	c->misses++;
+	*tx_control = false;
+	rv = sqlite3_prepare_v2(conn, sql, -1, stmt, tail);
+	if (rv != SQLITE_OK || *stmt == NULL) {
+		return rv;
+	}
+
+	if (!stmt_cache__make_room(c)) {
+		/* Not cached, stmt_cache__release() will finalize it. */
+		return SQLITE_OK;
+	}
+
+	len = strlen(sql);
+	entry = sqlite3_malloc64(sizeof *entry + len + 1);
+	if (entry == NULL) {
+		return SQLITE_OK;
+	}
+	memcpy(entry->sql, sql, len + 1);
+	entry->stmt = *stmt;
+	entry->tail = (size_t)(*tail - sql);
+	entry->busy = true;
+	entry->tx_control = *tx_control;
+	query_types__init(&entry->types);
+	QUEUE__PUSH(&c->entries, &entry->queue);
+	c->n++;
+
+	return SQLITE_OK;
+}
+
+struct query_types *stmt_cache__types(struct stmt_cache *c, sqlite3_stmt *stmt)
+{
+	queue *head;
+	QUEUE__FOREACH(head, &c->entries)
+	{
+		struct stmt_cache_entry *entry;
+		entry = QUEUE__DATA(head, struct stmt_cache_entry, queue);
+		if (entry->stmt == stmt) {
+			return &entry->types;
+		}
+	}
+	return NULL;
+}
+
+void stmt_cache__release(struct stmt_cache *c, sqlite3_stmt *stmt)
+{
+	queue *head;
+	QUEUE__FOREACH(head, &c->entries)
+	{
+		struct stmt_cache_entry *entry;
+		entry = QUEUE__DATA(head, struct stmt_cache_entry, queue);
+		if (entry->stmt == stmt) {
+			assert(entry->busy);
+			sqlite3_reset(stmt);
+			sqlite3_clear_bindings(stmt);
+			entry->busy = false;
+			return;
+		}
+	}
+	sqlite3_finalize(stmt);
+}
@@ -46,14 +46,22 @@
 #define DQLITE_STMT_H
 
 #include <sqlite3.h>
+#include <stdbool.h>
+#include <stdint.h>
 
+#include "lib/queue.h"
 #include "lib/registry.h"
 
+#include "query.h"
+
 /* Hold state for a single open SQLite database */
 struct stmt
 {
-	size_t id;	   /* Statement ID */
-	sqlite3_stmt *stmt;  /* Underlying SQLite statement handle */
+	size_t id;	          /* Statement ID */
+	uint32_t db_id;           /* ID of the database the statement belongs to */
+	sqlite3_stmt *stmt;       /* Underlying SQLite statement handle */
+	struct query_types types; /* Cached declared column types */
+	bool tx_control;          /* Whether it begins or ends a transaction */
 };
 
 /* Initialize a statement state object */
@@ -73,4 +81,47 @@ const char *stmt__hash(struct stmt *stmt);
 
 REGISTRY(stmt__registry, stmt);
 
+/* LRU cache of statements prepared from SQL text, keyed by the text itself. */
+struct stmt_cache
+{
+	queue entries;             /* Cached statements, least recent first */
+	unsigned n;                /* Number of cached statements */
+	unsigned cap;              /* Maximum number of cached statements */
+	unsigned long long hits;   /* Lookups served from the cache */
+	unsigned long long misses; /* Lookups that required a prepare */
+};
+
+/* Initialize a statement cache holding at most @cap statements. A capacity of
+ * zero disables caching. */
+void stmt_cache__init(struct stmt_cache *c, unsigned cap);
+
+/* Finalize all cached statements. */
+void stmt_cache__close(struct stmt_cache *c);
+
+/* Return a statement for the first SQL statement in @sql, and set @tail to the
+ * remaining text, like sqlite3_prepare_v2() would do.
+ *
+ * If a cached statement for the same text is available it's returned right
+ * away, otherwise a new one is prepared against @conn and cached. The returned
+ * statement must be given back with stmt_cache__release() once done.
+ *
+ * The @tx_control flag is cleared before preparing, and is expected to be
+ * raised by the authorizer of @conn if the statement begins or ends a
+ * transaction or a savepoint. It's recorded along with the statement, so it's
+ * also set for cached statements. */
+int stmt_cache__prepare(struct stmt_cache *c,
+			sqlite3 *conn,
+			const char *sql,
+			sqlite3_stmt **stmt,
+			const char **tail,
+			bool *tx_control);
+
+/* Return the cached declared column types of a statement obtained with
+ * stmt_cache__prepare(), or NULL if the statement is not cached. */
+struct query_types *stmt_cache__types(struct stmt_cache *c, sqlite3_stmt *stmt);
+
+/* Give back a statement obtained with stmt_cache__prepare(). Its state and
+ * bindings are cleared, and it's finalized if it was not cached. */
+void stmt_cache__release(struct stmt_cache *c, sqlite3_stmt *stmt);
+
 #endif /* DQLITE_STMT_H */
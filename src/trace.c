@@ -0,0 +1,123 @@
+#include <string.h>
+
+#include <sqlite3.h>
+
+#include "./lib/assert.h"
+
+#include "metrics.h"
+#include "trace.h"
+
+void tracer__init(struct tracer *t)
+{
+	t->sample = 0;
+	t->n = 0;
+	t->ring = NULL;
+	t->capacity = 0;
+	t->first = 0;
+	t->len = 0;
+	pthread_mutex_init(&t->mutex, NULL);
+}
+
+void tracer__close(struct tracer *t)
+{
+	sqlite3_free(t->ring);
+	pthread_mutex_destroy(&t->mutex);
+}
+
+int tracer__setup(struct tracer *t, unsigned sample, unsigned capacity)
+{
+	dqlite_trace_span *ring = NULL;
+
+	if (sample > 0) {
+		assert(capacity > 0);
+		ring = sqlite3_malloc64(capacity * sizeof *ring);
+		if (ring == NULL) {
+			return DQLITE_NOMEM;
+		}
+	}
+
+	pthread_mutex_lock(&t->mutex);
+	sqlite3_free(t->ring);
+	t->sample = sample;
+	t->ring = ring;
+	t->capacity = ring != NULL ? capacity : 0;
+	t->first = 0;
+	t->len = 0;
+	pthread_mutex_unlock(&t->mutex);
+
+	return 0;
+}
+
+void tracer__start(struct tracer *t, struct trace *trace, int type)
+{
+	trace->on = false;
+	if (t == NULL || t->sample == 0) {
+		return;
+	}
+	t->n++;
+	if (t->n % t->sample != 0) {
+		return;
+	}
+	memset(&trace->span, 0, sizeof trace->span);
+	trace->on = true;
+	trace->span.id = t->n;
+	trace->span.type = type;
+	trace__stamp(trace, DQLITE_TRACE_HANDLE);
+}
+
+void tracer__finish(struct tracer *t, struct trace *trace)
+{
+	unsigned i;
+
+	if (!trace->on) {
+		return;
+	}
+	trace->on = false;
+	assert(t != NULL);
+
+	pthread_mutex_lock(&t->mutex);
+	if (t->capacity > 0) {
+		if (t->len < t->capacity) {
+			i = (t->first + t->len) % t->capacity;
+			t->len++;
+		} else {
+			/* Overwrite the oldest span. */
+			i = t->first;
+			t->first = (t->first + 1) % t->capacity;
+		}
+		t->ring[i] = trace->span;
+	}
+	pthread_mutex_unlock(&t->mutex);
+}
+
+unsigned tracer__drain(struct tracer *t, dqlite_trace_span *spans, unsigned n)
+{
+	unsigned i;
+
+	pthread_mutex_lock(&t->mutex);
+	for (i = 0; i < n && t->len > 0; i++) {
+		spans[i] = t->ring[t->first];
+		t->first = (t->first + 1) % t->capacity;
+		t->len--;
+	}
+	pthread_mutex_unlock(&t->mutex);
+
+	return i;
+}
+
+void trace__stamp(struct trace *trace, int stage)
+{
+	if (trace == NULL || !trace->on) {
+		return;
+	}
+	assert(stage >= 0 && stage < DQLITE_TRACE_STAGES);
+	trace->span.stamps[stage] = metrics__now();
+	switch (stage) {
+		case DQLITE_TRACE_STEP:
+			trace->span.steps++;
+			break;
+		case DQLITE_TRACE_APPLY:
+			trace->span.applies++;
+			break;
+	}
+}
@@ -0,0 +1,71 @@
+/**
+ * Record when sampled client requests go through each stage of their handling.
+ *
+ * A gateway owns the trace of the request it's handling, and lends it to its
+ * leader connections, so the leader loop and the replication hooks can stamp
+ * it too. Finished spans are kept in a ring that other threads can drain, see
+ * dqlite_node_get_traces().
+ */
+
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <pthread.h>
+#include <stdbool.h>
+
+#include "../include/dqlite.h"
+
+/**
+ * Trace of the request being handled by a gateway.
+ */
+struct trace
+{
+	bool on;                /* Whether the current request is sampled */
+	dqlite_trace_span span; /* Stamps collected so far */
+};
+
+struct tracer
+{
+	unsigned sample;         /* Trace one request every @sample */
+	unsigned long long n;    /* Requests seen so far */
+	pthread_mutex_t mutex;   /* Protect the ring, drained by any thread */
+	dqlite_trace_span *ring; /* Spans of finished requests */
+	unsigned capacity;       /* Size of the ring */
+	unsigned first;          /* Index of the oldest span */
+	unsigned len;            /* Number of spans in the ring */
+};
+
+void tracer__init(struct tracer *t);
+void tracer__close(struct tracer *t);
+
+/**
+ * Sample one request every @sample, keeping the last @capacity spans. A
+ * @sample of 0 disables tracing and frees the ring.
+ */
+int tracer__setup(struct tracer *t, unsigned sample, unsigned capacity);
+
+/**
+ * Start tracing a request of the given type, if it's sampled. The tracer can
+ * be NULL, in which case tracing is off.
+ */
+void tracer__start(struct tracer *t, struct trace *trace, int type);
+
+/**
+ * Stop tracing the current request and save its span in the ring, replacing
+ * the oldest one if full.
+ */
+void tracer__finish(struct tracer *t, struct trace *trace);
+
+/**
+ * Move up to @n spans from the ring to @spans, oldest first, and return how
+ * many were moved.
+ */
+unsigned tracer__drain(struct tracer *t, dqlite_trace_span *spans, unsigned n);
+
+/**
+ * Record that the traced request reached the given stage now. This is a no-op
+ * if @trace is NULL or its request is not sampled.
+ */
+void trace__stamp(struct trace *trace, int stage);
+
+#endif /* TRACE_H_ */
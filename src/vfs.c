@@ -417,12 +417,14 @@ struct vfs
 	struct vfsContent **contents; /* Files content */
 	int contents_len;             /* Number of files */
 	int error;                    /* Last error occurred. */
+	pthread_mutex_t mutex;        /* Serialize access by reader threads */
 };
 
 /* Create a new vfs object. */
 static struct vfs *vfsCreate()
 {
 	struct vfs *r;
+	pthread_mutexattr_t attr;
 	int contents_size;
 
 	r = sqlite3_malloc(sizeof *r);
@@ -441,6 +443,13 @@ static struct vfs *vfsCreate()
 
 	memset(r->contents, 0, contents_size);
 
+	/* Methods might be called recursively, e.g. when reading a snapshot
+	 * with VfsFileRead(). */
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&r->mutex, &attr);
+	pthread_mutexattr_destroy(&attr);
+
 	return r;
 
 oom_after_root_alloc:
@@ -478,6 +487,7 @@ static void vfsDestroy(struct vfs *r)
 	}
 
 	sqlite3_free(r->contents);
+	pthread_mutex_destroy(&r->mutex);
 }
 
 /* Find a content object by name.
@@ -1382,9 +1392,9 @@ static int vfsFileShmLock(sqlite3_file *file, int ofst, int n, int flags)
 static void vfsFileShmBarrier(sqlite3_file *file)
 {
 	(void)file;
-	/* This is a no-op since we expect SQLite to be compiled with mutex
-	 * support (i.e. SQLITE_MUTEX_OMIT or SQLITE_MUTEX_NOOP are *not*
-	 * defined, see sqliteInt.h). */
+	/* Reader threads access the shared memory concurrently with the main
+	 * loop thread, so a full memory barrier is needed. Taking the VFS mutex
+	 * in the locked wrapper below provides it. */
 }
 
 static int vfsFileShmUnmap(sqlite3_file *file, int delete_flag)
@@ -1405,24 +1415,93 @@ static int vfsFileShmUnmap(sqlite3_file *file, int delete_flag)
 	return SQLITE_OK;
 }
 
+/* File content is shared between the main loop thread and reader threads,
+ * which run read-only queries on their own. All methods touching it hold the
+ * root mutex. Temporary files are private to a connection and need no
+ * locking. */
+static void vfsLock(struct vfs *root)
+{
+	if (root != NULL) {
+		pthread_mutex_lock(&root->mutex);
+	}
+}
+
+static void vfsUnlock(struct vfs *root)
+{
+	if (root != NULL) {
+		pthread_mutex_unlock(&root->mutex);
+	}
+}
+
+/* Define a wrapper of the given file method holding the root mutex. */
+#define VFS__LOCKED(NAME, ARGS, PARAMS)                            \
+	static int NAME##Locked ARGS                               \
+	{                                                          \
+		struct vfs *root = ((struct vfsFile *)file)->root; \
+		int rc;                                            \
+		vfsLock(root);                                     \
+		rc = NAME PARAMS;                                  \
+		vfsUnlock(root);                                   \
+		return rc;                                         \
+	}
+
+VFS__LOCKED(vfsFileClose, (sqlite3_file *file), (file))
+VFS__LOCKED(vfsFileRead,
+	    (sqlite3_file *file, void *buf, int amount, sqlite_int64 offset),
+	    (file, buf, amount, offset))
+VFS__LOCKED(vfsFileWrite,
+	    (sqlite3_file *file,
+	     const void *buf,
+	     int amount,
+	     sqlite_int64 offset),
+	    (file, buf, amount, offset))
+VFS__LOCKED(vfsFileTruncate,
+	    (sqlite3_file *file, sqlite_int64 size),
+	    (file, size))
+VFS__LOCKED(vfsFileSize, (sqlite3_file *file, sqlite_int64 *size), (file, size))
+VFS__LOCKED(vfsFileControl,
+	    (sqlite3_file *file, int op, void *arg),
+	    (file, op, arg))
+VFS__LOCKED(vfsFileShmMap,
+	    (sqlite3_file *file,
+	     int region_index,
+	     int region_size,
+	     int extend,
+	     void volatile **out),
+	    (file, region_index, region_size, extend, out))
+VFS__LOCKED(vfsFileShmLock,
+	    (sqlite3_file *file, int ofst, int n, int flags),
+	    (file, ofst, n, flags))
+VFS__LOCKED(vfsFileShmUnmap,
+	    (sqlite3_file *file, int delete_flag),
+	    (file, delete_flag))
+
+static void vfsFileShmBarrierLocked(sqlite3_file *file)
+{
+	struct vfs *root = ((struct vfsFile *)file)->root;
+	vfsLock(root);
+	vfsFileShmBarrier(file);
+	vfsUnlock(root);
+}
+
 static const sqlite3_io_methods vfsFileMethods = {
     2,                             // iVersion
-    vfsFileClose,                  // xClose
-    vfsFileRead,                   // xRead
-    vfsFileWrite,                  // xWrite
-    vfsFileTruncate,               // xTruncate
+    vfsFileCloseLocked,            // xClose
+    vfsFileReadLocked,             // xRead
+    vfsFileWriteLocked,            // xWrite
+    vfsFileTruncateLocked,         // xTruncate
     vfsFileSync,                   // xSync
-    vfsFileSize,                   // xFileSize
+    vfsFileSizeLocked,             // xFileSize
     vfsFileLock,                   // xLock
     vfsFileUnlock,                 // xUnlock
     vfsFileCheckReservedLock,      // xCheckReservedLock
-    vfsFileControl,                // xFileControl
+    vfsFileControlLocked,          // xFileControl
     vfsFileSectorSize,             // xSectorSize
     vfsFileDeviceCharacteristics,  // xDeviceCharacteristics
-    vfsFileShmMap,                 // xShmMap
-    vfsFileShmLock,                // xShmLock
-    vfsFileShmBarrier,             // xShmBarrier
-    vfsFileShmUnmap,               // xShmUnmap
+    vfsFileShmMapLocked,           // xShmMap
+    vfsFileShmLockLocked,          // xShmLock
+    vfsFileShmBarrierLocked,       // xShmBarrier
+    vfsFileShmUnmapLocked,         // xShmUnmap
     0,
     0,
 };
@@ -1729,6 +1808,43 @@ static int vfsGetLastError(sqlite3_vfs *vfs, int x, char *y)
 	return rc;
 }
 
+static int vfsOpenLocked(sqlite3_vfs *vfs,
+			 const char *filename,
+			 sqlite3_file *file,
+			 int flags,
+			 int *out_flags)
+{
+	struct vfs *root = vfs->pAppData;
+	int rc;
+	vfsLock(root);
+	rc = vfsOpen(vfs, filename, file, flags, out_flags);
+	vfsUnlock(root);
+	return rc;
+}
+
+static int vfsDeleteLocked(sqlite3_vfs *vfs, const char *filename, int dir_sync)
+{
+	struct vfs *root = vfs->pAppData;
+	int rc;
+	vfsLock(root);
+	rc = vfsDelete(vfs, filename, dir_sync);
+	vfsUnlock(root);
+	return rc;
+}
+
+static int vfsAccessLocked(sqlite3_vfs *vfs,
+			   const char *filename,
+			   int flags,
+			   int *result)
+{
+	struct vfs *root = vfs->pAppData;
+	int rc;
+	vfsLock(root);
+	rc = vfsAccess(vfs, filename, flags, result);
+	vfsUnlock(root);
+	return rc;
+}
+
 int VfsInit(struct sqlite3_vfs *vfs, const char *name)
 {
 	vfs->iVersion = 2;
@@ -1741,9 +1857,9 @@ int VfsInit(struct sqlite3_vfs *vfs, const char *name)
 		return DQLITE_NOMEM;
 	}
 
-	vfs->xOpen = vfsOpen;
-	vfs->xDelete = vfsDelete;
-	vfs->xAccess = vfsAccess;
+	vfs->xOpen = vfsOpenLocked;
+	vfs->xDelete = vfsDeleteLocked;
+	vfs->xAccess = vfsAccessLocked;
 	vfs->xFullPathname = vfsFullPathname;
 	vfs->xDlOpen = vfsDlOpen;
 	vfs->xDlError = vfsDlError;
@@ -1919,6 +2035,120 @@ err:
 	return rc;
 }
 
+int VfsFileReadChunk(const char *vfs_name,
+		     const char *filename,
+		     size_t offset,
+		     void *buf,
+		     size_t len,
+		     size_t *n,
+		     size_t *size)
+{
+	sqlite3_vfs *vfs;
+	int type;
+	int flags;
+	sqlite3_file *file;
+	sqlite3_int64 file_size;
+	uint8_t header[FORMAT__WAL_HDR_SIZE];
+	unsigned page_size;
+	size_t unit;
+	uint8_t *pos = buf;
+	int rc;
+
+	assert(vfs_name != NULL);
+	assert(filename != NULL);
+
+	*n = 0;
+	*size = 0;
+
+	vfs = sqlite3_vfs_find(vfs_name);
+	if (vfs == NULL) {
+		return SQLITE_ERROR;
+	}
+
+	type = vfsGuessFileType(filename);
+	flags = SQLITE_OPEN_READWRITE;
+	if (type == FORMAT__DB) {
+		flags |= SQLITE_OPEN_MAIN_DB;
+	} else {
+		flags |= SQLITE_OPEN_WAL;
+	}
+
+	file = sqlite3_malloc(vfs->szOsFile);
+	if (file == NULL) {
+		return SQLITE_NOMEM;
+	}
+
+	rc = vfs->xOpen(vfs, filename, file, flags, &flags);
+	if (rc != SQLITE_OK) {
+		goto err_after_file_malloc;
+	}
+
+	rc = file->pMethods->xFileSize(file, &file_size);
+	if (rc != SQLITE_OK) {
+		goto err_after_file_open;
+	}
+	*size = file_size;
+	if ((size_t)file_size <= offset || len == 0) {
+		goto out;
+	}
+
+	rc = file->pMethods->xRead(file, header, sizeof header, 0);
+	if (rc != SQLITE_OK) {
+		goto err_after_file_open;
+	}
+	rc = format__get_page_size(type, header, &page_size);
+	if (rc != SQLITE_OK) {
+		goto err_after_file_open;
+	}
+
+	if (type == FORMAT__WAL && offset == 0) {
+		if (len < sizeof header) {
+			goto out;
+		}
+		memcpy(pos, header, sizeof header);
+		pos += sizeof header;
+		offset += sizeof header;
+	}
+
+	unit = page_size;
+	if (type == FORMAT__WAL) {
+		unit += FORMAT__WAL_FRAME_HDR_SIZE;
+	}
+
+	while (offset < (size_t)file_size &&
+	       (size_t)(pos - (uint8_t *)buf) + unit <= len) {
+		if (type == FORMAT__WAL) {
+			rc = file->pMethods->xRead(
+			    file, pos, FORMAT__WAL_FRAME_HDR_SIZE, offset);
+			if (rc != SQLITE_OK) {
+				goto err_after_file_open;
+			}
+			offset += FORMAT__WAL_FRAME_HDR_SIZE;
+			pos += FORMAT__WAL_FRAME_HDR_SIZE;
+		}
+		rc = file->pMethods->xRead(file, pos, page_size, offset);
+		if (rc != SQLITE_OK) {
+			goto err_after_file_open;
+		}
+		offset += page_size;
+		pos += page_size;
+	}
+
+	*n = pos - (uint8_t *)buf;
+
+out:
+	file->pMethods->xClose(file);
+	sqlite3_free(file);
+	return SQLITE_OK;
+
+err_after_file_open:
+	file->pMethods->xClose(file);
+err_after_file_malloc:
+	sqlite3_free(file);
+	*n = 0;
+	return rc;
+}
+
 int VfsFileWrite(const char *vfs_name,
 		 const char *filename,
 		 const void *buf,
@@ -27,6 +27,21 @@ int VfsFileRead(const char *vfs_name,
 		void **buf,
 		size_t *len);
 
+/* Read a chunk of at most @len bytes of a file starting at @offset, using the
+ * VFS implementation registered under the given name. Only whole pages of a
+ * database file, or the header and whole frames of a WAL file, are read, so
+ * @offset must be 0 or the end of a previous chunk. The amount of bytes read is
+ * stored in @n, which is 0 if @len can't fit a single page or frame, and the
+ * current file size in @size. Used to stream database snapshots without
+ * reading them in memory at once. */
+int VfsFileReadChunk(const char *vfs_name,
+		     const char *filename,
+		     size_t offset,
+		     void *buf,
+		     size_t len,
+		     size_t *n,
+		     size_t *size);
+
 /* Write the content of a file, using the VFS implementation registered under
  * the given name. Used to restore database snapshots against the dqlite
  * in-memory VFS. If the file already exists, it's overwritten. */
@@ -6,6 +6,8 @@
 #include "../lib/sqlite.h"
 
 #include "../../src/client.h"
+#include "../../src/command.h"
+#include "../../src/protocol.h"
 
 TEST_MODULE(server);
 
@@ -187,3 +189,33 @@ TEST_CASE(client, query, NULL)
 
 	return MUNIT_OK;
 }
+
+TEST_CASE(client, metrics, NULL)
+{
+	struct client_fixture *f = data;
+	struct dqlite_node_metrics metrics;
+	unsigned stmt_id;
+	unsigned last_insert_id;
+	unsigned rows_affected;
+	int rv;
+	(void)params;
+	PREPARE("CREATE TABLE test (n INT)", &stmt_id);
+	EXEC(stmt_id, &last_insert_id, &rows_affected);
+
+	rv = dqlite_node_get_metrics(f->server.dqlite, &metrics);
+	munit_assert_int(rv, ==, 0);
+
+	munit_assert_int(metrics.requests[DQLITE_REQUEST_OPEN], ==, 1);
+	munit_assert_int(metrics.requests[DQLITE_REQUEST_PREPARE], ==, 1);
+	munit_assert_int(metrics.requests[DQLITE_REQUEST_EXEC], ==, 1);
+	munit_assert_int(metrics.request_latency[DQLITE_REQUEST_EXEC].count, ==,
+			 1);
+	munit_assert_int(metrics.request_failures[DQLITE_REQUEST_EXEC], ==, 0);
+	munit_assert_int(metrics.applies, >=, 1);
+	munit_assert_int(metrics.apply_latency.count, ==, metrics.applies);
+	munit_assert_int(metrics.commands[COMMAND_FRAMES], >=, 1);
+	munit_assert_int(metrics.connections, ==, 1);
+	munit_assert_int(metrics.connections_total, ==, 1);
+
+	return MUNIT_OK;
+}
@@ -89,7 +89,8 @@ struct server
 		rc = fsm__init(fsm, &s->config, &s->registry);             \
 		munit_assert_int(rc, ==, 0);                               \
                                                                            \
-		rc = replication__init(&s->replication, &s->config, raft); \
+		rc = replication__init(&s->replication, &s->config, raft,  \
+				       &s->registry.metrics);             \
 		munit_assert_int(rc, ==, 0);                               \
 	}
 
@@ -9,11 +9,12 @@
 
 #define FIXTURE_REPLICATION sqlite3_wal_replication replication;
 
-#define SETUP_REPLICATION                                                      \
-	{                                                                      \
-		int rc;                                                        \
-		rc = replication__init(&f->replication, &f->config, &f->raft); \
-		munit_assert_int(rc, ==, 0);                                   \
+#define SETUP_REPLICATION                                               \
+	{                                                               \
+		int rc;                                                 \
+		rc = replication__init(&f->replication, &f->config,     \
+				       &f->raft, &f->registry.metrics); \
+		munit_assert_int(rc, ==, 0);                            \
 	}
 
 #define TEAR_DOWN_REPLICATION replication__close(&f->replication);
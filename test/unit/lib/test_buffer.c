@@ -1,3 +1,4 @@
+#include "../../../include/dqlite.h"
 #include "../../../src/lib/buffer.h"
 
 #include "../../lib/runner.h"
@@ -33,6 +34,11 @@ static void tear_down(void *data)
 	free(f);
 }
 
+static void noRelease(void *base)
+{
+	(void)base;
+}
+
 /******************************************************************************
  *
  * Helper macros.
@@ -116,3 +122,186 @@ TEST_CASE(advance, double_twice, NULL)
 	ASSERT_N_PAGES(4);
 	return MUNIT_OK;
 }
+
+/* Content written before growing is preserved. */
+TEST_CASE(advance, preserve, NULL)
+{
+	struct fixture *f = data;
+	void *cursor;
+	(void)params;
+	ADVANCE(8);
+	*(uint64_t *)cursor = 123;
+	ADVANCE(16 + 3 * f->buffer.page_size);
+	ASSERT_N_PAGES(4);
+	munit_assert_int(*(uint64_t *)buffer__cursor(&f->buffer, 0), ==, 123);
+	return MUNIT_OK;
+}
+
+/******************************************************************************
+ *
+ * buffer__attach
+ *
+ ******************************************************************************/
+
+TEST_SUITE(attach);
+TEST_SETUP(attach, setup);
+TEST_TEAR_DOWN(attach, tear_down);
+
+/* Attached data is interleaved with the buffer's own memory, without being
+ * copied. */
+TEST_CASE(attach, segments, NULL)
+{
+	struct fixture *f = data;
+	void *cursor;
+	char *chunk = malloc(32);
+	uv_buf_t bufs[BUFFER__MAX_SEGMENTS];
+	unsigned n;
+	int rv;
+	(void)params;
+	munit_assert_ptr_not_null(chunk);
+	ADVANCE(8);
+	rv = buffer__attach(&f->buffer, chunk, 32, free);
+	munit_assert_int(rv, ==, 0);
+	ADVANCE(16);
+	munit_assert_int(buffer__offset(&f->buffer), ==, 24);
+	munit_assert_int(buffer__size(&f->buffer), ==, 56);
+	n = buffer__segments(&f->buffer, bufs);
+	munit_assert_int(n, ==, 3);
+	munit_assert_ptr_equal(bufs[0].base, buffer__cursor(&f->buffer, 0));
+	munit_assert_int(bufs[0].len, ==, 8);
+	munit_assert_ptr_equal(bufs[1].base, chunk);
+	munit_assert_int(bufs[1].len, ==, 32);
+	munit_assert_ptr_equal(bufs[2].base, buffer__cursor(&f->buffer, 8));
+	munit_assert_int(bufs[2].len, ==, 16);
+	return MUNIT_OK;
+}
+
+/* Resetting the buffer releases attached data. */
+TEST_CASE(attach, reset, NULL)
+{
+	struct fixture *f = data;
+	int rv;
+	(void)params;
+	rv = buffer__attach(&f->buffer, malloc(8), 8, free);
+	munit_assert_int(rv, ==, 0);
+	buffer__reset(&f->buffer);
+	munit_assert_int(buffer__size(&f->buffer), ==, 0);
+	munit_assert_int(f->buffer.n_refs, ==, 0);
+	return MUNIT_OK;
+}
+
+/* At most BUFFER__MAX_REFS chunks can be attached. */
+TEST_CASE(attach, too_many, NULL)
+{
+	struct fixture *f = data;
+	static char chunk[8];
+	unsigned i;
+	int rv;
+	(void)params;
+	for (i = 0; i < BUFFER__MAX_REFS; i++) {
+		rv = buffer__attach(&f->buffer, chunk, 8, noRelease);
+		munit_assert_int(rv, ==, 0);
+	}
+	rv = buffer__attach(&f->buffer, chunk, 8, noRelease);
+	munit_assert_int(rv, ==, DQLITE_ERROR);
+	return MUNIT_OK;
+}
+
+/******************************************************************************
+ *
+ * buffer_pool__get
+ *
+ ******************************************************************************/
+
+struct pool_fixture
+{
+	struct buffer_pool pool;
+	struct buffer buffer;
+};
+
+static void *pool_setup(const MunitParameter params[], void *user_data)
+{
+	struct pool_fixture *f = munit_malloc(sizeof *f);
+	(void)params;
+	(void)user_data;
+	buffer_pool__init(&f->pool, 16 * 4096, 64 * 4096);
+	f->buffer.data = NULL;
+	return f;
+}
+
+static void pool_tear_down(void *data)
+{
+	struct pool_fixture *f = data;
+	buffer_pool__put(&f->pool, &f->buffer);
+	buffer_pool__close(&f->pool);
+	free(f);
+}
+
+TEST_SUITE(pool);
+TEST_SETUP(pool, pool_setup);
+TEST_TEAR_DOWN(pool, pool_tear_down);
+
+/* Memory given back to the pool is lent again to the next borrower. */
+TEST_CASE(pool, reuse, NULL)
+{
+	struct pool_fixture *f = data;
+	void *memory;
+	int rv;
+	(void)params;
+	rv = buffer_pool__get(&f->pool, &f->buffer, 100);
+	munit_assert_int(rv, ==, 0);
+	memory = f->buffer.data;
+	buffer_pool__put(&f->pool, &f->buffer);
+	munit_assert_ptr_null(f->buffer.data);
+	munit_assert_int(f->pool.cached, ==, f->pool.page_size);
+	rv = buffer_pool__get(&f->pool, &f->buffer, 100);
+	munit_assert_int(rv, ==, 0);
+	munit_assert_ptr_equal(f->buffer.data, memory);
+	munit_assert_int(f->pool.cached, ==, 0);
+	munit_assert_int(f->pool.n_hits, ==, 1);
+	return MUNIT_OK;
+}
+
+/* Borrowed memory is large enough for the requested size, and comes from the
+ * matching size class. */
+TEST_CASE(pool, size_class, NULL)
+{
+	struct pool_fixture *f = data;
+	int rv;
+	(void)params;
+	rv = buffer_pool__get(&f->pool, &f->buffer, 100);
+	munit_assert_int(rv, ==, 0);
+	buffer_pool__put(&f->pool, &f->buffer);
+	rv = buffer_pool__get(&f->pool, &f->buffer, 3 * f->pool.page_size);
+	munit_assert_int(rv, ==, 0);
+	munit_assert_int(f->pool.n_hits, ==, 0);
+	munit_assert_int(f->buffer.n_pages, ==, 4);
+	return MUNIT_OK;
+}
+
+/* Memory larger than the maximum size is released instead of being kept. */
+TEST_CASE(pool, too_large, NULL)
+{
+	struct pool_fixture *f = data;
+	int rv;
+	(void)params;
+	rv = buffer_pool__get(&f->pool, &f->buffer, 32 * f->pool.page_size);
+	munit_assert_int(rv, ==, 0);
+	buffer_pool__put(&f->pool, &f->buffer);
+	munit_assert_int(f->pool.cached, ==, 0);
+	return MUNIT_OK;
+}
+
+/* Trimming the pool releases all its idle memory. */
+TEST_CASE(pool, trim, NULL)
+{
+	struct pool_fixture *f = data;
+	int rv;
+	(void)params;
+	rv = buffer_pool__get(&f->pool, &f->buffer, 100);
+	munit_assert_int(rv, ==, 0);
+	buffer_pool__put(&f->pool, &f->buffer);
+	buffer_pool__trim(&f->pool);
+	munit_assert_int(f->pool.cached, ==, 0);
+	return MUNIT_OK;
+}
@@ -104,7 +104,7 @@ static void tear_down(void *data)
 #define WRITE(BUF)                                                    \
 	{                                                             \
 		int rv2;                                              \
-		rv2 = transport__write(&f->transport, BUF, write_cb); \
+		rv2 = transport__write(&f->transport, BUF, 1, write_cb); \
 		munit_assert_int(rv2, ==, 0);                         \
 	}
 
@@ -34,15 +34,16 @@ static void connCloseCb(struct conn *conn)
 	*closed = true;
 }
 
-#define FIXTURE              \
-	FIXTURE_LOGGER;      \
-	FIXTURE_VFS;         \
-	FIXTURE_CONFIG;      \
-	FIXTURE_REGISTRY;    \
-	FIXTURE_RAFT;        \
-	FIXTURE_REPLICATION; \
-	FIXTURE_CLIENT;      \
-	struct conn conn;    \
+#define FIXTURE                  \
+	FIXTURE_LOGGER;          \
+	FIXTURE_VFS;             \
+	FIXTURE_CONFIG;          \
+	FIXTURE_REGISTRY;        \
+	FIXTURE_RAFT;            \
+	FIXTURE_REPLICATION;     \
+	FIXTURE_CLIENT;          \
+	struct buffer_pool pool; \
+	struct conn conn;        \
 	bool closed;
 
 #define SETUP                                                                \
@@ -63,8 +64,11 @@ static void connCloseCb(struct conn *conn)
 	munit_assert_int(rv, ==, 0);                                         \
 	f->closed = false;                                                   \
 	f->conn.queue[0] = &f->closed;                                       \
-	rv = conn__start(&f->conn, &f->config, &f->loop, &f->registry,       \
-			 &f->raft, stream, &f->raft_transport, connCloseCb); \
+	buffer_pool__init(&f->pool, f->config.buffer_pool_max_size,          \
+			  f->config.buffer_pool_max);                        \
+	rv = conn__start(&f->conn, &f->config, &f->loop, &f->pool,           \
+			 &f->registry, &f->raft, stream, &f->raft_transport, \
+			 connCloseCb);                                       \
 	munit_assert_int(rv, ==, 0)
 
 #define TEAR_DOWN                         \
@@ -72,6 +76,7 @@ static void connCloseCb(struct conn *conn)
 	while (!f->closed) {              \
 		test_uv_run(&f->loop, 1); \
 	};                                \
+	buffer_pool__close(&f->pool);     \
 	TEAR_DOWN_REPLICATION;            \
 	TEAR_DOWN_RAFT;                   \
 	TEAR_DOWN_CLIENT;                 \
@@ -198,6 +203,26 @@ TEST_CASE(handshake, success, NULL)
 	return MUNIT_OK;
 }
 
+/* Client and server settle on the capabilities they both support. */
+TEST_CASE(handshake, capabilities, NULL)
+{
+	struct handshake_fixture *f = data;
+	uint64_t capabilities;
+	int rv;
+	(void)params;
+	HANDSHAKE;
+	rv = clientSendCapabilities(&f->client, DQLITE_CAPABILITY_COLUMNAR |
+						    (1ULL << 63));
+	munit_assert_int(rv, ==, 0);
+	test_uv_run(&f->loop, 1);
+	rv = clientRecvCapabilities(&f->client, &capabilities);
+	munit_assert_int(rv, ==, 0);
+	munit_assert_ulong(capabilities, ==, DQLITE_CAPABILITY_COLUMNAR);
+	munit_assert_ulong(f->conn.gateway.capabilities, ==,
+			   DQLITE_CAPABILITY_COLUMNAR);
+	return MUNIT_OK;
+}
+
 /******************************************************************************
  *
  * Handle an open request
@@ -410,6 +435,136 @@ TEST_CASE(query, one, NULL)
 	return MUNIT_OK;
 }
 
+/* Once a request was handled, the connection doesn't hold any buffer memory,
+ * which is back in the pool. */
+TEST_CASE(query, idle, NULL)
+{
+	struct query_fixture *f = data;
+	unsigned i;
+	(void)params;
+	PREPARE("SELECT n FROM test", &f->stmt_id);
+	QUERY(f->stmt_id, &f->rows);
+	test_uv_run(&f->loop, 1);
+	munit_assert_ptr_null(f->conn.read.data);
+	munit_assert_ptr_null(f->conn.body.data);
+	for (i = 0; i < f->conn.n_write; i++) {
+		munit_assert_ptr_null(f->conn.write[i].data);
+	}
+	munit_assert_int(f->pool.cached, >, 0);
+	return MUNIT_OK;
+}
+
+/* The next batch of rows of a large query is produced while the first one is
+ * still being sent, but no further than the prefetch depth. */
+TEST_CASE(query, prefetch, NULL)
+{
+	struct query_fixture *f = data;
+	struct db *db;
+	int rv;
+	(void)params;
+	PREPARE(
+	    "WITH RECURSIVE c(x) AS (SELECT 1 UNION ALL SELECT x+1 FROM c) "
+	    "SELECT x FROM c LIMIT 20000",
+	    &f->stmt_id);
+	QUERY(f->stmt_id, &f->rows);
+	munit_assert_int(f->rows.column_count, ==, 1);
+	rv = registry__db_get(&f->registry, "test", &db);
+	munit_assert_int(rv, ==, 0);
+	munit_assert_int(f->config.query_prefetch, ==, 1);
+	munit_assert_int(db->n_batches, ==, 2);
+	return MUNIT_OK;
+}
+
+/* A tagged interrupt sent right after a large query stops it before all of its
+ * batches of rows were produced. */
+TEST_CASE(query, interrupt, NULL)
+{
+	struct query_fixture *f = data;
+	struct db *db;
+	unsigned skipped;
+	int rv;
+	(void)params;
+	PREPARE(
+	    "WITH RECURSIVE c(x) AS (SELECT 1 UNION ALL SELECT x+1 FROM c) "
+	    "SELECT x FROM c LIMIT 100000",
+	    &f->stmt_id);
+	rv = registry__db_get(&f->registry, "test", &db);
+	munit_assert_int(rv, ==, 0);
+	f->conn.gateway.budget.rows = 10;
+	f->client.tag = 1;
+	rv = clientSendQuery(&f->client, f->stmt_id);
+	munit_assert_int(rv, ==, 0);
+	f->client.tag = 2;
+	rv = clientSendInterrupt(&f->client);
+	munit_assert_int(rv, ==, 0);
+	while (db->n_batches == 0 || f->conn.handling) {
+		test_uv_run(&f->loop, 1);
+	}
+
+	rv = clientRecvInterrupt(&f->client, &skipped);
+	munit_assert_int(rv, ==, 0);
+	munit_assert_int(f->client.last_tag, ==, 2);
+	munit_assert_int(skipped, >, 0);
+	munit_assert_int(db->n_batches, <, 100);
+	munit_assert_false(f->conn.gateway.interrupted);
+	return MUNIT_OK;
+}
+
+/******************************************************************************
+ *
+ * Pipeline tagged requests
+ *
+ ******************************************************************************/
+
+TEST_SUITE(pipeline);
+
+struct pipeline_fixture
+{
+	FIXTURE;
+};
+
+TEST_SETUP(pipeline)
+{
+	struct pipeline_fixture *f = munit_malloc(sizeof *f);
+	SETUP;
+	HANDSHAKE;
+	OPEN;
+	return f;
+}
+
+TEST_TEAR_DOWN(pipeline)
+{
+	struct pipeline_fixture *f = data;
+	TEAR_DOWN;
+	free(f);
+}
+
+/* Several tagged requests can be sent before reading any response. Responses
+ * come back in order, carrying the tag of their request. */
+TEST_CASE(pipeline, tagged, NULL)
+{
+	struct pipeline_fixture *f = data;
+	unsigned stmt_id1;
+	unsigned stmt_id2;
+	int rv;
+	(void)params;
+	f->client.tag = 1;
+	rv = clientSendPrepare(&f->client, "SELECT 1");
+	munit_assert_int(rv, ==, 0);
+	f->client.tag = 2;
+	rv = clientSendPrepare(&f->client, "SELECT 2");
+	munit_assert_int(rv, ==, 0);
+	test_uv_run(&f->loop, 4);
+	rv = clientRecvStmt(&f->client, &stmt_id1);
+	munit_assert_int(rv, ==, 0);
+	munit_assert_int(f->client.last_tag, ==, 1);
+	rv = clientRecvStmt(&f->client, &stmt_id2);
+	munit_assert_int(rv, ==, 0);
+	munit_assert_int(f->client.last_tag, ==, 2);
+	munit_assert_int(stmt_id1, !=, stmt_id2);
+	return MUNIT_OK;
+}
+
 /******************************************************************************
  *
  * Handle a raft connect request
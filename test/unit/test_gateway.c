@@ -1,5 +1,8 @@
 #include "../../include/dqlite.h"
+#include "../../src/checkpoint.h"
 #include "../../src/gateway.h"
+#include "../../src/metrics.h"
+#include "../../src/readers.h"
 #include "../../src/request.h"
 #include "../../src/response.h"
 #include "../../src/tuple.h"
@@ -198,6 +201,17 @@ static void handleCb(struct handle *req, int status, int type)
 		ASSERT_CALLBACK(0, EMPTY);        \
 	}
 
+/* Set the given connection option. */
+#define OPTION(NAME, VALUE)                   \
+	{                                     \
+		struct request_option option; \
+		option.option = NAME;         \
+		option.value = VALUE;         \
+		ENCODE(&option, option);      \
+		HANDLE(OPTION);               \
+		ASSERT_CALLBACK(0, EMPTY);    \
+	}
+
 /* Submit a request to execute the given statement. */
 #define EXEC_SUBMIT(STMT_ID)              \
 	{                                 \
@@ -231,6 +245,44 @@ static void handleCb(struct handle *req, int status, int type)
 		munit_assert_true(f->context->invoked); \
 	}
 
+/* Run the given loop until the reader thread producing a batch of rows for
+ * the current gateway is done. */
+#define WAIT_READER(LOOP)                       \
+	while (f->gateway->reading) {           \
+		uv_run(LOOP, UV_RUN_ONCE);      \
+	}                                       \
+	munit_assert_true(f->context->invoked);
+
+/* Take a snapshot of the first server and restore it right away, rewriting
+ * the files of all its databases. */
+#define RESTORE                                                            \
+	{                                                                  \
+		struct raft_fsm *fsm_ = &f->fsms[0];                       \
+		struct raft_buffer *bufs_;                                 \
+		struct raft_buffer buf_;                                   \
+		unsigned n_bufs_;                                          \
+		unsigned i_;                                               \
+		int rv_;                                                   \
+		rv_ = fsm_->snapshot(fsm_, &bufs_, &n_bufs_);              \
+		munit_assert_int(rv_, ==, 0);                              \
+		buf_.len = 0;                                              \
+		for (i_ = 0; i_ < n_bufs_; i_++) {                         \
+			buf_.len += bufs_[i_].len;                         \
+		}                                                          \
+		buf_.base = raft_malloc(buf_.len);                         \
+		munit_assert_ptr_not_null(buf_.base);                      \
+		buf_.len = 0;                                              \
+		for (i_ = 0; i_ < n_bufs_; i_++) {                         \
+			memcpy((char *)buf_.base + buf_.len, bufs_[i_].base, \
+			       bufs_[i_].len);                             \
+			buf_.len += bufs_[i_].len;                         \
+			raft_free(bufs_[i_].base);                         \
+		}                                                          \
+		raft_free(bufs_);                                          \
+		rv_ = fsm_->restore(fsm_, &buf_);                          \
+		munit_assert_int(rv_, ==, 0);                              \
+	}
+
 /* Prepare and exec a statement. */
 #define EXEC(SQL)                           \
 	{                                   \
@@ -388,10 +440,180 @@ TEST_CASE(open, success, NULL)
 	return MUNIT_OK;
 }
 
-TEST_GROUP(open, error);
+/* Closing a gateway gives its leader connection back to the database pool, and
+ * the next open request reuses it. */
+TEST_CASE(open, pool, NULL)
+{
+	struct open_fixture *f = data;
+	struct leader *leader;
+	(void)params;
+	f->request.filename = "test";
+	f->request.vfs = "";
+	ENCODE(&f->request, open);
+	HANDLE(OPEN);
+	ASSERT_CALLBACK(0, DB);
+	leader = f->gateway->leader;
+
+	gateway__close(f->gateway);
+	munit_assert_int(leader->db->pool_size, ==, 1);
+	gateway__init(f->gateway, CLUSTER_CONFIG(0), CLUSTER_REGISTRY(0),
+		      CLUSTER_RAFT(0));
+
+	ENCODE(&f->request, open);
+	HANDLE(OPEN);
+	ASSERT_CALLBACK(0, DB);
+	munit_assert_ptr_equal(f->gateway->leader, leader);
+	munit_assert_int(leader->db->pool_size, ==, 0);
+	return MUNIT_OK;
+}
+
+/* Reading a setting leaves the connection clean. */
+TEST_CASE(open, pool_read_pragma, NULL)
+{
+	struct open_fixture *f = data;
+	uint64_t stmt_id;
+	struct db *db;
+	(void)params;
+	OPEN;
+	PREPARE("PRAGMA foreign_keys");
+	FINALIZE(stmt_id);
+	db = f->gateway->leader->db;
+	gateway__close(f->gateway);
+	munit_assert_int(db->pool_size, ==, 1);
+	gateway__init(f->gateway, CLUSTER_CONFIG(0), CLUSTER_REGISTRY(0),
+		      CLUSTER_RAFT(0));
+	return MUNIT_OK;
+}
+
+/* A connection whose session settings were changed by the client is closed
+ * instead of being handed to the next one. */
+TEST_CASE(open, pool_dirty, NULL)
+{
+	struct open_fixture *f = data;
+	struct db *db;
+	(void)params;
+	CLUSTER_ELECT(0);
+	OPEN;
+	EXEC("PRAGMA query_only=1");
+	db = f->gateway->leader->db;
+	gateway__close(f->gateway);
+	munit_assert_int(db->pool_size, ==, 0);
+	gateway__init(f->gateway, CLUSTER_CONFIG(0), CLUSTER_REGISTRY(0),
+		      CLUSTER_RAFT(0));
+	return MUNIT_OK;
+}
+
+/* The same goes for a connection with a temporary table. */
+TEST_CASE(open, pool_temp, NULL)
+{
+	struct open_fixture *f = data;
+	struct db *db;
+	(void)params;
+	CLUSTER_ELECT(0);
+	OPEN;
+	EXEC("CREATE TEMP TABLE test (n INT)");
+	db = f->gateway->leader->db;
+	gateway__close(f->gateway);
+	munit_assert_int(db->pool_size, ==, 0);
+	gateway__init(f->gateway, CLUSTER_CONFIG(0), CLUSTER_REGISTRY(0),
+		      CLUSTER_RAFT(0));
+	return MUNIT_OK;
+}
+
+/* Once no request is in progress, an idle gateway gives its connection back to
+ * the pool, where another gateway can take it, and the next request against the
+ * database takes one again. */
+TEST_CASE(open, idle, NULL)
+{
+	struct open_fixture *f = data;
+	struct gateway other;
+	struct leader *leader;
+	struct db *db;
+	(void)params;
+	CLUSTER_ELECT(0);
+	OPEN;
+	leader = f->gateway->leader;
+	db = leader->db;
+	gateway__idle(f->gateway);
+	munit_assert_ptr_null(f->gateway->leaders[0]);
+	munit_assert_int(db->pool_size, ==, 1);
+
+	gateway__init(&other, CLUSTER_CONFIG(0), CLUSTER_REGISTRY(0),
+		      CLUSTER_RAFT(0));
+	SELECT(1);
+	f->gateway = &other;
+	OPEN;
+	munit_assert_ptr_equal(other.leader, leader);
+	munit_assert_int(db->pool_size, ==, 0);
+	gateway__idle(&other);
+	gateway__close(&other);
+	SELECT(0);
+
+	EXEC("CREATE TABLE test (n INT)");
+	munit_assert_ptr_equal(f->gateway->leader, leader);
+	gateway__idle(f->gateway);
+	munit_assert_int(db->pool_size, ==, 1);
+	return MUNIT_OK;
+}
+
+/* A connection with a prepared statement of the client is kept until the
+ * statement is finalized. */
+TEST_CASE(open, idle_stmt, NULL)
+{
+	struct open_fixture *f = data;
+	uint64_t stmt_id;
+	struct db *db;
+	(void)params;
+	OPEN;
+	PREPARE("SELECT 1");
+	db = f->gateway->leader->db;
+	gateway__idle(f->gateway);
+	munit_assert_ptr_not_null(f->gateway->leaders[0]);
+	munit_assert_int(db->pool_size, ==, 0);
+	FINALIZE(stmt_id);
+	gateway__idle(f->gateway);
+	munit_assert_ptr_null(f->gateway->leaders[0]);
+	munit_assert_int(db->pool_size, ==, 1);
+	return MUNIT_OK;
+}
 
-/* Attempting to open two databases on the same gateway results in an error. */
-TEST_CASE(open, error, twice, NULL)
+/* A connection with a transaction in progress is kept until it ends. */
+TEST_CASE(open, idle_tx, NULL)
+{
+	struct open_fixture *f = data;
+	struct db *db;
+	(void)params;
+	CLUSTER_ELECT(0);
+	OPEN;
+	EXEC("BEGIN");
+	db = f->gateway->leader->db;
+	gateway__idle(f->gateway);
+	munit_assert_ptr_not_null(f->gateway->leaders[0]);
+	EXEC("COMMIT");
+	gateway__idle(f->gateway);
+	munit_assert_ptr_null(f->gateway->leaders[0]);
+	munit_assert_int(db->pool_size, ==, 1);
+	return MUNIT_OK;
+}
+
+/* A connection whose session was changed by the client stays with it. */
+TEST_CASE(open, idle_dirty, NULL)
+{
+	struct open_fixture *f = data;
+	struct leader *leader;
+	(void)params;
+	CLUSTER_ELECT(0);
+	OPEN;
+	EXEC("PRAGMA query_only=1");
+	leader = f->gateway->leader;
+	gateway__idle(f->gateway);
+	munit_assert_ptr_equal(f->gateway->leaders[0], leader);
+	munit_assert_int(leader->db->pool_size, ==, 0);
+	return MUNIT_OK;
+}
+
+/* Opening the same database twice returns the same ID. */
+TEST_CASE(open, twice, NULL)
 {
 	struct open_fixture *f = data;
 	(void)params;
@@ -402,9 +624,76 @@ TEST_CASE(open, error, twice, NULL)
 	ASSERT_CALLBACK(0, DB);
 	ENCODE(&f->request, open);
 	HANDLE(OPEN);
+	ASSERT_CALLBACK(0, DB);
+	DECODE(&f->response, db);
+	munit_assert_int(f->response.id, ==, 0);
+	munit_assert_int(f->gateway->n_dbs, ==, 1);
+	return MUNIT_OK;
+}
+
+/* Several databases can be opened on the same gateway, and requests are routed
+ * by database ID. */
+TEST_CASE(open, multiple, NULL)
+{
+	struct open_fixture *f = data;
+	struct request_prepare prepare;
+	struct request_exec exec;
+	uint64_t stmt_id;
+	(void)params;
+	CLUSTER_ELECT(0);
+	OPEN;
+	f->request.filename = "test2";
+	f->request.vfs = "";
+	ENCODE(&f->request, open);
+	HANDLE(OPEN);
+	ASSERT_CALLBACK(0, DB);
+	DECODE(&f->response, db);
+	munit_assert_int(f->response.id, ==, 1);
+
+	prepare.db_id = 1;
+	prepare.sql = "CREATE TABLE test (n INT)";
+	ENCODE(&prepare, prepare);
+	HANDLE(PREPARE);
+	ASSERT_CALLBACK(0, STMT);
+	{
+		struct response_stmt stmt;
+		DECODE(&stmt, stmt);
+		munit_assert_int(stmt.db_id, ==, 1);
+		stmt_id = stmt.id;
+	}
+
+	/* The statement can't be used against the other database. */
+	exec.db_id = 0;
+	exec.stmt_id = stmt_id;
+	ENCODE(&exec, exec);
+	HANDLE(EXEC);
+	ASSERT_CALLBACK(0, FAILURE);
+	ASSERT_FAILURE(SQLITE_NOTFOUND, "no statement with the given id");
+
+	exec.db_id = 1;
+	ENCODE(&exec, exec);
+	HANDLE(EXEC);
+	WAIT;
+	ASSERT_CALLBACK(0, RESULT);
+	munit_assert_string_equal(f->gateway->leader->db->filename, "test2");
+	return MUNIT_OK;
+}
+
+TEST_GROUP(open, error);
+
+/* Requests against a database ID that was not opened fail. */
+TEST_CASE(open, error, unknown, NULL)
+{
+	struct open_fixture *f = data;
+	struct request_prepare prepare;
+	(void)params;
+	OPEN;
+	prepare.db_id = 1;
+	prepare.sql = "SELECT 1";
+	ENCODE(&prepare, prepare);
+	HANDLE(PREPARE);
 	ASSERT_CALLBACK(0, FAILURE);
-	ASSERT_FAILURE(SQLITE_BUSY,
-		       "a database for this connection is already open");
+	ASSERT_FAILURE(SQLITE_NOTFOUND, "no database opened");
 	return MUNIT_OK;
 }
 
@@ -922,6 +1211,73 @@ TEST_CASE(exec, restore, NULL)
 	return MUNIT_OK;
 }
 
+/* Execute a statement against several parameter tuples in one request. All
+ * rows get inserted by a single frames command. */
+TEST_CASE(exec, bulk, NULL)
+{
+	struct exec_fixture *f = data;
+	struct request_exec_bulk request;
+	struct value value;
+	uint64_t stmt_id;
+	unsigned i;
+	(void)params;
+	CLUSTER_ELECT(0);
+	EXEC("CREATE TABLE test (n INT)");
+	munit_assert_int(CLUSTER_LAST_INDEX(0), ==, 3);
+
+	PREPARE("INSERT INTO test VALUES (?)");
+	request.db_id = 0;
+	request.stmt_id = stmt_id;
+	request.n = 3;
+	ENCODE(&request, exec_bulk);
+	value.type = SQLITE_INTEGER;
+	for (i = 0; i < 3; i++) {
+		value.integer = i;
+		ENCODE_PARAMS(1, &value);
+	}
+	HANDLE(EXEC_BULK);
+	WAIT;
+	ASSERT_CALLBACK(0, RESULT);
+	DECODE(&f->response, result);
+	munit_assert_int(f->response.last_insert_id, ==, 3);
+	munit_assert_int(f->response.rows_affected, ==, 3);
+	munit_assert_int(CLUSTER_LAST_INDEX(0), ==, 4);
+	munit_assert_true(sqlite3_get_autocommit(f->gateway->leader->conn));
+
+	return MUNIT_OK;
+}
+
+/* If one of the tuples fails, none of them gets applied. */
+TEST_CASE(exec, bulk_rollback, NULL)
+{
+	struct exec_fixture *f = data;
+	struct request_exec_bulk request;
+	struct value value;
+	uint64_t stmt_id;
+	(void)params;
+	CLUSTER_ELECT(0);
+	EXEC("CREATE TABLE test (n INT UNIQUE)");
+
+	PREPARE("INSERT INTO test VALUES (?)");
+	request.db_id = 0;
+	request.stmt_id = stmt_id;
+	request.n = 2;
+	ENCODE(&request, exec_bulk);
+	value.type = SQLITE_INTEGER;
+	value.integer = 1;
+	ENCODE_PARAMS(1, &value);
+	ENCODE_PARAMS(1, &value);
+	HANDLE(EXEC_BULK);
+	WAIT;
+	ASSERT_CALLBACK(0, FAILURE);
+	ASSERT_FAILURE(SQLITE_CONSTRAINT_UNIQUE,
+		       "UNIQUE constraint failed: test.n");
+	munit_assert_int(CLUSTER_LAST_INDEX(0), ==, 3);
+	munit_assert_true(sqlite3_get_autocommit(f->gateway->leader->conn));
+
+	return MUNIT_OK;
+}
+
 /******************************************************************************
  *
  * query
@@ -1025,6 +1381,7 @@ TEST_CASE(query, large, NULL)
 		EXEC("INSERT INTO test(n) VALUES(123)");
 	}
 	EXEC("COMMIT");
+	OPTION(DQLITE_OPTION_BATCH_BYTES, 4096);
 
 	PREPARE("SELECT n FROM test");
 	f->request.db_id = 0;
@@ -1047,7 +1404,7 @@ TEST_CASE(query, large, NULL)
 	DECODE(&f->response, rows);
 	munit_assert_ulong(f->response.eof, ==, DQLITE_RESPONSE_ROWS_PART);
 
-	gateway__resume(f->gateway, &finished);
+	gateway__resume(f->gateway, f->buf2, &finished);
 	munit_assert_false(finished);
 
 	ASSERT_CALLBACK(0, ROWS);
@@ -1069,52 +1426,23 @@ TEST_CASE(query, large, NULL)
 	return MUNIT_OK;
 }
 
-/* Perform a query using a prepared statement with parameters */
-TEST_CASE(query, params, NULL)
-{
-	struct query_fixture *f = data;
-	struct value values[2];
-	uint64_t stmt_id;
-	(void)params;
-	EXEC("BEGIN");
-	EXEC("INSERT INTO test(n) VALUES(1)");
-	EXEC("INSERT INTO test(n) VALUES(2)");
-	EXEC("INSERT INTO test(n) VALUES(3)");
-	EXEC("INSERT INTO test(n) VALUES(4)");
-	EXEC("COMMIT");
-
-	PREPARE("SELECT n FROM test WHERE n > ? AND n < ?");
-	f->request.db_id = 0;
-	f->request.stmt_id = stmt_id;
-
-	ENCODE(&f->request, query);
-	values[0].type = SQLITE_INTEGER;
-	values[0].integer = 1;
-	values[1].type = SQLITE_INTEGER;
-	values[1].integer = 4;
-	ENCODE_PARAMS(2, values);
-
-	HANDLE(QUERY);
-	ASSERT_CALLBACK(0, ROWS);
-	return MUNIT_OK;
-}
-
-/* Interrupt a large query. */
-TEST_CASE(query, interrupt, NULL)
+/* Limit the number of rows in each batch. */
+TEST_CASE(query, batch_rows, NULL)
 {
 	struct query_fixture *f = data;
-	struct request_interrupt interrupt;
 	unsigned i;
 	uint64_t stmt_id;
 	uint64_t n;
 	const char *column;
 	struct value value;
+	bool finished;
 	(void)params;
 	EXEC("BEGIN");
-	for (i = 0; i < 500; i++) {
+	for (i = 0; i < 5; i++) {
 		EXEC("INSERT INTO test(n) VALUES(123)");
 	}
 	EXEC("COMMIT");
+	OPTION(DQLITE_OPTION_BATCH_ROWS, 3);
 
 	PREPARE("SELECT n FROM test");
 	f->request.db_id = 0;
@@ -1127,218 +1455,1507 @@ TEST_CASE(query, interrupt, NULL)
 	munit_assert_int(n, ==, 1);
 	text__decode(f->cursor, &column);
 	munit_assert_string_equal(column, "n");
-
-	for (i = 0; i < 255; i++) {
+	for (i = 0; i < 3; i++) {
 		DECODE_ROW(1, &value);
-		munit_assert_int(value.type, ==, SQLITE_INTEGER);
 		munit_assert_int(value.integer, ==, 123);
 	}
-
 	DECODE(&f->response, rows);
 	munit_assert_ulong(f->response.eof, ==, DQLITE_RESPONSE_ROWS_PART);
 
-	ENCODE(&interrupt, interrupt);
-	HANDLE(INTERRUPT);
+	gateway__resume(f->gateway, f->buf2, &finished);
+	munit_assert_false(finished);
+	ASSERT_CALLBACK(0, ROWS);
 
-	ASSERT_CALLBACK(0, EMPTY);
+	uint64__decode(f->cursor, &n);
+	text__decode(f->cursor, &column);
+	for (i = 0; i < 2; i++) {
+		DECODE_ROW(1, &value);
+		munit_assert_int(value.integer, ==, 123);
+	}
+	DECODE(&f->response, rows);
+	munit_assert_ulong(f->response.eof, ==, DQLITE_RESPONSE_ROWS_DONE);
 
 	return MUNIT_OK;
 }
 
-/* Submit a query request right after the server has been re-elected and needs
- * to catch up with logs. */
-TEST_CASE(query, barrier, NULL)
+/* Setting an unknown option fails. */
+TEST_CASE(query, option_unknown, NULL)
 {
 	struct query_fixture *f = data;
-	uint64_t stmt_id;
+	struct request_option request;
 	(void)params;
-
-	PREPARE("INSERT INTO test(n) VALUES(1)");
-	EXEC_SUBMIT(stmt_id);
-	CLUSTER_DEPOSE;
+	request.option = 666;
+	request.value = 1;
+	ENCODE(&request, option);
+	HANDLE(OPTION);
 	ASSERT_CALLBACK(0, FAILURE);
+	ASSERT_FAILURE(SQLITE_NOTFOUND, "unknown option");
 
-	/* Re-elect ourselves and issue a query request */
-	CLUSTER_ELECT(0);
+	return MUNIT_OK;
+}
+
+/* Declared column types are picked up again when a schema change re-prepares
+ * the statement. */
+TEST_CASE(query, decltype_schema_change, NULL)
+{
+	struct query_fixture *f = data;
+	uint64_t stmt_id;
+	uint64_t n;
+	const char *column;
+	struct value value;
+	(void)params;
+	EXEC("CREATE TABLE test2 (x INT)");
+	EXEC("INSERT INTO test2(x) VALUES(1)");
+	PREPARE("SELECT x FROM test2");
 
-	PREPARE("SELECT n FROM test");
 	f->request.db_id = 0;
 	f->request.stmt_id = stmt_id;
 	ENCODE(&f->request, query);
 	HANDLE(QUERY);
-	WAIT;
 	ASSERT_CALLBACK(0, ROWS);
+	uint64__decode(f->cursor, &n);
+	text__decode(f->cursor, &column);
+	DECODE_ROW(1, &value);
+	munit_assert_int(value.type, ==, SQLITE_INTEGER);
+
+	EXEC("DROP TABLE test2");
+	EXEC("CREATE TABLE test2 (x BOOLEAN)");
+	EXEC("INSERT INTO test2(x) VALUES(1)");
+
+	ENCODE(&f->request, query);
+	HANDLE(QUERY);
+	ASSERT_CALLBACK(0, ROWS);
+	uint64__decode(f->cursor, &n);
+	text__decode(f->cursor, &column);
+	DECODE_ROW(1, &value);
+	munit_assert_int(value.type, ==, DQLITE_BOOLEAN);
+	munit_assert_int(value.integer, ==, 1);
+
 	return MUNIT_OK;
 }
 
-/******************************************************************************
- *
- * finalize
- *
- ******************************************************************************/
+/* Decode a columnar batch header, checking the column count and the number of
+ * rows. */
+#define DECODE_COLUMNAR_HEADER(N_COLUMNS, N_ROWS)                \
+	{                                                        \
+		uint64_t n2;                                     \
+		const char *name2;                               \
+		unsigned i2;                                     \
+		uint64__decode(f->cursor, &n2);                  \
+		munit_assert_int(n2, ==, N_COLUMNS);             \
+		for (i2 = 0; i2 < N_COLUMNS; i2++) {             \
+			text__decode(f->cursor, &name2);         \
+		}                                                \
+		uint64__decode(f->cursor, &n2);                  \
+		munit_assert_int(n2, ==, N_ROWS);                \
+	}
 
-struct finalize_fixture
+/* Query results can be encoded column by column. */
+TEST_CASE(query, columnar, NULL)
 {
-	FIXTURE;
+	struct query_fixture *f = data;
+	uint64_t stmt_id;
+	uint64_t word;
+	int64_t integer;
+	uint64_t offset;
+	const char *text;
+	unsigned i;
+	(void)params;
+	EXEC("INSERT INTO test(n, data) VALUES(1, 'a')");
+	EXEC("INSERT INTO test(n, data) VALUES(NULL, 'bc')");
+	EXEC("INSERT INTO test(n, data) VALUES(3, NULL)");
+
+	PREPARE("SELECT n, data FROM test");
+	f->request.db_id = 0;
+	f->request.stmt_id = stmt_id;
+	ENCODE(&f->request, query);
+	f->handle->flags = DQLITE_MESSAGE_COLUMNAR;
+	HANDLE(QUERY);
+	ASSERT_CALLBACK(0, ROWS);
+	DECODE_COLUMNAR_HEADER(2, 3);
+
+	/* Integer column, with the second row being NULL. */
+	uint64__decode(f->cursor, &word);
+	munit_assert_int(word, ==, SQLITE_INTEGER);
+	uint64__decode(f->cursor, &word);
+	munit_assert_int(word, ==, 2);
+	for (i = 0; i < 3; i++) {
+		int64__decode(f->cursor, &integer);
+		munit_assert_int(integer, ==, i == 1 ? 0 : i + 1);
+	}
+
+	/* Text column, with the third row being NULL. */
+	uint64__decode(f->cursor, &word);
+	munit_assert_int(word, ==, SQLITE_TEXT);
+	uint64__decode(f->cursor, &word);
+	munit_assert_int(word, ==, 4);
+	uint64__decode(f->cursor, &offset);
+	munit_assert_int(offset, ==, 1);
+	uint64__decode(f->cursor, &offset);
+	munit_assert_int(offset, ==, 3);
+	uint64__decode(f->cursor, &offset);
+	munit_assert_int(offset, ==, 3);
+	text = f->cursor->p;
+	munit_assert_memory_equal(3, text, "abc");
+	f->cursor->p += 8;
+	f->cursor->cap -= 8;
+
+	DECODE(&f->response, rows);
+	munit_assert_ulong(f->response.eof, ==, DQLITE_RESPONSE_ROWS_DONE);
+
+	return MUNIT_OK;
+}
+
+/* Once the columnar capability is agreed on, queries use that format without
+ * the client setting the message flag. */
+TEST_CASE(query, columnar_capability, NULL)
+{
+	struct query_fixture *f = data;
+	struct request_capabilities capabilities;
+	struct response_capabilities agreed;
+	uint64_t stmt_id;
+	(void)params;
+	EXEC("INSERT INTO test(n, data) VALUES(1, 'a')");
+
+	capabilities.capabilities = DQLITE_CAPABILITIES;
+	ENCODE(&capabilities, capabilities);
+	HANDLE(CAPABILITIES);
+	ASSERT_CALLBACK(0, CAPABILITIES);
+	DECODE(&agreed, capabilities);
+	munit_assert_ulong(agreed.capabilities, ==, DQLITE_CAPABILITIES);
+
+	PREPARE("SELECT n, data FROM test");
+	f->request.db_id = 0;
+	f->request.stmt_id = stmt_id;
+	ENCODE(&f->request, query);
+	f->handle->flags = 0;
+	HANDLE(QUERY);
+	ASSERT_CALLBACK(0, ROWS);
+	munit_assert_true(f->handle->flags & DQLITE_MESSAGE_COLUMNAR);
+	DECODE_COLUMNAR_HEADER(2, 1);
+
+	return MUNIT_OK;
+}
+
+/* A value whose type differs from the one of the previous values of its column
+ * starts a new batch. */
+TEST_CASE(query, columnar_mismatch, NULL)
+{
+	struct query_fixture *f = data;
+	uint64_t stmt_id;
+	uint64_t word;
+	int64_t integer;
+	bool finished;
+	(void)params;
+	EXEC("INSERT INTO test(n, data) VALUES(1, 2)");
+	EXEC("INSERT INTO test(n, data) VALUES(3, 'x')");
+
+	PREPARE("SELECT n, data FROM test");
+	f->request.db_id = 0;
+	f->request.stmt_id = stmt_id;
+	ENCODE(&f->request, query);
+	f->handle->flags = DQLITE_MESSAGE_COLUMNAR;
+	HANDLE(QUERY);
+	ASSERT_CALLBACK(0, ROWS);
+	DECODE_COLUMNAR_HEADER(2, 1);
+	uint64__decode(f->cursor, &word);
+	munit_assert_int(word, ==, SQLITE_INTEGER);
+	uint64__decode(f->cursor, &word);
+	munit_assert_int(word, ==, 0);
+	int64__decode(f->cursor, &integer);
+	munit_assert_int(integer, ==, 1);
+	uint64__decode(f->cursor, &word);
+	munit_assert_int(word, ==, SQLITE_INTEGER);
+	uint64__decode(f->cursor, &word);
+	munit_assert_int(word, ==, 0);
+	int64__decode(f->cursor, &integer);
+	munit_assert_int(integer, ==, 2);
+	DECODE(&f->response, rows);
+	munit_assert_ulong(f->response.eof, ==, DQLITE_RESPONSE_ROWS_PART);
+
+	gateway__resume(f->gateway, f->buf2, &finished);
+	munit_assert_false(finished);
+	ASSERT_CALLBACK(0, ROWS);
+	DECODE_COLUMNAR_HEADER(2, 1);
+	uint64__decode(f->cursor, &word);
+	munit_assert_int(word, ==, SQLITE_INTEGER);
+	uint64__decode(f->cursor, &word);
+	int64__decode(f->cursor, &integer);
+	munit_assert_int(integer, ==, 3);
+	uint64__decode(f->cursor, &word);
+	munit_assert_int(word, ==, SQLITE_TEXT);
+	uint64__decode(f->cursor, &word);
+	uint64__decode(f->cursor, &word);
+	munit_assert_int(word, ==, 1);
+	f->cursor->p += 8;
+	f->cursor->cap -= 8;
+	DECODE(&f->response, rows);
+	munit_assert_ulong(f->response.eof, ==, DQLITE_RESPONSE_ROWS_DONE);
+
+	return MUNIT_OK;
+}
+
+/* Column buffers kept from a previous columnar query don't leak into the
+ * batches of the next one. */
+TEST_CASE(query, columnar_reuse, NULL)
+{
+	struct query_fixture *f = data;
+	uint64_t stmt_id;
+	uint64_t word;
+	int64_t integer;
+	(void)params;
+	EXEC("INSERT INTO test(n, data) VALUES(NULL, 'a')");
+	EXEC("INSERT INTO test(n, data) VALUES(2, 'b')");
+
+	PREPARE("SELECT n, data FROM test");
+	f->request.db_id = 0;
+	f->request.stmt_id = stmt_id;
+	ENCODE(&f->request, query);
+	f->handle->flags = DQLITE_MESSAGE_COLUMNAR;
+	HANDLE(QUERY);
+	ASSERT_CALLBACK(0, ROWS);
+	DECODE_COLUMNAR_HEADER(2, 2);
+
+	PREPARE("SELECT n FROM test WHERE n IS NOT NULL");
+	f->request.db_id = 0;
+	f->request.stmt_id = stmt_id;
+	ENCODE(&f->request, query);
+	f->handle->flags = DQLITE_MESSAGE_COLUMNAR;
+	HANDLE(QUERY);
+	ASSERT_CALLBACK(0, ROWS);
+	DECODE_COLUMNAR_HEADER(1, 1);
+	uint64__decode(f->cursor, &word);
+	munit_assert_int(word, ==, SQLITE_INTEGER);
+	uint64__decode(f->cursor, &word);
+	munit_assert_int(word, ==, 0);
+	int64__decode(f->cursor, &integer);
+	munit_assert_int(integer, ==, 2);
+	DECODE(&f->response, rows);
+	munit_assert_ulong(f->response.eof, ==, DQLITE_RESPONSE_ROWS_DONE);
+
+	return MUNIT_OK;
+}
+
+/* Perform a query using a prepared statement with parameters */
+TEST_CASE(query, params, NULL)
+{
+	struct query_fixture *f = data;
+	struct value values[2];
+	uint64_t stmt_id;
+	(void)params;
+	EXEC("BEGIN");
+	EXEC("INSERT INTO test(n) VALUES(1)");
+	EXEC("INSERT INTO test(n) VALUES(2)");
+	EXEC("INSERT INTO test(n) VALUES(3)");
+	EXEC("INSERT INTO test(n) VALUES(4)");
+	EXEC("COMMIT");
+
+	PREPARE("SELECT n FROM test WHERE n > ? AND n < ?");
+	f->request.db_id = 0;
+	f->request.stmt_id = stmt_id;
+
+	ENCODE(&f->request, query);
+	values[0].type = SQLITE_INTEGER;
+	values[0].integer = 1;
+	values[1].type = SQLITE_INTEGER;
+	values[1].integer = 4;
+	ENCODE_PARAMS(2, values);
+
+	HANDLE(QUERY);
+	ASSERT_CALLBACK(0, ROWS);
+	return MUNIT_OK;
+}
+
+/* Text parameters are bound without copying them, and don't outlive the
+ * request that bound them. */
+TEST_CASE(query, params_text, NULL)
+{
+	struct query_fixture *f = data;
+	struct value value;
+	uint64_t stmt_id;
+	uint64_t n;
+	const char *column;
+	(void)params;
+	PREPARE("SELECT ?");
+	f->request.db_id = 0;
+	f->request.stmt_id = stmt_id;
+
+	ENCODE(&f->request, query);
+	value.type = SQLITE_TEXT;
+	value.text = "hello";
+	ENCODE_PARAMS(1, &value);
+	HANDLE(QUERY);
+	ASSERT_CALLBACK(0, ROWS);
+	uint64__decode(f->cursor, &n);
+	text__decode(f->cursor, &column);
+	DECODE_ROW(1, &value);
+	munit_assert_int(value.type, ==, SQLITE_TEXT);
+	munit_assert_string_equal(value.text, "hello");
+
+	ENCODE(&f->request, query);
+	HANDLE(QUERY);
+	ASSERT_CALLBACK(0, ROWS);
+	uint64__decode(f->cursor, &n);
+	text__decode(f->cursor, &column);
+	DECODE_ROW(1, &value);
+	munit_assert_int(value.type, ==, SQLITE_NULL);
+
+	return MUNIT_OK;
+}
+
+/* A query running past its time budget is cut off. */
+TEST_CASE(query, time_budget, NULL)
+{
+	struct query_fixture *f = data;
+	uint64_t stmt_id;
+	(void)params;
+	OPTION(DQLITE_OPTION_TIME_BUDGET, 50);
+	PREPARE(
+	    "WITH RECURSIVE c(x) AS (SELECT 1 UNION ALL SELECT x+1 FROM c) "
+	    "SELECT count(*) FROM c");
+	f->request.db_id = 0;
+	f->request.stmt_id = stmt_id;
+	ENCODE(&f->request, query);
+	HANDLE(QUERY);
+	ASSERT_CALLBACK(0, FAILURE);
+	ASSERT_FAILURE(SQLITE_INTERRUPT,
+		       "query exceeded its time budget of 50 ms");
+	return MUNIT_OK;
+}
+
+/* Interrupt a large query. */
+TEST_CASE(query, interrupt, NULL)
+{
+	struct query_fixture *f = data;
+	struct request_interrupt interrupt;
+	unsigned i;
+	uint64_t stmt_id;
+	uint64_t n;
+	const char *column;
+	struct value value;
+	(void)params;
+	EXEC("BEGIN");
+	for (i = 0; i < 500; i++) {
+		EXEC("INSERT INTO test(n) VALUES(123)");
+	}
+	EXEC("COMMIT");
+	OPTION(DQLITE_OPTION_BATCH_BYTES, 4096);
+
+	PREPARE("SELECT n FROM test");
+	f->request.db_id = 0;
+	f->request.stmt_id = stmt_id;
+	ENCODE(&f->request, query);
+	HANDLE(QUERY);
+	ASSERT_CALLBACK(0, ROWS);
+
+	uint64__decode(f->cursor, &n);
+	munit_assert_int(n, ==, 1);
+	text__decode(f->cursor, &column);
+	munit_assert_string_equal(column, "n");
+
+	for (i = 0; i < 255; i++) {
+		DECODE_ROW(1, &value);
+		munit_assert_int(value.type, ==, SQLITE_INTEGER);
+		munit_assert_int(value.integer, ==, 123);
+	}
+
+	DECODE(&f->response, rows);
+	munit_assert_ulong(f->response.eof, ==, DQLITE_RESPONSE_ROWS_PART);
+
+	ENCODE(&interrupt, interrupt);
+	HANDLE(INTERRUPT);
+
+	ASSERT_CALLBACK(0, EMPTY);
+
+	return MUNIT_OK;
+}
+
+/* A query interrupted before its next batch is produced is dropped. */
+TEST_CASE(query, interrupt_early, NULL)
+{
+	struct query_fixture *f = data;
+	struct request_interrupt interrupt;
+	uint64_t stmt_id;
+	bool finished;
+	unsigned i;
+	(void)params;
+	EXEC("BEGIN");
+	for (i = 0; i < 500; i++) {
+		EXEC("INSERT INTO test(n) VALUES(123)");
+	}
+	EXEC("COMMIT");
+	OPTION(DQLITE_OPTION_BATCH_BYTES, 4096);
+
+	PREPARE("SELECT n FROM test");
+	f->request.db_id = 0;
+	f->request.stmt_id = stmt_id;
+	ENCODE(&f->request, query);
+	HANDLE(QUERY);
+	ASSERT_CALLBACK(0, ROWS);
+
+	gateway__interrupt(f->gateway);
+	f->context->invoked = false;
+	gateway__resume(f->gateway, f->buf2, &finished);
+	munit_assert_true(finished);
+	munit_assert_false(f->context->invoked);
+	munit_assert_ptr_null(f->gateway->stmt);
+
+	ENCODE(&interrupt, interrupt);
+	HANDLE(INTERRUPT);
+	ASSERT_CALLBACK(0, EMPTY);
+	munit_assert_false(f->gateway->interrupted);
+
+	return MUNIT_OK;
+}
+
+/* Interrupt a query whose rows are being produced by a reader thread. */
+TEST_CASE(query, interrupt_reading, NULL)
+{
+	struct query_fixture *f = data;
+	struct request_interrupt interrupt;
+	struct uv_loop_s loop;
+	struct readers readers;
+	uint64_t stmt_id;
+	int rv;
+	(void)params;
+	rv = uv_loop_init(&loop);
+	munit_assert_int(rv, ==, 0);
+	readers__init(&readers);
+	rv = readers__start(&readers, &loop, 1);
+	munit_assert_int(rv, ==, 0);
+	f->gateway->registry->readers = &readers;
+
+	PREPARE(
+	    "WITH RECURSIVE c(x) AS (SELECT 1 UNION ALL SELECT x+1 FROM c) "
+	    "SELECT count(*) FROM c");
+	f->request.db_id = 0;
+	f->request.stmt_id = stmt_id;
+	ENCODE(&f->request, query);
+	HANDLE(QUERY);
+	munit_assert_true(f->gateway->reading);
+
+	ENCODE(&interrupt, interrupt);
+	HANDLE(INTERRUPT);
+	ASSERT_CALLBACK(0, EMPTY);
+	munit_assert_false(f->gateway->reading);
+	munit_assert_false(f->gateway->leader->interrupted);
+
+	f->gateway->registry->readers = NULL;
+	readers__stop(&readers);
+	uv_run(&loop, UV_RUN_NOWAIT);
+	readers__close(&readers);
+	uv_loop_close(&loop);
+	return MUNIT_OK;
+}
+
+static void writeCb(struct exec *req, int status)
+{
+	bool *done = req->data;
+	munit_assert_int(status, ==, SQLITE_DONE);
+	*done = true;
+}
+
+/* Rows produced by a reader thread are the ones of the snapshot the query
+ * started from, even if the loop commits writes to the same database while the
+ * thread is stepping. */
+TEST_CASE(query, reading_concurrent_writes, NULL)
+{
+	struct query_fixture *f = data;
+	struct uv_loop_s loop;
+	struct readers readers;
+	struct leader writer;
+	struct exec exec;
+	sqlite3_stmt *stmt;
+	struct db *db;
+	uint64_t stmt_id;
+	uint64_t n;
+	const char *column;
+	struct value value;
+	bool finished;
+	bool done;
+	int64_t expected = 1;
+	unsigned batch;
+	unsigned i;
+	int rv;
+	(void)params;
+	EXEC("INSERT INTO test(n) WITH RECURSIVE c(x) AS "
+	     "(SELECT 1 UNION ALL SELECT x+1 FROM c LIMIT 95) SELECT x FROM c");
+	OPTION(DQLITE_OPTION_BATCH_ROWS, 10);
+
+	rv = uv_loop_init(&loop);
+	munit_assert_int(rv, ==, 0);
+	readers__init(&readers);
+	rv = readers__start(&readers, &loop, 1);
+	munit_assert_int(rv, ==, 0);
+	f->gateway->registry->readers = &readers;
+
+	rv = registry__db_get(CLUSTER_REGISTRY(0), "test", &db);
+	munit_assert_int(rv, ==, 0);
+	rv = leader__init(&writer, db, CLUSTER_RAFT(0));
+	munit_assert_int(rv, ==, 0);
+	rv = sqlite3_prepare_v2(writer.conn, "UPDATE test SET n = -n", -1,
+				&stmt, NULL);
+	munit_assert_int(rv, ==, 0);
+
+	PREPARE("SELECT n FROM test");
+	f->request.db_id = 0;
+	f->request.stmt_id = stmt_id;
+	ENCODE(&f->request, query);
+	HANDLE(QUERY);
+
+	/* The snapshot of the query is taken during the first batch, so only
+	 * write while producing the following ones. */
+	for (batch = 0;; batch++) {
+		munit_assert_true(f->gateway->reading);
+
+		if (batch > 0) {
+			/* Commit a write on the loop thread meanwhile. */
+			done = false;
+			exec.data = &done;
+			rv = leader__exec(&writer, &exec, stmt, writeCb);
+			munit_assert_int(rv, ==, 0);
+			for (i = 0; i < 60 && !done; i++) {
+				CLUSTER_STEP;
+			}
+			munit_assert_true(done);
+			sqlite3_reset(stmt);
+		}
+
+		WAIT_READER(&loop);
+		ASSERT_CALLBACK(0, ROWS);
+		uint64__decode(f->cursor, &n);
+		munit_assert_int(n, ==, 1);
+		text__decode(f->cursor, &column);
+		for (i = 0; i < (batch < 9 ? 10u : 5u); i++) {
+			DECODE_ROW(1, &value);
+			munit_assert_int(value.integer, ==, expected);
+			expected++;
+		}
+		DECODE(&f->response, rows);
+		if (f->response.eof == DQLITE_RESPONSE_ROWS_DONE) {
+			break;
+		}
+		gateway__resume(f->gateway, f->buf2, &finished);
+		munit_assert_false(finished);
+	}
+	munit_assert_int(expected, ==, 96);
+
+	sqlite3_finalize(stmt);
+	leader__close(&writer);
+	f->gateway->registry->readers = NULL;
+	readers__stop(&readers);
+	uv_run(&loop, UV_RUN_NOWAIT);
+	readers__close(&readers);
+	uv_loop_close(&loop);
+	return MUNIT_OK;
+}
+
+/* Restoring a snapshot fails a query that a reader thread is running against
+ * the same database, instead of waiting for it to finish. */
+TEST_CASE(query, reading_restore, NULL)
+{
+	struct query_fixture *f = data;
+	struct uv_loop_s loop;
+	struct readers readers;
+	uint64_t stmt_id;
+	int rv;
+	(void)params;
+	rv = uv_loop_init(&loop);
+	munit_assert_int(rv, ==, 0);
+	readers__init(&readers);
+	rv = readers__start(&readers, &loop, 1);
+	munit_assert_int(rv, ==, 0);
+	f->gateway->registry->readers = &readers;
+
+	PREPARE(
+	    "WITH RECURSIVE c(x) AS (SELECT 1 UNION ALL SELECT x+1 FROM c) "
+	    "SELECT count(*) FROM c");
+	f->request.db_id = 0;
+	f->request.stmt_id = stmt_id;
+	ENCODE(&f->request, query);
+	HANDLE(QUERY);
+	munit_assert_true(f->gateway->reading);
+
+	RESTORE;
+	WAIT_READER(&loop);
+	ASSERT_CALLBACK(0, FAILURE);
+	ASSERT_FAILURE(SQLITE_INTERRUPT, "interrupted");
+	munit_assert_false(f->gateway->leader->interrupted);
+	munit_assert_false(f->gateway->leader->reading);
+
+	f->gateway->registry->readers = NULL;
+	readers__stop(&readers);
+	uv_run(&loop, UV_RUN_NOWAIT);
+	readers__close(&readers);
+	uv_loop_close(&loop);
+	return MUNIT_OK;
+}
+
+/* Restoring a snapshot fails a query that is waiting for a reader thread,
+ * instead of letting it run over the rewritten files. */
+TEST_CASE(query, pending_restore, NULL)
+{
+	struct query_fixture *f = data;
+	struct uv_loop_s loop;
+	struct readers readers;
+	uint64_t stmt_id;
+	int rv;
+	(void)params;
+	EXEC("INSERT INTO test(n) VALUES(1)");
+	rv = uv_loop_init(&loop);
+	munit_assert_int(rv, ==, 0);
+	readers__init(&readers);
+	rv = readers__start(&readers, &loop, 1);
+	munit_assert_int(rv, ==, 0);
+	f->gateway->registry->readers = &readers;
+
+	/* Hold the query in the pending queue until the restore is done. */
+	readers__pause(&readers);
+	PREPARE("SELECT n FROM test");
+	f->request.db_id = 0;
+	f->request.stmt_id = stmt_id;
+	ENCODE(&f->request, query);
+	HANDLE(QUERY);
+	munit_assert_true(f->gateway->reading);
+
+	RESTORE;
+	WAIT_READER(&loop);
+	ASSERT_CALLBACK(0, FAILURE);
+	ASSERT_FAILURE(SQLITE_INTERRUPT, "interrupted");
+	munit_assert_false(f->gateway->leader->interrupted);
+
+	f->gateway->registry->readers = NULL;
+	readers__stop(&readers);
+	uv_run(&loop, UV_RUN_NOWAIT);
+	readers__close(&readers);
+	uv_loop_close(&loop);
+	return MUNIT_OK;
+}
+
+/* Submit a query request right after the server has been re-elected and needs
+ * to catch up with logs. */
+TEST_CASE(query, barrier, NULL)
+{
+	struct query_fixture *f = data;
+	uint64_t stmt_id;
+	(void)params;
+
+	PREPARE("INSERT INTO test(n) VALUES(1)");
+	EXEC_SUBMIT(stmt_id);
+	CLUSTER_DEPOSE;
+	ASSERT_CALLBACK(0, FAILURE);
+
+	/* Re-elect ourselves and issue a query request */
+	CLUSTER_ELECT(0);
+
+	PREPARE("SELECT n FROM test");
+	f->request.db_id = 0;
+	f->request.stmt_id = stmt_id;
+	ENCODE(&f->request, query);
+	HANDLE(QUERY);
+	WAIT;
+	ASSERT_CALLBACK(0, ROWS);
+	return MUNIT_OK;
+}
+
+/******************************************************************************
+ *
+ * finalize
+ *
+ ******************************************************************************/
+
+struct finalize_fixture
+{
+	FIXTURE;
 	struct request_finalize request;
 	struct response_empty response;
 };
 
-TEST_SUITE(finalize);
-TEST_SETUP(finalize)
+TEST_SUITE(finalize);
+TEST_SETUP(finalize)
+{
+	struct finalize_fixture *f = munit_malloc(sizeof *f);
+	SETUP;
+	OPEN;
+	return f;
+}
+TEST_TEAR_DOWN(finalize)
+{
+	struct finalize_fixture *f = data;
+	TEAR_DOWN;
+	free(f);
+}
+
+/* Finalize a prepared statement. */
+TEST_CASE(finalize, success, NULL)
+{
+	uint64_t stmt_id;
+	struct finalize_fixture *f = data;
+	(void)params;
+	PREPARE("CREATE TABLE test (n INT)");
+	f->request.db_id = 0;
+	f->request.stmt_id = stmt_id;
+	ENCODE(&f->request, finalize);
+	HANDLE(FINALIZE);
+	ASSERT_CALLBACK(0, EMPTY);
+	return MUNIT_OK;
+}
+
+/******************************************************************************
+ *
+ * exec_sql
+ *
+ ******************************************************************************/
+
+struct exec_sql_fixture
+{
+	FIXTURE;
+	struct request_exec_sql request;
+	struct response_result response;
+};
+
+TEST_SUITE(exec_sql);
+TEST_SETUP(exec_sql)
+{
+	struct exec_sql_fixture *f = munit_malloc(sizeof *f);
+	SETUP;
+	CLUSTER_ELECT(0);
+	OPEN;
+	return f;
+}
+TEST_TEAR_DOWN(exec_sql)
+{
+	struct exec_sql_fixture *f = data;
+	TEAR_DOWN;
+	free(f);
+}
+
+/* Exec a SQL text with a single query. */
+TEST_CASE(exec_sql, single, NULL)
+{
+	struct exec_sql_fixture *f = data;
+	(void)params;
+	f->request.db_id = 0;
+	f->request.sql = "CREATE TABLE test (n INT)";
+	ENCODE(&f->request, exec_sql);
+	HANDLE(EXEC_SQL);
+	CLUSTER_APPLIED(3);
+	ASSERT_CALLBACK(0, RESULT);
+	return MUNIT_OK;
+}
+
+/* Exec a SQL text with a multiple queries. */
+TEST_CASE(exec_sql, multi, NULL)
+{
+	struct exec_sql_fixture *f = data;
+	(void)params;
+	f->request.db_id = 0;
+	f->request.sql =
+	    "CREATE TABLE test (n INT); INSERT INTO test VALUES(1)";
+	ENCODE(&f->request, exec_sql);
+	HANDLE(EXEC_SQL);
+	WAIT;
+	ASSERT_CALLBACK(0, RESULT);
+	return MUNIT_OK;
+}
+
+/* Statements prepared from SQL text are cached and reused. */
+TEST_CASE(exec_sql, cached, NULL)
+{
+	struct exec_sql_fixture *f = data;
+	struct stmt_cache *cache = &f->gateway->leader->cache;
+	(void)params;
+	EXEC_SQL_SUBMIT("CREATE TABLE test (n INT)");
+	WAIT;
+	ASSERT_CALLBACK(0, RESULT);
+	EXEC_SQL_SUBMIT("INSERT INTO test VALUES(1)");
+	WAIT;
+	ASSERT_CALLBACK(0, RESULT);
+	EXEC_SQL_SUBMIT("INSERT INTO test VALUES(1)");
+	WAIT;
+	ASSERT_CALLBACK(0, RESULT);
+	munit_assert_int(cache->misses, ==, 2);
+	munit_assert_int(cache->hits, ==, 1);
+	munit_assert_int(cache->n, ==, 2);
+	return MUNIT_OK;
+}
+
+/******************************************************************************
+ *
+ * query_sql
+ *
+ ******************************************************************************/
+
+struct query_sql_fixture
+{
+	FIXTURE;
+	struct request_query_sql request;
+	struct response_rows response;
+};
+
+TEST_SUITE(query_sql);
+TEST_SETUP(query_sql)
+{
+	struct query_sql_fixture *f = munit_malloc(sizeof *f);
+	SETUP;
+	CLUSTER_ELECT(0);
+	OPEN;
+	EXEC("CREATE TABLE test (n INT)");
+	return f;
+}
+TEST_TEAR_DOWN(query_sql)
+{
+	struct query_sql_fixture *f = data;
+	TEAR_DOWN;
+	free(f);
+}
+
+/* Exec a SQL query whose result set fits in a page. */
+TEST_CASE(query_sql, small, NULL)
+{
+	struct query_sql_fixture *f = data;
+	(void)params;
+	EXEC("INSERT INTO test VALUES(123)");
+	f->request.db_id = 0;
+	f->request.sql = "SELECT n FROM test";
+	ENCODE(&f->request, query_sql);
+	HANDLE(QUERY_SQL);
+	ASSERT_CALLBACK(0, ROWS);
+	return MUNIT_OK;
+}
+
+/* Perform a query with parameters */
+TEST_CASE(query_sql, params, NULL)
+{
+	struct query_sql_fixture *f = data;
+	struct value values[2];
+	(void)params;
+	EXEC("BEGIN");
+	EXEC("INSERT INTO test(n) VALUES(1)");
+	EXEC("INSERT INTO test(n) VALUES(2)");
+	EXEC("INSERT INTO test(n) VALUES(3)");
+	EXEC("INSERT INTO test(n) VALUES(4)");
+	EXEC("COMMIT");
+
+	f->request.db_id = 0;
+	f->request.sql = "SELECT n FROM test WHERE n > ? AND n < ?";
+	ENCODE(&f->request, query_sql);
+	values[0].type = SQLITE_INTEGER;
+	values[0].integer = 1;
+	values[1].type = SQLITE_INTEGER;
+	values[1].integer = 4;
+	ENCODE_PARAMS(2, values);
+
+	HANDLE(QUERY_SQL);
+	ASSERT_CALLBACK(0, ROWS);
+	return MUNIT_OK;
+}
+
+/* Running the same SQL query twice reuses the cached statement. */
+TEST_CASE(query_sql, cached, NULL)
+{
+	struct query_sql_fixture *f = data;
+	struct stmt_cache *cache = &f->gateway->leader->cache;
+	unsigned long long hits = cache->hits;
+	(void)params;
+	f->request.db_id = 0;
+	f->request.sql = "SELECT n FROM test";
+	ENCODE(&f->request, query_sql);
+	HANDLE(QUERY_SQL);
+	ASSERT_CALLBACK(0, ROWS);
+	ENCODE(&f->request, query_sql);
+	HANDLE(QUERY_SQL);
+	ASSERT_CALLBACK(0, ROWS);
+	munit_assert_int(cache->hits, ==, hits + 1);
+	return MUNIT_OK;
+}
+
+/******************************************************************************
+ *
+ * query_sql_stale
+ *
+ ******************************************************************************/
+
+struct query_sql_stale_fixture
+{
+	FIXTURE;
+	struct request_query_sql_stale request;
+	struct response_rows response;
+};
+
+TEST_SUITE(query_sql_stale);
+TEST_SETUP(query_sql_stale)
 {
-	struct finalize_fixture *f = munit_malloc(sizeof *f);
+	struct query_sql_stale_fixture *f = munit_malloc(sizeof *f);
 	SETUP;
+	CLUSTER_ELECT(0);
+	OPEN;
+	EXEC("CREATE TABLE test (n INT)");
+	EXEC("INSERT INTO test VALUES(123)");
+	CLUSTER_APPLIED(CLUSTER_LAST_INDEX(0));
+	SELECT(1);
 	OPEN;
 	return f;
 }
-TEST_TEAR_DOWN(finalize)
+TEST_TEAR_DOWN(query_sql_stale)
 {
-	struct finalize_fixture *f = data;
+	struct query_sql_stale_fixture *f = data;
 	TEAR_DOWN;
 	free(f);
 }
 
-/* Finalize a prepared statement. */
-TEST_CASE(finalize, success, NULL)
+/* A follower that has applied the requested index serves the query. */
+TEST_CASE(query_sql_stale, follower, NULL)
 {
-	uint64_t stmt_id;
-	struct finalize_fixture *f = data;
+	struct query_sql_stale_fixture *f = data;
+	uint64_t n;
+	const char *column;
+	struct value value;
 	(void)params;
-	PREPARE("CREATE TABLE test (n INT)");
 	f->request.db_id = 0;
-	f->request.stmt_id = stmt_id;
-	ENCODE(&f->request, finalize);
-	HANDLE(FINALIZE);
-	ASSERT_CALLBACK(0, EMPTY);
+	f->request.min_index = CLUSTER_LAST_INDEX(0);
+	f->request.sql = "SELECT n FROM test";
+	ENCODE(&f->request, query_sql_stale);
+	HANDLE(QUERY_SQL_STALE);
+	ASSERT_CALLBACK(0, ROWS);
+	uint64__decode(f->cursor, &n);
+	munit_assert_int(n, ==, 1);
+	text__decode(f->cursor, &column);
+	munit_assert_string_equal(column, "n");
+	DECODE_ROW(1, &value);
+	munit_assert_int(value.type, ==, SQLITE_INTEGER);
+	munit_assert_int(value.integer, ==, 123);
+	DECODE(&f->response, rows);
+	munit_assert_ulong(f->response.eof, ==, DQLITE_RESPONSE_ROWS_DONE);
+	return MUNIT_OK;
+}
+
+/* A follower that is behind the requested index rejects the query. */
+TEST_CASE(query_sql_stale, behind, NULL)
+{
+	struct query_sql_stale_fixture *f = data;
+	char message[128];
+	(void)params;
+	f->request.db_id = 0;
+	f->request.min_index = CLUSTER_LAST_INDEX(0) + 1;
+	f->request.sql = "SELECT n FROM test";
+	ENCODE(&f->request, query_sql_stale);
+	HANDLE(QUERY_SQL_STALE);
+	ASSERT_CALLBACK(0, FAILURE);
+	sprintf(message, "applied index %llu is behind %llu",
+		(unsigned long long)raft_last_applied(CLUSTER_RAFT(1)),
+		(unsigned long long)f->request.min_index);
+	ASSERT_FAILURE(SQLITE_BUSY, message);
+	return MUNIT_OK;
+}
+
+/* Only read-only statements are accepted. */
+TEST_CASE(query_sql_stale, not_readonly, NULL)
+{
+	struct query_sql_stale_fixture *f = data;
+	(void)params;
+	f->request.db_id = 0;
+	f->request.min_index = 0;
+	f->request.sql = "INSERT INTO test VALUES(1)";
+	ENCODE(&f->request, query_sql_stale);
+	HANDLE(QUERY_SQL_STALE);
+	ASSERT_CALLBACK(0, FAILURE);
+	ASSERT_FAILURE(SQLITE_READONLY, "statement is not read-only");
 	return MUNIT_OK;
 }
 
 /******************************************************************************
  *
- * exec_sql
+ * batch
  *
  ******************************************************************************/
 
-struct exec_sql_fixture
+struct batch_fixture
 {
 	FIXTURE;
-	struct request_exec_sql request;
-	struct response_result response;
+	struct request_batch request;
+	struct response_results response;
 };
 
-TEST_SUITE(exec_sql);
-TEST_SETUP(exec_sql)
+TEST_SUITE(batch);
+TEST_SETUP(batch)
 {
-	struct exec_sql_fixture *f = munit_malloc(sizeof *f);
+	struct batch_fixture *f = munit_malloc(sizeof *f);
 	SETUP;
 	CLUSTER_ELECT(0);
 	OPEN;
+	EXEC("CREATE TABLE test (n INT)");
 	return f;
 }
-TEST_TEAR_DOWN(exec_sql)
+TEST_TEAR_DOWN(batch)
 {
-	struct exec_sql_fixture *f = data;
+	struct batch_fixture *f = data;
 	TEAR_DOWN;
 	free(f);
 }
 
-/* Exec a SQL text with a single query. */
-TEST_CASE(exec_sql, single, NULL)
+/* Append a batch item to the request payload. */
+#define ENCODE_ITEM(STMT_ID, SQL)                                \
+	{                                                        \
+		struct request_batch_item item;                  \
+		void *cursor;                                    \
+		item.stmt_id = STMT_ID;                          \
+		item.sql = SQL;                                  \
+		cursor = buffer__advance(                        \
+		    f->buf1, request_batch_item__sizeof(&item)); \
+		munit_assert_ptr_not_null(cursor);               \
+		request_batch_item__encode(&item, &cursor);      \
+	}
+
+/* Run prepared and SQL text statements in one transaction. */
+TEST_CASE(batch, mixed, NULL)
 {
-	struct exec_sql_fixture *f = data;
+	struct batch_fixture *f = data;
+	struct response_result result;
+	struct value value;
+	uint64_t stmt_id;
+	raft_index index = CLUSTER_LAST_INDEX(0);
 	(void)params;
+	PREPARE("INSERT INTO test VALUES (?)");
 	f->request.db_id = 0;
-	f->request.sql = "CREATE TABLE test (n INT)";
-	ENCODE(&f->request, exec_sql);
-	HANDLE(EXEC_SQL);
-	CLUSTER_APPLIED(3);
-	ASSERT_CALLBACK(0, RESULT);
+	f->request.n = 3;
+	ENCODE(&f->request, batch);
+	value.type = SQLITE_INTEGER;
+	value.integer = 1;
+	ENCODE_ITEM(stmt_id, "");
+	ENCODE_PARAMS(1, &value);
+	value.integer = 2;
+	ENCODE_ITEM(0, "INSERT INTO test VALUES (?)");
+	ENCODE_PARAMS(1, &value);
+	ENCODE_ITEM(0, "UPDATE test SET n = n + 1");
+	ENCODE_PARAMS(0, &value);
+	HANDLE(BATCH);
+	WAIT;
+	ASSERT_CALLBACK(0, RESULTS);
+	DECODE(&f->response, results);
+	munit_assert_int(f->response.n, ==, 3);
+	DECODE(&result, result);
+	munit_assert_int(result.last_insert_id, ==, 1);
+	munit_assert_int(result.rows_affected, ==, 1);
+	DECODE(&result, result);
+	munit_assert_int(result.last_insert_id, ==, 2);
+	munit_assert_int(result.rows_affected, ==, 1);
+	DECODE(&result, result);
+	munit_assert_int(result.rows_affected, ==, 2);
+
+	/* A single frames command was needed. */
+	munit_assert_int(CLUSTER_LAST_INDEX(0), ==, index + 1);
 	return MUNIT_OK;
 }
 
-/* Exec a SQL text with a multiple queries. */
-TEST_CASE(exec_sql, multi, NULL)
+/* The first failing statement aborts the whole batch. */
+TEST_CASE(batch, error, NULL)
 {
-	struct exec_sql_fixture *f = data;
+	struct batch_fixture *f = data;
+	struct value value;
+	raft_index index = CLUSTER_LAST_INDEX(0);
 	(void)params;
 	f->request.db_id = 0;
-	f->request.sql =
-	    "CREATE TABLE test (n INT); INSERT INTO test VALUES(1)";
-	ENCODE(&f->request, exec_sql);
-	HANDLE(EXEC_SQL);
+	f->request.n = 2;
+	ENCODE(&f->request, batch);
+	value.type = SQLITE_INTEGER;
+	value.integer = 1;
+	ENCODE_ITEM(0, "INSERT INTO test VALUES (?)");
+	ENCODE_PARAMS(1, &value);
+	ENCODE_ITEM(0, "INSERT INTO missing VALUES (?)");
+	ENCODE_PARAMS(1, &value);
+	HANDLE(BATCH);
 	WAIT;
-	ASSERT_CALLBACK(0, RESULT);
+	ASSERT_CALLBACK(0, FAILURE);
+	ASSERT_FAILURE(SQLITE_ERROR, "statement 1: no such table: missing");
+	munit_assert_int(CLUSTER_LAST_INDEX(0), ==, index);
+	munit_assert_true(sqlite3_get_autocommit(f->gateway->leader->conn));
+	return MUNIT_OK;
+}
+
+/* Statements ending the transaction wrapping the batch are refused, and
+ * nothing gets replicated. */
+TEST_CASE(batch, tx_control, NULL)
+{
+	struct batch_fixture *f = data;
+	struct value value;
+	raft_index index = CLUSTER_LAST_INDEX(0);
+	(void)params;
+	f->request.db_id = 0;
+	f->request.n = 3;
+	ENCODE(&f->request, batch);
+	value.type = SQLITE_INTEGER;
+	value.integer = 1;
+	ENCODE_ITEM(0, "INSERT INTO test VALUES (?)");
+	ENCODE_PARAMS(1, &value);
+	ENCODE_ITEM(0, "/* done */ commit");
+	ENCODE_PARAMS(0, &value);
+	ENCODE_ITEM(0, "INSERT INTO test VALUES (?)");
+	ENCODE_PARAMS(1, &value);
+	HANDLE(BATCH);
+	WAIT;
+	ASSERT_CALLBACK(0, FAILURE);
+	ASSERT_FAILURE(SQLITE_MISUSE,
+		       "statement 1: transaction control statement");
+	munit_assert_int(CLUSTER_LAST_INDEX(0), ==, index);
+	munit_assert_true(sqlite3_get_autocommit(f->gateway->leader->conn));
+	return MUNIT_OK;
+}
+
+/* The same goes for savepoints, which could undo part of the batch. */
+TEST_CASE(batch, savepoint, NULL)
+{
+	struct batch_fixture *f = data;
+	struct value value;
+	raft_index index = CLUSTER_LAST_INDEX(0);
+	(void)params;
+	f->request.db_id = 0;
+	f->request.n = 3;
+	ENCODE(&f->request, batch);
+	value.type = SQLITE_INTEGER;
+	value.integer = 1;
+	ENCODE_ITEM(0, "INSERT INTO test VALUES (?)");
+	ENCODE_PARAMS(1, &value);
+	ENCODE_ITEM(0, "SAVEPOINT sp");
+	ENCODE_PARAMS(0, &value);
+	ENCODE_ITEM(0, "RELEASE sp");
+	ENCODE_PARAMS(0, &value);
+	HANDLE(BATCH);
+	WAIT;
+	ASSERT_CALLBACK(0, FAILURE);
+	ASSERT_FAILURE(SQLITE_MISUSE,
+		       "statement 1: transaction control statement");
+	munit_assert_int(CLUSTER_LAST_INDEX(0), ==, index);
+	munit_assert_true(sqlite3_get_autocommit(f->gateway->leader->conn));
+	return MUNIT_OK;
+}
+
+/* Failing to bind parameters reports the SQLite error. */
+TEST_CASE(batch, bind_error, NULL)
+{
+	struct batch_fixture *f = data;
+	struct value values[2];
+	(void)params;
+	f->request.db_id = 0;
+	f->request.n = 1;
+	ENCODE(&f->request, batch);
+	values[0].type = SQLITE_INTEGER;
+	values[0].integer = 1;
+	values[1] = values[0];
+	ENCODE_ITEM(0, "INSERT INTO test VALUES (?)");
+	ENCODE_PARAMS(2, values);
+	HANDLE(BATCH);
+	WAIT;
+	ASSERT_CALLBACK(0, FAILURE);
+	ASSERT_FAILURE(SQLITE_RANGE, "statement 0: column index out of range");
 	return MUNIT_OK;
 }
 
 /******************************************************************************
  *
- * query_sql
+ * dump
  *
  ******************************************************************************/
 
-struct query_sql_fixture
+struct dump_fixture
 {
 	FIXTURE;
-	struct request_query_sql request;
-	struct response_rows response;
+	struct request_dump request;
+	struct response_chunk response;
 };
 
-TEST_SUITE(query_sql);
-TEST_SETUP(query_sql)
+TEST_SUITE(dump);
+TEST_SETUP(dump)
 {
-	struct query_sql_fixture *f = munit_malloc(sizeof *f);
+	struct dump_fixture *f = munit_malloc(sizeof *f);
+	SETUP;
+	CLUSTER_ELECT(0);
+	OPEN;
+	EXEC("CREATE TABLE test (b BLOB)");
+	EXEC("INSERT INTO test VALUES(zeroblob(100000))");
+	return f;
+}
+TEST_TEAR_DOWN(dump)
+{
+	struct dump_fixture *f = data;
+	TEAR_DOWN;
+	free(f);
+}
+
+/* Decode a chunk response and skip over its content, saving the trailing
+ * marker in eof. */
+#define DECODE_CHUNK                                             \
+	DECODE(&f->response, chunk);                             \
+	munit_assert_ulong(f->response.len, <=, f->cursor->cap); \
+	f->cursor->p += f->response.len;                         \
+	f->cursor->cap -= f->response.len;                       \
+	uint64__decode(f->cursor, &eof)
+
+/* With the chunked flag set, files are streamed in parts of bounded size, each
+ * continuing where the previous one stopped. */
+TEST_CASE(dump, chunked, NULL)
+{
+	struct dump_fixture *f = data;
+	struct db *db;
+	uint64_t eof;
+	uint64_t offset = 0;
+	unsigned n = 0;
+	bool finished;
+	(void)params;
+	f->gateway->config->dump_chunk_bytes = 0; /* Use the minimum */
+	f->request.filename = "test";
+	ENCODE(&f->request, dump);
+	f->handle->flags = DQLITE_MESSAGE_CHUNKED;
+	HANDLE(DUMP);
+	db = f->gateway->dump.db;
+	munit_assert_ptr_not_null(db);
+	munit_assert_int(db->n_dumps, ==, 1);
+	while (1) {
+		ASSERT_CALLBACK(0, CHUNK);
+		DECODE_CHUNK;
+		n++;
+		munit_assert_ulong(f->response.offset, ==, offset);
+		offset += f->response.len;
+		if (offset == f->response.size) {
+			offset = 0;
+		}
+		if (eof == DQLITE_RESPONSE_ROWS_DONE) {
+			break;
+		}
+		munit_assert_ulong(eof, ==, DQLITE_RESPONSE_ROWS_PART);
+		gateway__resume(f->gateway, f->buf2, &finished);
+		munit_assert_false(finished);
+	}
+
+	/* The WAL didn't fit in a single chunk. */
+	munit_assert_string_equal(f->response.filename, "test-wal");
+	munit_assert_int(n, >, 2);
+	munit_assert_int(db->n_dumps, ==, 0);
+
+	gateway__resume(f->gateway, f->buf2, &finished);
+	munit_assert_true(finished);
+	return MUNIT_OK;
+}
+
+/* A streamed dump can be interrupted. */
+TEST_CASE(dump, interrupt, NULL)
+{
+	struct dump_fixture *f = data;
+	struct request_interrupt interrupt;
+	struct db *db;
+	uint64_t eof;
+	(void)params;
+	f->gateway->config->dump_chunk_bytes = 0;
+	f->request.filename = "test";
+	ENCODE(&f->request, dump);
+	f->handle->flags = DQLITE_MESSAGE_CHUNKED;
+	HANDLE(DUMP);
+	db = f->gateway->dump.db;
+	ASSERT_CALLBACK(0, CHUNK);
+	DECODE_CHUNK;
+	munit_assert_ulong(eof, ==, DQLITE_RESPONSE_ROWS_PART);
+
+	f->handle->flags = 0;
+	interrupt.db_id = 0;
+	ENCODE(&interrupt, interrupt);
+	HANDLE(INTERRUPT);
+	ASSERT_CALLBACK(0, EMPTY);
+	munit_assert_int(db->n_dumps, ==, 0);
+	munit_assert_ptr_null(f->gateway->req);
+	return MUNIT_OK;
+}
+
+/* A dump abandoned by its client holds off checkpoints only until it times
+ * out, and then fails. */
+TEST_CASE(dump, timeout, NULL)
+{
+	struct dump_fixture *f = data;
+	struct db *db;
+	uint64_t eof;
+	bool finished;
+	(void)params;
+	f->gateway->config->dump_chunk_bytes = 0;
+	f->gateway->config->checkpoint_threshold = 1;
+	f->request.filename = "test";
+	ENCODE(&f->request, dump);
+	f->handle->flags = DQLITE_MESSAGE_CHUNKED;
+	HANDLE(DUMP);
+	db = f->gateway->dump.db;
+	ASSERT_CALLBACK(0, CHUNK);
+	DECODE_CHUNK;
+	munit_assert_ulong(eof, ==, DQLITE_RESPONSE_ROWS_PART);
+
+	checkpoint__maybe(db, CLUSTER_RAFT(0));
+	munit_assert_false(db->checkpoint.pending);
+
+	/* Pretend that the client stopped reading long enough ago. */
+	f->gateway->config->dump_timeout = 1;
+	db->dumps_since = metrics__now() - 2 * 1000 * 1000;
+	checkpoint__maybe(db, CLUSTER_RAFT(0));
+	munit_assert_true(db->checkpoint.pending);
+	munit_assert_int(db->n_dumps, ==, 0);
+
+	gateway__resume(f->gateway, f->buf2, &finished);
+	munit_assert_false(finished);
+	ASSERT_CALLBACK(0, FAILURE);
+	ASSERT_FAILURE(SQLITE_ABORT, "failed to dump database");
+	munit_assert_int(db->n_dumps, ==, 0);
+	munit_assert_ptr_null(f->gateway->req);
+	CLUSTER_APPLIED(CLUSTER_LAST_INDEX(0));
+	return MUNIT_OK;
+}
+
+/******************************************************************************
+ *
+ * metrics
+ *
+ ******************************************************************************/
+
+struct metrics_fixture
+{
+	FIXTURE;
+	struct request_metrics request;
+	struct response_metrics response;
+};
+
+TEST_SUITE(metrics);
+TEST_SETUP(metrics)
+{
+	struct metrics_fixture *f = munit_malloc(sizeof *f);
 	SETUP;
 	CLUSTER_ELECT(0);
 	OPEN;
 	EXEC("CREATE TABLE test (n INT)");
 	return f;
 }
-TEST_TEAR_DOWN(query_sql)
+TEST_TEAR_DOWN(metrics)
 {
-	struct query_sql_fixture *f = data;
+	struct metrics_fixture *f = data;
 	TEAR_DOWN;
 	free(f);
 }
 
-/* Exec a SQL query whose result set fits in a page. */
-TEST_CASE(query_sql, small, NULL)
+/* The node counters are followed by the ones of each request type handled. */
+TEST_CASE(metrics, success, NULL)
 {
-	struct query_sql_fixture *f = data;
+	struct metrics_fixture *f = data;
+	uint64_t values[4];
+	unsigned i;
+	unsigned j;
+	bool exec = false;
 	(void)params;
-	EXEC("INSERT INTO test VALUES(123)");
-	f->request.db_id = 0;
-	f->request.sql = "SELECT n FROM test";
-	ENCODE(&f->request, query_sql);
-	HANDLE(QUERY_SQL);
-	ASSERT_CALLBACK(0, ROWS);
+	ENCODE(&f->request, metrics);
+	HANDLE(METRICS);
+	ASSERT_CALLBACK(0, METRICS);
+	DECODE(&f->response, metrics);
+	munit_assert_int(f->response.databases, ==, 1);
+	munit_assert_int(f->response.applies, >=, 1);
+	munit_assert_int(f->response.last_applied, ==, CLUSTER_LAST_INDEX(0));
+
+	/* OPEN, PREPARE, EXEC, FINALIZE and METRICS itself. */
+	munit_assert_int(f->response.n, ==, 5);
+	for (i = 0; i < f->response.n; i++) {
+		for (j = 0; j < 4; j++) {
+			uint64__decode(f->cursor, &values[j]);
+		}
+		munit_assert_int(values[1], >=, 1);
+		munit_assert_int(values[2], ==, 0);
+		if (values[0] == DQLITE_REQUEST_EXEC) {
+			exec = true;
+		}
+	}
+	munit_assert_true(exec);
 	return MUNIT_OK;
 }
 
-/* Perform a query with parameters */
-TEST_CASE(query_sql, params, NULL)
+/******************************************************************************
+ *
+ * trace
+ *
+ ******************************************************************************/
+
+struct trace_fixture
 {
-	struct query_sql_fixture *f = data;
-	struct value values[2];
+	FIXTURE;
+	struct tracer tracer;
+	dqlite_trace_span spans[8];
+	unsigned n;
+};
+
+/* Move the spans recorded so far to the fixture. */
+#define DRAIN f->n = tracer__drain(&f->tracer, f->spans, 8)
+
+TEST_SUITE(trace);
+TEST_SETUP(trace)
+{
+	struct trace_fixture *f = munit_malloc(sizeof *f);
+	SETUP;
+	CLUSTER_ELECT(0);
+	OPEN;
+	tracer__init(&f->tracer);
+	rc = tracer__setup(&f->tracer, 1, 8);
+	munit_assert_int(rc, ==, 0);
+	f->gateway->registry->tracer = &f->tracer;
+	return f;
+}
+TEST_TEAR_DOWN(trace)
+{
+	struct trace_fixture *f = data;
+	TEAR_DOWN;
+	tracer__close(&f->tracer);
+	free(f);
+}
+
+/* A write goes through every stage but the barrier, in order. */
+TEST_CASE(trace, exec, NULL)
+{
+	struct trace_fixture *f = data;
+	dqlite_trace_span *span;
+	int stages[] = {DQLITE_TRACE_HANDLE,     DQLITE_TRACE_STEP,
+			DQLITE_TRACE_APPLY,      DQLITE_TRACE_APPLY_DONE,
+			DQLITE_TRACE_STEP_DONE,  DQLITE_TRACE_RESPOND,
+			DQLITE_TRACE_WRITE};
+	unsigned i;
 	(void)params;
-	EXEC("BEGIN");
-	EXEC("INSERT INTO test(n) VALUES(1)");
-	EXEC("INSERT INTO test(n) VALUES(2)");
-	EXEC("INSERT INTO test(n) VALUES(3)");
-	EXEC("INSERT INTO test(n) VALUES(4)");
-	EXEC("COMMIT");
+	EXEC("CREATE TABLE test (n INT)");
+	DRAIN;
+
+	/* PREPARE, EXEC and FINALIZE. */
+	munit_assert_int(f->n, ==, 3);
+	span = &f->spans[1];
+	munit_assert_int(span->type, ==, DQLITE_REQUEST_EXEC);
+	munit_assert_ullong(span->id, ==, f->spans[0].id + 1);
+	munit_assert_false(span->failed);
+	munit_assert_int(span->steps, ==, 1);
+	munit_assert_int(span->applies, >=, 1);
+	for (i = 1; i < sizeof stages / sizeof *stages; i++) {
+		munit_assert_ullong(span->stamps[stages[i]], >=,
+				    span->stamps[stages[i - 1]]);
+	}
+	munit_assert_ullong(span->stamps[DQLITE_TRACE_HANDLE], >, 0);
 
-	f->request.db_id = 0;
-	f->request.sql = "SELECT n FROM test WHERE n > ? AND n < ?";
-	ENCODE(&f->request, query_sql);
-	values[0].type = SQLITE_INTEGER;
-	values[0].integer = 1;
-	values[1].type = SQLITE_INTEGER;
-	values[1].integer = 4;
-	ENCODE_PARAMS(2, values);
+	/* Spans are moved out of the ring. */
+	DRAIN;
+	munit_assert_int(f->n, ==, 0);
+	return MUNIT_OK;
+}
 
-	HANDLE(QUERY_SQL);
-	ASSERT_CALLBACK(0, ROWS);
+/* Failed requests are traced too. */
+TEST_CASE(trace, failure, NULL)
+{
+	struct trace_fixture *f = data;
+	struct request_prepare prepare;
+	(void)params;
+	prepare.db_id = 0;
+	prepare.sql = "FOO";
+	ENCODE(&prepare, prepare);
+	HANDLE(PREPARE);
+	ASSERT_CALLBACK(0, FAILURE);
+	DRAIN;
+	munit_assert_int(f->n, ==, 1);
+	munit_assert_int(f->spans[0].type, ==, DQLITE_REQUEST_PREPARE);
+	munit_assert_true(f->spans[0].failed);
+	munit_assert_ullong(f->spans[0].stamps[DQLITE_TRACE_STEP], ==, 0);
+	munit_assert_ullong(f->spans[0].stamps[DQLITE_TRACE_WRITE], >, 0);
 	return MUNIT_OK;
 }
@@ -0,0 +1,45 @@
+#include "../lib/runner.h"
+
+#include "../../src/metrics.h"
+
+TEST_MODULE(metrics);
+
+/******************************************************************************
+ *
+ * metrics__observe
+ *
+ ******************************************************************************/
+
+TEST_SUITE(observe);
+
+/* Each observation lands in the first bucket whose bound is above it. */
+TEST_CASE(observe, buckets, NULL)
+{
+	struct dqlite_histogram h;
+	(void)data;
+	(void)params;
+	memset(&h, 0, sizeof h);
+	metrics__observe(&h, 500);         /* 0us */
+	metrics__observe(&h, 1000);        /* 1us */
+	metrics__observe(&h, 3000);        /* 3us */
+	metrics__observe(&h, 1000 * 1000); /* 1000us */
+	munit_assert_int(h.count, ==, 4);
+	munit_assert_int(h.sum, ==, 1004);
+	munit_assert_int(h.buckets[0], ==, 1);
+	munit_assert_int(h.buckets[1], ==, 1);
+	munit_assert_int(h.buckets[2], ==, 1);
+	munit_assert_int(h.buckets[10], ==, 1);
+	return MUNIT_OK;
+}
+
+/* Observations above the last bound land in the last bucket. */
+TEST_CASE(observe, overflow, NULL)
+{
+	struct dqlite_histogram h;
+	(void)data;
+	(void)params;
+	memset(&h, 0, sizeof h);
+	metrics__observe(&h, UINT64_C(3600) * 1000 * 1000 * 1000);
+	munit_assert_int(h.buckets[DQLITE_HISTOGRAM_BUCKETS - 1], ==, 1);
+	return MUNIT_OK;
+}
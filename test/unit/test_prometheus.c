@@ -0,0 +1,265 @@
+#include <arpa/inet.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "../lib/heap.h"
+#include "../lib/runner.h"
+#include "../lib/sqlite.h"
+#include "../lib/uv.h"
+
+#include "../../src/command.h"
+#include "../../src/prometheus.h"
+#include "../../src/protocol.h"
+
+TEST_MODULE(prometheus);
+
+/******************************************************************************
+ *
+ * prometheus__format
+ *
+ ******************************************************************************/
+
+struct fixture
+{
+	dqlite_node_metrics metrics;
+	struct buffer buffer;
+	char *text;
+};
+
+static void *setUp(const MunitParameter params[], void *user_data)
+{
+	struct fixture *f = munit_malloc(sizeof *f);
+	int rv;
+	(void)params;
+	(void)user_data;
+	memset(&f->metrics, 0, sizeof f->metrics);
+	rv = buffer__init(&f->buffer);
+	munit_assert_int(rv, ==, 0);
+	f->text = NULL;
+	return f;
+}
+
+static void tearDown(void *data)
+{
+	struct fixture *f = data;
+	free(f->text);
+	buffer__close(&f->buffer);
+	free(f);
+}
+
+/* Format the fixture metrics and save them as a NULL-terminated string. */
+#define FORMAT                                                      \
+	{                                                           \
+		size_t n_;                                          \
+		int rv_;                                            \
+		rv_ = prometheus__format(&f->metrics, &f->buffer);  \
+		munit_assert_int(rv_, ==, 0);                       \
+		n_ = buffer__offset(&f->buffer);                    \
+		f->text = munit_malloc(n_ + 1);                     \
+		memcpy(f->text, buffer__cursor(&f->buffer, 0), n_); \
+		f->text[n_] = 0;                                    \
+	}
+
+#define ASSERT_LINE(LINE) munit_assert_not_null(strstr(f->text, LINE "\n"))
+
+TEST_SUITE(format);
+TEST_SETUP(format, setUp);
+TEST_TEAR_DOWN(format, tearDown);
+
+/* Per-type samples are labeled with the name of the type. */
+TEST_CASE(format, requests, NULL)
+{
+	struct fixture *f = data;
+	(void)params;
+	f->metrics.requests[DQLITE_REQUEST_QUERY] = 3;
+	f->metrics.request_failures[DQLITE_REQUEST_QUERY] = 1;
+	f->metrics.request_latency[DQLITE_REQUEST_QUERY].count = 3;
+	f->metrics.request_latency[DQLITE_REQUEST_QUERY].sum = 1500000;
+	f->metrics.request_latency[DQLITE_REQUEST_QUERY].buckets[1] = 2;
+	f->metrics.request_latency[DQLITE_REQUEST_QUERY].buckets[3] = 1;
+	FORMAT;
+	ASSERT_LINE("dqlite_requests_total{type=\"query\"} 3");
+	ASSERT_LINE("dqlite_request_failures_total{type=\"query\"} 1");
+	ASSERT_LINE(
+	    "dqlite_request_duration_seconds_bucket{type=\"query\",le=\"1e-06\"}"
+	    " 0");
+	ASSERT_LINE(
+	    "dqlite_request_duration_seconds_bucket{type=\"query\",le=\"2e-06\"}"
+	    " 2");
+	ASSERT_LINE(
+	    "dqlite_request_duration_seconds_bucket{type=\"query\",le=\"+Inf\"}"
+	    " 3");
+	ASSERT_LINE("dqlite_request_duration_seconds_sum{type=\"query\"} 1.500000");
+	ASSERT_LINE("dqlite_request_duration_seconds_count{type=\"query\"} 3");
+
+	/* Types never handled are left out. */
+	munit_assert_null(strstr(f->text, "type=\"exec\""));
+	return MUNIT_OK;
+}
+
+/* Node-wide counters and gauges have no labels. */
+TEST_CASE(format, node, NULL)
+{
+	struct fixture *f = data;
+	(void)params;
+	f->metrics.connections = 2;
+	f->metrics.last_index = 42;
+	f->metrics.commands[COMMAND_FRAMES] = 7;
+	FORMAT;
+	ASSERT_LINE("# TYPE dqlite_connections gauge");
+	ASSERT_LINE("dqlite_connections 2");
+	ASSERT_LINE("dqlite_raft_last_index 42");
+	ASSERT_LINE("dqlite_fsm_commands_total{command=\"frames\"} 7");
+	ASSERT_LINE("dqlite_raft_apply_duration_seconds_count 0");
+	return MUNIT_OK;
+}
+
+/******************************************************************************
+ *
+ * prometheus__start
+ *
+ ******************************************************************************/
+
+struct serve_fixture
+{
+	struct uv_loop_s loop;
+	struct prometheus prometheus;
+	int fd;             /* Client socket */
+	char response[65536]; /* Response read by the client */
+	size_t n;             /* Size of the response read so far */
+};
+
+static void collectCb(void *data, dqlite_node_metrics *m)
+{
+	(void)data;
+	memset(m, 0, sizeof *m);
+	m->connections = 3;
+}
+
+/* Read what the server sent so far, and return true once it closed the
+ * connection. */
+static bool isClosed(struct serve_fixture *f)
+{
+	char buf[4096];
+	ssize_t n;
+	while (1) {
+		n = recv(f->fd, buf, sizeof buf, MSG_DONTWAIT);
+		if (n <= 0) {
+			return n == 0;
+		}
+		if (f->n + (size_t)n >= sizeof f->response) {
+			n = (ssize_t)(sizeof f->response - 1 - f->n);
+		}
+		memcpy(f->response + f->n, buf, (size_t)n);
+		f->n += (size_t)n;
+		f->response[f->n] = 0;
+	}
+}
+
+/* Send the given request text to the server. */
+#define SEND(TEXT)                                          \
+	{                                                   \
+		ssize_t n_ = write(f->fd, TEXT, strlen(TEXT)); \
+		munit_assert_int(n_, ==, strlen(TEXT));     \
+	}
+
+/* Run the loop until the server closes the client connection. */
+#define WAIT_CLOSED test_uv_run_until(f, isClosed)
+
+TEST_SUITE(serve);
+
+TEST_SETUP(serve)
+{
+	struct serve_fixture *f = munit_malloc(sizeof *f);
+	struct sockaddr_in addr;
+	int len = sizeof addr;
+	int rv;
+	SETUP_HEAP;
+	SETUP_SQLITE;
+	test_uv_setup(params, &f->loop);
+
+	memset(&addr, 0, sizeof addr);
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = 0;
+	rv = prometheus__start(&f->prometheus, &f->loop,
+			       (struct sockaddr *)&addr, 50, collectCb, NULL);
+	munit_assert_int(rv, ==, 0);
+	rv = uv_tcp_getsockname(&f->prometheus.listener,
+				(struct sockaddr *)&addr, &len);
+	munit_assert_int(rv, ==, 0);
+
+	f->fd = socket(AF_INET, SOCK_STREAM, 0);
+	munit_assert_int(f->fd, >=, 0);
+	rv = connect(f->fd, (struct sockaddr *)&addr, sizeof addr);
+	munit_assert_int(rv, ==, 0);
+	f->response[0] = 0;
+	f->n = 0;
+	return f;
+}
+
+TEST_TEAR_DOWN(serve)
+{
+	struct serve_fixture *f = data;
+	close(f->fd);
+	prometheus__stop(&f->prometheus);
+	test_uv_stop(&f->loop);
+	test_uv_tear_down(&f->loop);
+	TEAR_DOWN_SQLITE;
+	TEAR_DOWN_HEAP;
+	free(f);
+}
+
+/* A GET request for /metrics gets the metrics. */
+TEST_CASE(serve, metrics, NULL)
+{
+	struct serve_fixture *f = data;
+	(void)params;
+	SEND("GET /metrics HTTP/1.0\r\n\r\n");
+	WAIT_CLOSED;
+	munit_assert_ptr_equal(strstr(f->response, "HTTP/1.0 200 OK\r\n"),
+			       f->response);
+	munit_assert_not_null(strstr(f->response, "\ndqlite_connections 3\n"));
+	return MUNIT_OK;
+}
+
+/* Other paths are not found. */
+TEST_CASE(serve, not_found, NULL)
+{
+	struct serve_fixture *f = data;
+	(void)params;
+	SEND("GET /metricsx HTTP/1.0\r\n\r\n");
+	WAIT_CLOSED;
+	munit_assert_string_equal(f->response,
+				  "HTTP/1.0 404 Not Found\r\n"
+				  "Content-Length: 0\r\n\r\n");
+	return MUNIT_OK;
+}
+
+/* Other methods are not allowed. */
+TEST_CASE(serve, not_allowed, NULL)
+{
+	struct serve_fixture *f = data;
+	(void)params;
+	SEND("POST /metrics HTTP/1.0\r\nContent-Length: 0\r\n\r\n");
+	WAIT_CLOSED;
+	munit_assert_string_equal(f->response,
+				  "HTTP/1.0 405 Method Not Allowed\r\n"
+				  "Allow: GET\r\n"
+				  "Content-Length: 0\r\n\r\n");
+	return MUNIT_OK;
+}
+
+/* A client that doesn't complete its request is disconnected once the
+ * timeout expires. */
+TEST_CASE(serve, idle, NULL)
+{
+	struct serve_fixture *f = data;
+	(void)params;
+	SEND("GET /met");
+	WAIT_CLOSED;
+	munit_assert_int(f->n, ==, 0);
+	munit_assert_true(QUEUE__IS_EMPTY(&f->prometheus.scrapes));
+	return MUNIT_OK;
+}
@@ -0,0 +1,168 @@
+#include <uv.h>
+
+#include "../lib/heap.h"
+#include "../lib/runner.h"
+#include "../lib/sqlite.h"
+#include "../lib/uv.h"
+
+#include "../../src/readers.h"
+
+/******************************************************************************
+ *
+ * Fixture
+ *
+ ******************************************************************************/
+
+struct fixture
+{
+	struct uv_loop_s loop;
+	struct readers readers;
+	struct reader_work work;
+	pthread_t thread; /* Thread that ran the work */
+	bool done;        /* Whether the done callback was invoked */
+};
+
+static void workCb(struct reader_work *w)
+{
+	struct fixture *f = w->data;
+	f->thread = pthread_self();
+}
+
+static void doneCb(struct reader_work *w)
+{
+	struct fixture *f = w->data;
+	f->done = true;
+}
+
+static bool isDone(struct fixture *f)
+{
+	return f->done;
+}
+
+static void *setUp(const MunitParameter params[], void *user_data)
+{
+	struct fixture *f = munit_malloc(sizeof *f);
+	int rv;
+	SETUP_HEAP;
+	SETUP_SQLITE;
+	test_uv_setup(params, &f->loop);
+	readers__init(&f->readers);
+	rv = readers__start(&f->readers, &f->loop, 2);
+	munit_assert_int(rv, ==, 0);
+	f->work.data = f;
+	f->work.work = workCb;
+	f->work.done = doneCb;
+	f->work.state = READER_WORK_IDLE;
+	f->work.readers = NULL;
+	f->thread = pthread_self();
+	f->done = false;
+	return f;
+}
+
+static void tearDown(void *data)
+{
+	struct fixture *f = data;
+	readers__stop(&f->readers);
+	readers__close(&f->readers);
+	test_uv_stop(&f->loop);
+	test_uv_tear_down(&f->loop);
+	TEAR_DOWN_SQLITE;
+	TEAR_DOWN_HEAP;
+	free(f);
+}
+
+/******************************************************************************
+ *
+ * readers__submit
+ *
+ ******************************************************************************/
+
+SUITE(readers__submit)
+
+/* Work runs on a reader thread, and its done callback on the loop thread. */
+TEST(readers__submit, success, setUp, tearDown, 0, NULL)
+{
+	struct fixture *f = data;
+	pthread_t loop_thread = pthread_self();
+	readers__submit(&f->readers, &f->work);
+	test_uv_run_until(f, isDone);
+	munit_assert_false(pthread_equal(f->thread, loop_thread));
+	munit_assert_int(f->work.state, ==, READER_WORK_IDLE);
+	return MUNIT_OK;
+}
+
+/* Work can be submitted again once done. */
+TEST(readers__submit, again, setUp, tearDown, 0, NULL)
+{
+	struct fixture *f = data;
+	readers__submit(&f->readers, &f->work);
+	test_uv_run_until(f, isDone);
+	f->done = false;
+	readers__submit(&f->readers, &f->work);
+	test_uv_run_until(f, isDone);
+	return MUNIT_OK;
+}
+
+/******************************************************************************
+ *
+ * readers__cancel
+ *
+ ******************************************************************************/
+
+SUITE(readers__cancel)
+
+/* Cancelled work never gets its done callback invoked. */
+TEST(readers__cancel, success, setUp, tearDown, 0, NULL)
+{
+	struct fixture *f = data;
+	readers__submit(&f->readers, &f->work);
+	readers__cancel(&f->work);
+	munit_assert_int(f->work.state, ==, READER_WORK_IDLE);
+	uv_run(&f->loop, UV_RUN_NOWAIT);
+	munit_assert_false(f->done);
+	return MUNIT_OK;
+}
+
+/* Cancelling work that was never submitted is a no-op. */
+TEST(readers__cancel, idle, setUp, tearDown, 0, NULL)
+{
+	struct fixture *f = data;
+	readers__cancel(&f->work);
+	munit_assert_int(f->work.state, ==, READER_WORK_IDLE);
+	return MUNIT_OK;
+}
+
+/******************************************************************************
+ *
+ * readers__pause
+ *
+ ******************************************************************************/
+
+SUITE(readers__pause)
+
+/* Work submitted while paused stays pending until resumed. */
+TEST(readers__pause, success, setUp, tearDown, 0, NULL)
+{
+	struct fixture *f = data;
+	readers__pause(&f->readers);
+	readers__submit(&f->readers, &f->work);
+	uv_run(&f->loop, UV_RUN_NOWAIT);
+	munit_assert_false(f->done);
+	munit_assert_int(f->work.state, ==, READER_WORK_PENDING);
+	readers__resume(&f->readers);
+	test_uv_run_until(f, isDone);
+	munit_assert_int(f->work.state, ==, READER_WORK_IDLE);
+	return MUNIT_OK;
+}
+
+/* Pausing waits for running work to finish. */
+TEST(readers__pause, running, setUp, tearDown, 0, NULL)
+{
+	struct fixture *f = data;
+	readers__submit(&f->readers, &f->work);
+	readers__pause(&f->readers);
+	munit_assert_int(f->work.state, !=, READER_WORK_RUNNING);
+	readers__resume(&f->readers);
+	test_uv_run_until(f, isDone);
+	return MUNIT_OK;
+}
@@ -1,6 +1,7 @@
 #include "../lib/cluster.h"
 #include "../lib/runner.h"
 
+#include "../../src/checkpoint.h"
 #include "../../src/format.h"
 #include "../../src/leader.h"
 
@@ -250,6 +251,24 @@ TEST_CASE(exec, snapshot_busy, NULL)
 	return MUNIT_OK;
 }
 
+/* Frames whose size exceeds the configured limit are split across several
+ * commands. */
+TEST_CASE(exec, frames_split, NULL)
+{
+	struct exec_fixture *f = data;
+	struct config *config = CLUSTER_CONFIG(0);
+	raft_index index;
+	(void)params;
+	config->frames_max_size = 512;
+	CLUSTER_ELECT(0);
+	index = CLUSTER_LAST_INDEX(0);
+	EXEC_SQL(0, "CREATE TABLE test (n  INT)");
+	/* One Open command plus one Frames command for each of the 2 pages. */
+	munit_assert_int(CLUSTER_LAST_INDEX(0), ==, index + 3);
+	ASSERT_WAL_PAGES(1, 2);
+	return MUNIT_OK;
+}
+
 /* If the WAL size grows beyond the configured threshold, checkpoint it. */
 TEST_CASE(exec, checkpoint, NULL)
 {
@@ -303,6 +322,215 @@ TEST_CASE(exec, checkpoint_read_lock, NULL)
 	return MUNIT_OK;
 }
 
+/* A checkpoint postponed because of a read transaction is retried once the
+ * read transaction is over. */
+TEST_CASE(exec, checkpoint_retry, NULL)
+{
+	struct exec_fixture *f = data;
+	struct config *config = CLUSTER_CONFIG(0);
+	struct registry *registry = CLUSTER_REGISTRY(0);
+	struct db *db;
+	struct leader leader2;
+	char *errmsg;
+	int rv;
+	(void)params;
+	config->checkpoint_threshold = 3;
+
+	CLUSTER_ELECT(0);
+	EXEC_SQL(0, "CREATE TABLE test (n  INT)");
+
+	rv = registry__db_get(registry, "test.db", &db);
+	munit_assert_int(rv, ==, 0);
+	leader__init(&leader2, db, CLUSTER_RAFT(0));
+
+	rv = sqlite3_exec(leader2.conn, "BEGIN", NULL, NULL, &errmsg);
+	munit_assert_int(rv, ==, 0);
+
+	rv = sqlite3_exec(leader2.conn, "SELECT * FROM test", NULL, NULL, &errmsg);
+	munit_assert_int(rv, ==, 0);
+
+	EXEC_SQL(0, "INSERT INTO test(n) VALUES(1)");
+	ASSERT_WAL_PAGES(0, 3);
+	munit_assert_int(db->checkpoint.n_busy, ==, 1);
+
+	/* End the read transaction and retry. */
+	rv = sqlite3_exec(leader2.conn, "COMMIT", NULL, NULL, &errmsg);
+	munit_assert_int(rv, ==, 0);
+	checkpoint__maybe(db, CLUSTER_RAFT(0));
+	CLUSTER_APPLIED(CLUSTER_LAST_INDEX(0));
+
+	ASSERT_WAL_PAGES(0, 0);
+	munit_assert_int(db->checkpoint.n, ==, 1);
+
+	leader__close(&leader2);
+
+	return MUNIT_OK;
+}
+
+/* If the WAL grows past the hard limit, new write transactions are refused. */
+TEST_CASE(exec, checkpoint_max, NULL)
+{
+	struct exec_fixture *f = data;
+	struct config *config = CLUSTER_CONFIG(0);
+	(void)params;
+	config->checkpoint_max = 3;
+	CLUSTER_ELECT(0);
+	EXEC_SQL(0, "CREATE TABLE test (n  INT)");
+	EXEC_SQL(0, "INSERT INTO test(n) VALUES(1)");
+	PREPARE(0, "INSERT INTO test(n) VALUES(2)");
+	f->invoked = false;
+	EXEC(0);
+	munit_assert_true(f->invoked);
+	munit_assert_int(f->status, ==, SQLITE_BUSY);
+	RESET(SQLITE_BUSY);
+	FINALIZE;
+	return MUNIT_OK;
+}
+
+/* Once a checkpoint is applied, writes are not refused because of the size of
+ * the WAL anymore, without waiting for the next tick. */
+TEST_CASE(exec, checkpoint_max_lifted, NULL)
+{
+	struct exec_fixture *f = data;
+	struct config *config = CLUSTER_CONFIG(0);
+	struct registry *registry = CLUSTER_REGISTRY(0);
+	struct db *db;
+	int rv;
+	(void)params;
+	config->checkpoint_threshold = 3;
+	config->checkpoint_max = 3;
+	CLUSTER_ELECT(0);
+	EXEC_SQL(0, "CREATE TABLE test (n  INT)");
+	EXEC_SQL(0, "INSERT INTO test(n) VALUES(1)");
+	ASSERT_WAL_PAGES(0, 0);
+	rv = registry__db_get(registry, "test.db", &db);
+	munit_assert_int(rv, ==, 0);
+	munit_assert_int(db->checkpoint.n, ==, 1);
+	munit_assert_int(db->checkpoint.wal_pages, ==, 0);
+	munit_assert_false(checkpoint__over_limit(db));
+	EXEC_SQL(0, "INSERT INTO test(n) VALUES(2)");
+	return MUNIT_OK;
+}
+
+/* If too many log entries are waiting to be applied, new write transactions
+ * are refused until the pipeline drains. */
+TEST_CASE(exec, overloaded, NULL)
+{
+	struct exec_fixture *f = data;
+	struct config *config = CLUSTER_CONFIG(0);
+	struct registry *registry = CLUSTER_REGISTRY(0);
+	const struct admission *admission;
+	struct db *db;
+	struct leader leader2;
+	struct exec req2;
+	sqlite3_stmt *stmt2;
+	int rv;
+	(void)params;
+	config->max_backlog = 1;
+	admission = replication__admission(&f->servers[0].replication);
+
+	CLUSTER_ELECT(0);
+	EXEC_SQL(0, "CREATE TABLE test (n  INT)");
+
+	rv = registry__db_get(registry, "test.db", &db);
+	munit_assert_int(rv, ==, 0);
+	leader__init(&leader2, db, CLUSTER_RAFT(0));
+
+	/* Start a write on the first leader, without completing it. */
+	PREPARE(0, "INSERT INTO test(n) VALUES(1)");
+	f->invoked = false;
+	EXEC(0);
+	munit_assert_false(f->invoked);
+	munit_assert_int(admission->applies, ==, 1);
+
+	/* A write on the second leader gets refused. */
+	rv = sqlite3_prepare_v2(leader2.conn, "INSERT INTO test(n) VALUES(2)",
+				-1, &stmt2, NULL);
+	munit_assert_int(rv, ==, 0);
+	rv = leader__exec(&leader2, &req2, stmt2, NULL);
+	munit_assert_int(rv, ==, 0);
+	munit_assert_true(req2.done);
+	munit_assert_int(req2.status, ==, DQLITE_OVERLOADED);
+	munit_assert_int(admission->shed, ==, 1);
+	sqlite3_finalize(stmt2);
+
+	CLUSTER_APPLIED(CLUSTER_LAST_INDEX(0));
+	munit_assert_true(f->invoked);
+	munit_assert_int(f->status, ==, SQLITE_DONE);
+	munit_assert_int(admission->applies, ==, 0);
+	FINALIZE;
+
+	leader__close(&leader2);
+
+	return MUNIT_OK;
+}
+
+static void barrierCb(struct raft_barrier *req, int status)
+{
+	(void)req;
+	(void)status;
+}
+
+/* Writes are shed with the default limits, once requests of other connections
+ * pile up in the log. */
+TEST_CASE(exec, overloaded_default, NULL)
+{
+	struct exec_fixture *f = data;
+	struct config *config = CLUSTER_CONFIG(0);
+	struct registry *registry = CLUSTER_REGISTRY(0);
+	const struct admission *admission;
+	struct raft_barrier *barriers;
+	struct db *db;
+	struct leader leader2;
+	struct exec req2;
+	sqlite3_stmt *stmt2;
+	unsigned i;
+	int rv;
+	(void)params;
+	munit_assert_int(config->max_backlog, >, 1);
+	admission = replication__admission(&f->servers[0].replication);
+
+	CLUSTER_ELECT(0);
+	EXEC_SQL(0, "CREATE TABLE test (n  INT)");
+
+	rv = registry__db_get(registry, "test.db", &db);
+	munit_assert_int(rv, ==, 0);
+	leader__init(&leader2, db, CLUSTER_RAFT(0));
+
+	/* Start a write on the first leader, and queue barriers of other
+	 * requests behind it. */
+	PREPARE(0, "INSERT INTO test(n) VALUES(1)");
+	f->invoked = false;
+	EXEC(0);
+	munit_assert_false(f->invoked);
+	barriers = munit_malloc(config->max_backlog * sizeof *barriers);
+	for (i = 0; i < config->max_backlog - 1; i++) {
+		rv = raft_barrier(CLUSTER_RAFT(0), &barriers[i], barrierCb);
+		munit_assert_int(rv, ==, 0);
+	}
+
+	/* A write on the second leader gets refused. */
+	rv = sqlite3_prepare_v2(leader2.conn, "INSERT INTO test(n) VALUES(2)",
+				-1, &stmt2, NULL);
+	munit_assert_int(rv, ==, 0);
+	rv = leader__exec(&leader2, &req2, stmt2, NULL);
+	munit_assert_int(rv, ==, 0);
+	munit_assert_true(req2.done);
+	munit_assert_int(req2.status, ==, DQLITE_OVERLOADED);
+	munit_assert_int(admission->shed, ==, 1);
+	sqlite3_finalize(stmt2);
+
+	CLUSTER_APPLIED(CLUSTER_LAST_INDEX(0));
+	munit_assert_true(f->invoked);
+	munit_assert_int(f->status, ==, SQLITE_DONE);
+	FINALIZE;
+
+	leader__close(&leader2);
+	free(barriers);
+
+	return MUNIT_OK;
+}
+
 TEST_GROUP(exec, error);
 
 /* The local server is not the leader. */
@@ -0,0 +1,161 @@
+#include "../lib/runner.h"
+
+#include "../../src/protocol.h"
+#include "../../src/trace.h"
+
+TEST_MODULE(trace);
+
+/******************************************************************************
+ *
+ * Fixture
+ *
+ ******************************************************************************/
+
+struct fixture
+{
+	struct tracer tracer;
+	struct trace trace;
+	dqlite_trace_span spans[8];
+};
+
+static void *setUp(const MunitParameter params[], void *user_data)
+{
+	struct fixture *f = munit_malloc(sizeof *f);
+	(void)params;
+	(void)user_data;
+	tracer__init(&f->tracer);
+	f->trace.on = false;
+	return f;
+}
+
+static void tearDown(void *data)
+{
+	struct fixture *f = data;
+	tracer__close(&f->tracer);
+	free(f);
+}
+
+/* Start and finish tracing a request of the given type. */
+#define TRACE(TYPE)                                                  \
+	tracer__start(&f->tracer, &f->trace, DQLITE_REQUEST_##TYPE); \
+	trace__stamp(&f->trace, DQLITE_TRACE_RESPOND);               \
+	tracer__finish(&f->tracer, &f->trace)
+
+#define SETUP_TRACER(SAMPLE, CAPACITY)                             \
+	{                                                          \
+		int rv_;                                           \
+		rv_ = tracer__setup(&f->tracer, SAMPLE, CAPACITY); \
+		munit_assert_int(rv_, ==, 0);                      \
+	}
+
+/******************************************************************************
+ *
+ * tracer__start
+ *
+ ******************************************************************************/
+
+TEST_SUITE(start);
+TEST_SETUP(start, setUp);
+TEST_TEAR_DOWN(start, tearDown);
+
+/* Without any sampling, nothing is traced. */
+TEST_CASE(start, disabled, NULL)
+{
+	struct fixture *f = data;
+	(void)params;
+	tracer__start(&f->tracer, &f->trace, DQLITE_REQUEST_EXEC);
+	munit_assert_false(f->trace.on);
+	trace__stamp(&f->trace, DQLITE_TRACE_STEP);
+	munit_assert_false(f->trace.on);
+	return MUNIT_OK;
+}
+
+/* One request every sample is traced. */
+TEST_CASE(start, sample, NULL)
+{
+	struct fixture *f = data;
+	unsigned n;
+	(void)params;
+	SETUP_TRACER(3, 8);
+	TRACE(QUERY);
+	TRACE(EXEC);
+	TRACE(PREPARE);
+	TRACE(QUERY);
+	n = tracer__drain(&f->tracer, f->spans, 8);
+	munit_assert_int(n, ==, 1);
+	munit_assert_ullong(f->spans[0].id, ==, 3);
+	munit_assert_int(f->spans[0].type, ==, DQLITE_REQUEST_PREPARE);
+	munit_assert_ullong(f->spans[0].stamps[DQLITE_TRACE_HANDLE], >, 0);
+	munit_assert_ullong(f->spans[0].stamps[DQLITE_TRACE_RESPOND], >=,
+			    f->spans[0].stamps[DQLITE_TRACE_HANDLE]);
+	return MUNIT_OK;
+}
+
+/* Steps and raft commands are counted. */
+TEST_CASE(start, counts, NULL)
+{
+	struct fixture *f = data;
+	unsigned n;
+	(void)params;
+	SETUP_TRACER(1, 8);
+	tracer__start(&f->tracer, &f->trace, DQLITE_REQUEST_EXEC_BULK);
+	trace__stamp(&f->trace, DQLITE_TRACE_STEP);
+	trace__stamp(&f->trace, DQLITE_TRACE_APPLY);
+	trace__stamp(&f->trace, DQLITE_TRACE_STEP);
+	trace__stamp(&f->trace, DQLITE_TRACE_APPLY);
+	trace__stamp(&f->trace, DQLITE_TRACE_APPLY);
+	tracer__finish(&f->tracer, &f->trace);
+	munit_assert_false(f->trace.on);
+	n = tracer__drain(&f->tracer, f->spans, 8);
+	munit_assert_int(n, ==, 1);
+	munit_assert_int(f->spans[0].steps, ==, 2);
+	munit_assert_int(f->spans[0].applies, ==, 3);
+	return MUNIT_OK;
+}
+
+/******************************************************************************
+ *
+ * tracer__drain
+ *
+ ******************************************************************************/
+
+TEST_SUITE(drain);
+TEST_SETUP(drain, setUp);
+TEST_TEAR_DOWN(drain, tearDown);
+
+/* Spans are drained oldest first, up to the given number. */
+TEST_CASE(drain, partial, NULL)
+{
+	struct fixture *f = data;
+	unsigned n;
+	(void)params;
+	SETUP_TRACER(1, 8);
+	TRACE(QUERY);
+	TRACE(EXEC);
+	TRACE(PREPARE);
+	n = tracer__drain(&f->tracer, f->spans, 2);
+	munit_assert_int(n, ==, 2);
+	munit_assert_int(f->spans[0].type, ==, DQLITE_REQUEST_QUERY);
+	munit_assert_int(f->spans[1].type, ==, DQLITE_REQUEST_EXEC);
+	n = tracer__drain(&f->tracer, f->spans, 8);
+	munit_assert_int(n, ==, 1);
+	munit_assert_int(f->spans[0].type, ==, DQLITE_REQUEST_PREPARE);
+	return MUNIT_OK;
+}
+
+/* When the ring is full, the oldest spans are overwritten. */
+TEST_CASE(drain, overwrite, NULL)
+{
+	struct fixture *f = data;
+	unsigned n;
+	(void)params;
+	SETUP_TRACER(1, 2);
+	TRACE(QUERY);
+	TRACE(EXEC);
+	TRACE(PREPARE);
+	n = tracer__drain(&f->tracer, f->spans, 8);
+	munit_assert_int(n, ==, 2);
+	munit_assert_ullong(f->spans[0].id, ==, 2);
+	munit_assert_ullong(f->spans[1].id, ==, 3);
+	return MUNIT_OK;
+}